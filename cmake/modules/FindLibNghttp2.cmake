@@ -0,0 +1,32 @@
+# - Try to find the nghttp2 library
+# Once done this will define
+#
+#  LIBNGHTTP2_FOUND - system has nghttp2
+#  LIBNGHTTP2_INCLUDE_DIR - the nghttp2 include directory
+#  LIBNGHTTP2_LIBRARIES - Link these to use nghttp2
+#
+# Redistribution and use is allowed according to the terms of the BSD license.
+# For details see the accompanying COPYING-CMAKE-SCRIPTS file.
+
+find_package(PkgConfig QUIET)
+if(PKG_CONFIG_FOUND)
+  pkg_check_modules(PC_LIBNGHTTP2 QUIET libnghttp2)
+endif()
+
+find_path(LIBNGHTTP2_INCLUDE_DIR
+  NAMES nghttp2/nghttp2.h
+  HINTS ${PC_LIBNGHTTP2_INCLUDE_DIRS}
+)
+
+find_library(LIBNGHTTP2_LIBRARIES
+  NAMES nghttp2
+  HINTS ${PC_LIBNGHTTP2_LIBRARY_DIRS}
+)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LibNghttp2
+  REQUIRED_VARS LIBNGHTTP2_LIBRARIES LIBNGHTTP2_INCLUDE_DIR
+  VERSION_VAR PC_LIBNGHTTP2_VERSION
+)
+
+mark_as_advanced(LIBNGHTTP2_INCLUDE_DIR LIBNGHTTP2_LIBRARIES)
@@ -21,41 +21,47 @@
 #include <algorithm>
 #include <string.h>
 
+#include <QtAlgorithms>
+#include <QtEndian>
+
 BitSet BitSet::null;
 
+namespace
+{
+// the bits first to last of a word, the first bit is the most significant one
+inline quint64 wordMask(quint32 first, quint32 last)
+{
+    return (~Q_UINT64_C(0) >> first) & (~Q_UINT64_C(0) << (63 - last));
+}
+}
+
 BitSet::BitSet(quint32 num_bits)
     : num_bits(num_bits)
     , data(nullptr)
+    , num_on(0)
 {
-    num_bytes = (num_bits / 8) + ((num_bits % 8 > 0) ? 1 : 0);
-    data = new quint8[num_bytes];
-    std::fill(data, data + num_bytes, 0x00);
-    num_on = 0;
+    allocate();
 }
 
 BitSet::BitSet(const quint8 *d, quint32 num_bits)
     : num_bits(num_bits)
     , data(nullptr)
+    , num_on(0)
 {
-    num_bytes = (num_bits / 8) + ((num_bits % 8 > 0) ? 1 : 0);
-    data = new quint8[num_bytes];
+    allocate();
     memcpy(data, d, num_bytes);
-    num_on = 0;
-    quint32 i = 0;
-    while (i < num_bits) {
-        if (get(i))
-            num_on++;
-        i++;
+    clearPadding();
+    for (quint32 i = 0; i < num_words; ++i) {
+        num_on += qPopulationCount(word(i));
     }
 }
 
 BitSet::BitSet(const BitSet &bs)
     : num_bits(bs.num_bits)
-    , num_bytes(bs.num_bytes)
     , data(nullptr)
     , num_on(bs.num_on)
 {
-    data = new quint8[num_bytes];
+    allocate();
     std::copy(bs.data, bs.data + num_bytes, data);
 }
 
@@ -64,13 +70,39 @@ BitSet::~BitSet()
     delete[] data;
 }
 
+void BitSet::allocate()
+{
+    num_bytes = (num_bits / 8) + ((num_bits % 8 > 0) ? 1 : 0);
+    num_words = (num_bytes / 8) + ((num_bytes % 8 > 0) ? 1 : 0);
+    data = new quint8[num_words * 8];
+    std::fill(data, data + num_words * 8, 0x00);
+}
+
+void BitSet::clearPadding()
+{
+    if (num_bits % 8) {
+        data[num_bytes - 1] &= quint8(0xFF << (8 - num_bits % 8));
+    }
+}
+
+quint64 BitSet::word(quint32 i) const
+{
+    return qFromBigEndian<quint64>(data + i * 8);
+}
+
+void BitSet::setWord(quint32 i, quint64 value)
+{
+    qToBigEndian<quint64>(value, data + i * 8);
+}
+
 BitSet &BitSet::operator=(const BitSet &bs)
 {
-    if (data)
-        delete[] data;
-    num_bytes = bs.num_bytes;
+    if (this == &bs)
+        return *this;
+
+    delete[] data;
     num_bits = bs.num_bits;
-    data = new quint8[num_bytes];
+    allocate();
     std::copy(bs.data, bs.data + num_bytes, data);
     num_on = bs.num_on;
     return *this;
@@ -79,38 +111,59 @@ BitSet &BitSet::operator=(const BitSet &bs)
 void BitSet::setAll(bool on)
 {
     std::fill(data, data + num_bytes, on ? 0xFF : 0x00);
+    clearPadding();
     num_on = on ? num_bits : 0;
 }
 
-void BitSet::getContinuousRange(qint32 *start, qint32 *end, bool on)
+void BitSet::setRange(quint32 start, quint32 end, bool value)
 {
-    *start = -1;
-    *end = -1;
-
-    const bool nothingFound = on ? allOff() : allOn();
-    if (nothingFound) {
+    if ((start >= num_bits) || (end >= num_bits) || (start > end)) {
         return;
     }
 
-    const bool everythingMatches = on ? allOn() : allOff();
-    if (everythingMatches) {
-        *start = 0;
-        *end = num_bits - 1;
-        return;
+    const quint32 firstWord = start / 64;
+    const quint32 lastWord = end / 64;
+    for (quint32 i = firstWord; i <= lastWord; ++i) {
+        const quint64 mask = wordMask(i == firstWord ? start % 64 : 0, i == lastWord ? end % 64 : 63);
+        const quint64 oldWord = word(i);
+        const quint64 newWord = (value ? (oldWord | mask) : (oldWord & ~mask));
+        if (newWord != oldWord) {
+            num_on += qPopulationCount(newWord) - qPopulationCount(oldWord);
+            setWord(i, newWord);
+        }
     }
+}
 
-    for (quint32 i = 0; i < num_bits; ++i) {
-        if (get(i) == on) {
-            if (*start == -1) {
-                *start = i;
-            }
-            *end = i;
-        } else {
-            if (*start != -1) {
-                return;
-            }
+qint32 BitSet::findNext(quint32 from, bool on) const
+{
+    if (from >= num_bits) {
+        return -1;
+    }
+
+    quint32 i = from / 64;
+    quint64 current = (on ? word(i) : ~word(i)) & (~Q_UINT64_C(0) >> (from % 64));
+    while (!current) {
+        if (++i >= num_words) {
+            return -1;
         }
+        current = (on ? word(i) : ~word(i));
+    }
+
+    // the padding is off, so searching for off bits can end up there
+    const quint32 found = i * 64 + qCountLeadingZeroBits(current);
+    return (found < num_bits ? static_cast<qint32>(found) : -1);
+}
+
+void BitSet::getContinuousRange(qint32 *start, qint32 *end, bool on)
+{
+    *start = findNext(0, on);
+    *end = -1;
+    if (*start == -1) {
+        return;
     }
+
+    const qint32 next = findNext(*start, !on);
+    *end = (next == -1 ? num_bits - 1 : next - 1);
 }
 
 void BitSet::clear()
@@ -120,11 +173,20 @@ void BitSet::clear()
 
 void BitSet::orBitSet(const BitSet &other)
 {
-    quint32 i = 0;
-    while (i < num_bits) {
-        bool val = get(i) || other.get(i);
-        set(i, val);
-        i++;
+    const quint32 words = std::min(num_words, other.num_words);
+    for (quint32 i = 0; i < words; ++i) {
+        quint64 otherWord = other.word(i);
+        // bits of other that this one does not have
+        if ((i == num_words - 1) && (num_bits % 64)) {
+            otherWord &= wordMask(0, num_bits % 64 - 1);
+        }
+
+        const quint64 oldWord = word(i);
+        const quint64 newWord = oldWord | otherWord;
+        if (newWord != oldWord) {
+            num_on += qPopulationCount(newWord) - qPopulationCount(oldWord);
+            setWord(i, newWord);
+        }
     }
 }
 
@@ -28,10 +28,14 @@
  *
  * Simple implementation of a BitSet, can only turn on and off bits.
  * BitSet's are used to indicate which chunks we have or not.
+ *
+ * The bits are stored most significant bit first in bytes, see getData(). Operations on
+ * ranges and searches work on 64 bit words, the data is padded to a multiple of 8 bytes
+ * and unused bits are always 0.
  */
 class KGET_EXPORT BitSet
 {
-    quint32 num_bits, num_bytes;
+    quint32 num_bits, num_bytes, num_words;
     quint8 *data;
     quint32 num_on;
 
@@ -110,6 +114,14 @@ public:
         return num_on;
     }
 
+    /**
+     * Finds the next bit that is on/off
+     * @param from the first bit to look at
+     * @param on whether a bit that is on (set) or off (not set) should be searched for
+     * @return the index of the bit or -1 if there is none
+     */
+    qint32 findNext(quint32 from, bool on) const;
+
     /**
      * Finds a continuous range of bits that on/off
      * @param start here the start bit will be stored, -1 if nothing is found
@@ -156,6 +168,16 @@ public:
     }
 
     static BitSet null;
+
+private:
+    /// Allocates data for num_bits and fills it with 0
+    void allocate();
+
+    /// Sets the unused bits of the last byte to 0
+    void clearPadding();
+
+    quint64 word(quint32 i) const;
+    void setWord(quint32 i, quint64 value);
 };
 
 inline bool BitSet::get(quint32 i) const
@@ -186,15 +208,4 @@ inline void BitSet::set(quint32 i, bool on)
     }
 }
 
-inline void BitSet::setRange(quint32 start, quint32 end, bool value)
-{
-    if ((start >= num_bits) || (end >= num_bits)) {
-        return;
-    }
-
-    for (quint32 i = start; i <= end; ++i) {
-        set(i, value);
-    }
-}
-
 #endif
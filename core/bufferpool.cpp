@@ -0,0 +1,114 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+#include "bufferpool.h"
+
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+
+// smaller buffers are not worth keeping, they are cheap to allocate
+const int MIN_POOLED_CAPACITY = 16 * 1024;
+// the memory that is kept at most, buffers beyond that are freed
+const qint64 MAX_POOLED_BYTES = 64 * 1024 * 1024;
+
+Q_GLOBAL_STATIC(BufferPool, bufferPool)
+
+class BufferPool::Private
+{
+public:
+    QByteArray acquire(int capacity);
+    void release(QByteArray &buffer);
+
+    QMutex mutex;
+    QList<QByteArray> buffers; ///< only referenced by the pool
+    qint64 pooledBytes = 0;
+};
+
+QByteArray BufferPool::Private::acquire(int capacity)
+{
+    QByteArray buffer;
+    {
+        QMutexLocker locker(&mutex);
+        // the smallest buffer that is large enough, so that big ones stay available
+        int best = -1;
+        for (int i = 0; i < buffers.count(); ++i) {
+            const int available = buffers.at(i).capacity();
+            if ((available >= capacity) && ((best == -1) || (available < buffers.at(best).capacity()))) {
+                best = i;
+            }
+        }
+        if (best != -1) {
+            buffer = buffers.takeAt(best);
+            pooledBytes -= buffer.capacity();
+        }
+    }
+
+    // marks the capacity as reserved, so that emptying the buffer keeps the memory
+    buffer.reserve(qMax(capacity, buffer.capacity()));
+    buffer.truncate(0);
+    return buffer;
+}
+
+void BufferPool::Private::release(QByteArray &buffer)
+{
+    // only the memory of buffers nobody else uses can be reused
+    if (!buffer.isDetached() || (buffer.capacity() < MIN_POOLED_CAPACITY)) {
+        buffer = QByteArray();
+        return;
+    }
+
+    QMutexLocker locker(&mutex);
+    const int capacity = buffer.capacity();
+    // free the oldest buffers to make room for the new one
+    while (!buffers.isEmpty() && (pooledBytes + capacity > MAX_POOLED_BYTES)) {
+        pooledBytes -= buffers.takeFirst().capacity();
+    }
+    if (pooledBytes + capacity <= MAX_POOLED_BYTES) {
+        buffers.append(buffer);
+        pooledBytes += capacity;
+    }
+    buffer = QByteArray();
+}
+
+BufferPool::BufferPool()
+    : d(new Private)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    delete d;
+}
+
+QByteArray BufferPool::acquire(int capacity)
+{
+    return bufferPool->d->acquire(capacity);
+}
+
+void BufferPool::release(QByteArray &buffer)
+{
+    // buffers can still be released by threads that end after the pool got destroyed
+    if (!bufferPool.isDestroyed()) {
+        bufferPool->d->release(buffer);
+    } else {
+        buffer = QByteArray();
+    }
+}
+
+qint64 BufferPool::pooledBytes()
+{
+    QMutexLocker locker(&bufferPool->d->mutex);
+    return bufferPool->d->pooledBytes;
+}
+
+void BufferPool::clear()
+{
+    QMutexLocker locker(&bufferPool->d->mutex);
+    bufferPool->d->buffers.clear();
+    bufferPool->d->pooledBytes = 0;
+}
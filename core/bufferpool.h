@@ -0,0 +1,57 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+#ifndef KGET_BUFFER_POOL_H
+#define KGET_BUFFER_POOL_H
+
+#include "kget_export.h"
+
+#include <QByteArray>
+
+/**
+ * Keeps the memory of received data around so that it can be reused for the
+ * next data, instead of allocating and growing new buffers all the time.
+ *
+ * A buffer is handed on without copying it, whoever gets rid of it last, e.g. after it
+ * has been written, releases it. As QByteArray is implicitly shared a buffer is only
+ * reused once nobody references its data anymore. The pool is shared by all transfers
+ * and can be used from any thread.
+ */
+class KGET_EXPORT BufferPool
+{
+public:
+    BufferPool();
+    ~BufferPool();
+
+    /**
+     * @return an empty buffer that can hold at least capacity bytes without growing
+     */
+    static QByteArray acquire(int capacity);
+
+    /**
+     * Gives the memory of buffer back to the pool, buffer is empty afterwards
+     * @note buffers that are still referenced somewhere else or that are too small
+     * to be of use are simply dropped
+     */
+    static void release(QByteArray &buffer);
+
+    /**
+     * @return the number of bytes that are kept for reuse
+     */
+    static qint64 pooledBytes();
+
+    /**
+     * Frees all buffers of the pool
+     */
+    static void clear();
+
+private:
+    class Private;
+    Private *d;
+};
+
+#endif
@@ -10,6 +10,8 @@
 */
 #include "datasourcefactory.h"
 #include "bitset.h"
+#include "bufferpool.h"
+#include "filewriterthread.h"
 #include "settings.h"
 
 #include "core/filedeleter.h"
@@ -17,14 +19,18 @@
 #include "core/signature.h"
 #include "core/verifier.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 
+#include <QDataStream>
 #include <QDir>
 #include <QDomText>
+#include <QFile>
+#include <QStorageInfo>
 #include <QTimer>
-#include <QVarLengthArray>
 
-#include <KIO/FileJob>
+#include <KIO/FileCopyJob>
 #include <KLocalizedString>
 #include <KMessageBox>
 #include <KMountPoint>
@@ -33,7 +39,31 @@
 
 #include <qplatformdefs.h>
 
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 const int SPEEDTIMER = 1000; // 1 second...
+const KIO::fileoffset_t WRITE_ALIGNMENT = 64 * 1024;
+const KIO::fileoffset_t MIN_SEGMENT_SIZE = 128 * 1024;
+const KIO::fileoffset_t MAX_SEGMENT_SIZE = 16 * 1024 * 1024;
+const int SEGMENTS_PER_CONNECTION = 16; // so that there is something left to split between connections
+const int MAX_SEGMENTS = 4096;
+const int SEGMENT_DURATION = 5; // seconds a single connection should need for a segment
+const qreal STATISTICS_WEIGHT = 0.3; // weight of a new value in the averages of the TransferDataSources
+const int MIN_SOURCE_UPDATES = 20; // seconds a TransferDataSource is downloading before it can be replaced
+const qreal SLOW_SOURCE_FACTOR = 0.1; // slower than this compared to the best TransferDataSource is slow
+const int SLOW_SOURCE_UPDATES = 10; // seconds a TransferDataSource has to be slow before it is replaced
+const int MIN_SPEED_UPDATES = 5; // seconds a TransferDataSource is downloading before its speed per connection is remembered
+const int CONTROL_FILE_DELAY = 1000; // changes within that time are recorded in the control file at once
+const quint32 CONTROL_FILE_MAGIC = 0x4B474354; // "KGCT"
+const quint32 CONTROL_FILE_VERSION = 1;
+
+// the speed of a single connection to each host as measured by the last download from it,
+// the segment size has to be chosen before the connections of a new download got fast
+typedef QHash<QString, qreal> HostSpeeds;
+Q_GLOBAL_STATIC(HostSpeeds, hostConnectionSpeeds)
 
 DataSourceFactory::DataSourceFactory(QObject *parent, const QUrl &dest, KIO::filesize_t size, KIO::fileoffset_t segSize)
     : QObject(parent)
@@ -44,13 +74,24 @@ DataSourceFactory::DataSourceFactory(QObject *parent, const QUrl &dest, KIO::fil
     , m_segSize(segSize)
     , m_speed(0)
     , m_percent(0)
-    , m_tempOffset(0)
+    , m_cachedBytes(0)
+    , m_flushTimer(nullptr)
+    , m_writeCount(0)
+    , m_writtenBytes(0)
+    , m_mappedFile(nullptr)
+    , m_map(nullptr)
+    , m_spaceReserved(false)
     , m_startedChunks(nullptr)
     , m_finishedChunks(nullptr)
-    , m_putJob(nullptr)
+    , m_writer(nullptr)
+    , m_pendingVerifications(0)
+    , m_freeChunkCount(0)
+    , m_duplicateBytes(0)
+    , m_controlTimer(nullptr)
+    , m_pendingWrites(0)
+    , m_dataRefused(false)
     , m_doDownload(true)
     , m_open(false)
-    , m_blocked(false)
     , m_startTried(false)
     , m_findFilesizeTried(false)
     , m_assignTried(false)
@@ -74,7 +115,7 @@ DataSourceFactory::DataSourceFactory(QObject *parent, const QUrl &dest, KIO::fil
 
 DataSourceFactory::~DataSourceFactory()
 {
-    killPutJob();
+    closeFile();
     delete m_startedChunks;
     delete m_finishedChunks;
 }
@@ -91,11 +132,14 @@ void DataSourceFactory::init()
         connect(m_speedTimer, &QTimer::timeout, this, &DataSourceFactory::speedChanged);
     }
 
+    chooseSegmentSize();
+
     if (m_segSize && m_size) {
         const int hasRemainder = (m_size % m_segSize == 0) ? 0 : 1;
         const int bitSetSize = (m_size / m_segSize) + hasRemainder; // round up if needed
         if (!m_startedChunks && bitSetSize) {
             m_startedChunks = new BitSet(bitSetSize);
+            resetFreeChunks();
         }
         if (!m_finishedChunks && bitSetSize) {
             m_finishedChunks = new BitSet(bitSetSize);
@@ -105,6 +149,11 @@ void DataSourceFactory::init()
 
 void DataSourceFactory::deinit()
 {
+    if (m_downloadInitialized) {
+        // so that nothing gets recorded in the control file anymore
+        closeFile();
+        removeControlFile();
+    }
     if (m_downloadInitialized && QFile::exists(m_dest.toLocalFile())) {
         FileDeleter::deleteFile(m_dest);
     }
@@ -116,6 +165,7 @@ void DataSourceFactory::findFileSize()
     if (!m_size && !m_dest.isEmpty() && !m_sources.isEmpty()) {
         foreach (TransferDataSource *source, m_sources) {
             if (source->capabilities() & Transfer::Cap_FindFilesize) {
+                connect(source, &TransferDataSource::segmentSizeNeeded, this, &DataSourceFactory::slotSegmentSizeNeeded);
                 connect(source, &TransferDataSource::foundFileSize, this, &DataSourceFactory::slotFoundFileSize);
                 connect(source, &TransferDataSource::finishedDownload, this, &DataSourceFactory::slotFinishedDownload);
 
@@ -137,8 +187,13 @@ void DataSourceFactory::slotFoundFileSize(TransferDataSource *source, KIO::files
 
     init();
 
+    if (!preallocate()) {
+        return;
+    }
+    mapFile();
+
     if ((segmentRange.first != -1) && (segmentRange.second != -1)) {
-        m_startedChunks->setRange(segmentRange.first, segmentRange.second, true);
+        setChunksStarted(segmentRange.first, segmentRange.second, true);
     }
 
     if (m_startTried) {
@@ -146,6 +201,58 @@ void DataSourceFactory::slotFoundFileSize(TransferDataSource *source, KIO::files
     }
 }
 
+void DataSourceFactory::slotSegmentSizeNeeded(KIO::filesize_t fileSize, KIO::fileoffset_t &segmentSize)
+{
+    if (!m_size) {
+        m_size = fileSize;
+    }
+    chooseSegmentSize();
+    segmentSize = m_segSize;
+}
+
+KIO::fileoffset_t DataSourceFactory::automaticSegmentSize(KIO::filesize_t fileSize, int connections, ulong connectionSpeed)
+{
+    KIO::fileoffset_t segSize = fileSize / (qMax(connections, 1) * SEGMENTS_PER_CONNECTION);
+    if (connectionSpeed) {
+        segSize = qMin(segSize, static_cast<KIO::fileoffset_t>(connectionSpeed) * SEGMENT_DURATION);
+    }
+    segSize = qMax(segSize, static_cast<KIO::fileoffset_t>(fileSize / MAX_SEGMENTS));
+    segSize = qBound(MIN_SEGMENT_SIZE, segSize, MAX_SEGMENT_SIZE);
+
+    // aligned segments result in aligned writes
+    return ((segSize + WRITE_ALIGNMENT - 1) / WRITE_ALIGNMENT) * WRITE_ALIGNMENT;
+}
+
+void DataSourceFactory::chooseSegmentSize()
+{
+    if (m_segSize || !m_size || m_startedChunks || m_finishedChunks) {
+        return;
+    }
+
+    int connections = 0;
+    foreach (TransferDataSource *source, m_sources) {
+        connections += source->parallelSegments();
+    }
+    connections = qMax(connections, 1);
+
+    // nothing has been downloaded yet when the size is needed, so only earlier downloads
+    // from the same hosts tell how fast a connection is; otherwise it is unknown
+    qreal speed = 0;
+    int knownHosts = 0;
+    foreach (TransferDataSource *source, m_sources) {
+        const qreal hostSpeed = hostConnectionSpeeds()->value(source->sourceUrl().host().toLower());
+        if (hostSpeed > 0) {
+            speed += hostSpeed;
+            ++knownHosts;
+        }
+    }
+    const ulong connectionSpeed = (knownHosts ? speed / knownHosts : 0);
+
+    m_segSize = automaticSegmentSize(m_size, connections, connectionSpeed);
+    qCDebug(KGET_DEBUG) << "Using a segment size of" << m_segSize << "for" << m_size << "bytes and" << connections << "connections with" << connectionSpeed
+                        << "bytes/s each";
+}
+
 void DataSourceFactory::slotFinishedDownload(TransferDataSource *source, KIO::filesize_t size)
 {
     Q_UNUSED(source)
@@ -153,6 +260,8 @@ void DataSourceFactory::slotFinishedDownload(TransferDataSource *source, KIO::fi
 
     m_speedTimer->stop();
     m_finished = true;
+    flushCache();
+    QTimer::singleShot(0, this, &DataSourceFactory::checkFinished);
 }
 
 bool DataSourceFactory::checkLocalFile()
@@ -191,6 +300,12 @@ void DataSourceFactory::start()
         return;
     }
 
+    // an interrupted download of the same file, e.g. because of a crash, is resumed
+    if (!m_downloadInitialized && (!m_finishedChunks || !m_finishedChunks->numOnBits()) && loadControlFile()) {
+        qCDebug(KGET_DEBUG) << "Resuming the download from" << controlFileName();
+        m_downloadInitialized = true;
+    }
+
     // the file already exists, even though DataSourceFactory has not been initialized remove it
     // to avoid problems like over methods not finished removing it because of a redownload
     if (!m_downloadInitialized && QFile::exists(m_dest.toLocalFile())) {
@@ -205,15 +320,7 @@ void DataSourceFactory::start()
     // create all dirs needed
     QDir dir;
     dir.mkpath(m_dest.adjusted(QUrl::RemoveFilename).toLocalFile());
-    if (checkLocalFile()) {
-        if (!m_putJob) {
-            m_putJob = KIO::open(m_dest, QIODevice::WriteOnly | QIODevice::ReadOnly);
-            connect(m_putJob, &KIO::FileJob::open, this, &DataSourceFactory::slotOpen);
-            connect(m_putJob, &QObject::destroyed, this, &DataSourceFactory::slotPutJobDestroyed);
-            m_startTried = true;
-            return;
-        }
-    } else {
+    if (!checkLocalFile() || !openFile()) {
         // could not create file, maybe device not mounted so abort
         m_startTried = true;
         changeStatus(Job::Aborted);
@@ -222,11 +329,6 @@ void DataSourceFactory::start()
 
     init();
 
-    if (!m_open) {
-        m_startTried = true;
-        return;
-    }
-
     if (!m_size) {
         if (!m_findFilesizeTried && m_sources.count()) {
             m_findFilesizeTried = true;
@@ -236,6 +338,12 @@ void DataSourceFactory::start()
         return;
     }
 
+    // reserve the space before any data gets downloaded
+    if (!preallocate()) {
+        return;
+    }
+    mapFile();
+
     if (assignNeeded()) {
         if (m_sources.count()) {
             qCDebug(KGET_DEBUG) << "Assigning a TransferDataSource.";
@@ -270,7 +378,6 @@ void DataSourceFactory::start()
             }
         }
 
-        QFile::resize(m_dest.toLocalFile(), m_size); // TODO should we keep that?
         m_speedTimer->start();
 
         foreach (TransferDataSource *source, m_sources) {
@@ -292,22 +399,48 @@ void DataSourceFactory::slotRemovedFile()
     }
 }
 
-void DataSourceFactory::slotOpen(KIO::Job *job)
+bool DataSourceFactory::openFile()
 {
-    Q_UNUSED(job)
-    qCDebug(KGET_DEBUG) << "File opened" << this;
+    if (m_writer) {
+        return true;
+    }
 
-    if (!m_speedTimer) {
-        init();
+    m_writer = new FileWriterThread(m_dest.toLocalFile(), this);
+
+    // calculate the checksum for the automatic verification while downloading
+    QList<QPair<KIO::fileoffset_t, KIO::filesize_t>> existing;
+    if (Settings::checksumAutomaticVerification() && existingData(&existing)) {
+        const Checksum checksum = verifier()->availableChecksum(static_cast<Verifier::ChecksumStrength>(Settings::checksumStrength()));
+        if (!checksum.first.isEmpty()) {
+            m_writer->setHashing(checksum.first, Verifier::hashAlgorithm(checksum.first), existing);
+        }
+    }
+
+    if (!m_writer->open()) {
+        delete m_writer;
+        m_writer = nullptr;
+        return false;
     }
 
-    connect(m_putJob, &KIO::FileJob::position, this, &DataSourceFactory::slotOffset);
-    connect(m_putJob, &KIO::FileJob::written, this, &DataSourceFactory::slotDataWritten);
+    qCDebug(KGET_DEBUG) << "File opened" << this;
+    connect(m_writer, &FileWriterThread::written, this, &DataSourceFactory::slotDataWritten);
+    connect(m_writer, &FileWriterThread::error, this, &DataSourceFactory::slotWriteError);
+    connect(m_writer, &FileWriterThread::pieceVerified, this, &DataSourceFactory::slotPieceVerified);
     m_open = true;
 
-    if (m_startTried) {
-        start();
+    if (!m_flushTimer) {
+        m_flushTimer = new QTimer(this);
+        m_flushTimer->setSingleShot(true);
+        connect(m_flushTimer, &QTimer::timeout, this, &DataSourceFactory::flushCache);
     }
+    if (!m_controlTimer) {
+        m_controlTimer = new QTimer(this);
+        m_controlTimer->setSingleShot(true);
+        m_controlTimer->setInterval(CONTROL_FILE_DELAY);
+        connect(m_controlTimer, &QTimer::timeout, this, &DataSourceFactory::syncControlFile);
+    }
+
+    return true;
 }
 
 void DataSourceFactory::stop()
@@ -324,6 +457,12 @@ void DataSourceFactory::stop()
     foreach (TransferDataSource *source, m_sources) {
         source->stop();
     }
+    // stopping removes the duplicate connections
+    m_duplicatedChunks.clear();
+    for (auto it = m_sourceStatistics.begin(); it != m_sourceStatistics.end(); ++it) {
+        it->receivedBytes = 0;
+        it->connectionSpeeds.clear();
+    }
     m_startTried = false;
     m_findFilesizeTried = false;
     changeStatus(Job::Stopped);
@@ -386,7 +525,7 @@ void DataSourceFactory::addMirror(const QUrl &url, bool used, int numParallelCon
                     const int start = removed.first;
                     const int end = removed.second;
                     if ((start != -1) && (end != -1)) {
-                        m_startedChunks->setRange(start, end, false);
+                        setChunksStarted(start, end, false);
                     }
                 }
             }
@@ -417,19 +556,24 @@ void DataSourceFactory::addMirror(const QUrl &url, bool used, int numParallelCon
                     connect(source, &TransferDataSource::broken, this, &DataSourceFactory::broken);
                     connect(source, &TransferDataSource::finishedSegment, this, &DataSourceFactory::finishedSegment);
                     connect(source, SIGNAL(data(KIO::fileoffset_t, QByteArray, bool &)), this, SLOT(slotWriteData(KIO::fileoffset_t, QByteArray, bool &)));
+                    connect(source, &TransferDataSource::duplicateData, this, &DataSourceFactory::slotWriteDuplicateData);
                     connect(source,
-                            SIGNAL(freeSegments(TransferDataSource *, QPair<int, int>)),
+                            SIGNAL(freeSegments(TransferDataSource *, QPair<int, int>, bool)),
                             this,
-                            SLOT(slotFreeSegments(TransferDataSource *, QPair<int, int>)));
+                            SLOT(slotFreeSegments(TransferDataSource *, QPair<int, int>, bool)));
+                    connect(source, &TransferDataSource::connectionSpeeds, this, &DataSourceFactory::slotConnectionSpeeds);
                     connect(source, &TransferDataSource::log, this, &DataSourceFactory::log);
                     connect(source, &TransferDataSource::urlChanged, this, &DataSourceFactory::slotUrlChanged);
+                    connect(source, &TransferDataSource::validators, this, &DataSourceFactory::slotValidators);
+                    connect(source, &TransferDataSource::timeToFirstByte, this, &DataSourceFactory::slotTimeToFirstByte);
+                    connect(source, &TransferDataSource::requestSegments, this, &DataSourceFactory::slotRequestSegments);
 
                     slotUpdateCapabilities();
 
                     assignSegments(source);
 
                     // the job is already running, so also start the TransferDataSource
-                    if (!m_assignTried && !m_startTried && m_putJob && m_open && (m_status == Job::Running)) {
+                    if (!m_assignTried && !m_startTried && m_writer && m_open && (m_status == Job::Running)) {
                         source->start();
                     }
                 } else {
@@ -462,6 +606,43 @@ void DataSourceFactory::slotUrlChanged(const QUrl &old, const QUrl &newUrl)
     Q_EMIT dataSourceFactoryChange(Transfer::Tc_Source | Transfer::Tc_FileName);
 }
 
+void DataSourceFactory::slotValidators(TransferDataSource *source, const QString &etag, const QString &lastModified)
+{
+    // weak ETags do not guarantee that the bytes are the same, so they are of no use for ranges
+    const QString strongEtag = (etag.startsWith(QLatin1String("W/")) ? QString() : etag);
+    if (strongEtag.isEmpty() && lastModified.isEmpty()) {
+        return;
+    }
+
+    const QUrl url = source->sourceUrl();
+    const QPair<QString, QString> known = m_validators.value(url);
+    m_validators[url] = qMakePair(strongEtag, lastModified);
+
+    const bool etagChanged = !strongEtag.isEmpty() && !known.first.isEmpty() && (strongEtag != known.first);
+    const bool dateChanged = !lastModified.isEmpty() && !known.second.isEmpty() && (lastModified != known.second);
+    if (!etagChanged && !dateChanged) {
+        return;
+    }
+
+    qCWarning(KGET_DEBUG) << url << "changed, validators" << known << "are now" << m_validators.value(url);
+    Q_EMIT log(i18n("The file changed on %1, it will be downloaded again.", url.toString()), Transfer::Log_Warning);
+
+    // the source is still emitting, so it must not be removed right away
+    QTimer::singleShot(0, this, &DataSourceFactory::redownload);
+}
+
+void DataSourceFactory::redownload()
+{
+    if (m_movingFile || (m_status == Job::Finished)) {
+        return;
+    }
+
+    // the new writer must not hash any of the old data
+    closeFile();
+    removeControlFile();
+    slotRepair(QList<KIO::fileoffset_t>(), 0);
+}
+
 void DataSourceFactory::removeMirror(const QUrl &url)
 {
     qCDebug(KGET_DEBUG) << "Removing mirror: " << url;
@@ -472,13 +653,15 @@ void DataSourceFactory::removeMirror(const QUrl &url)
         m_sources.remove(url);
         m_unusedUrls.append(url);
         m_unusedConnections.append(source->parallelSegments());
+        std::replace(m_chunkSources.begin(), m_chunkSources.end(), source, static_cast<TransferDataSource *>(nullptr));
+        m_sourceStatistics.remove(source);
         delete source;
 
         for (int i = 0; i < assigned.count(); ++i) {
             const int start = assigned[i].first;
             const int end = assigned[i].second;
             if ((start != -1) && (end != -1)) {
-                m_startedChunks->setRange(start, end, false);
+                setChunksStarted(start, end, false);
                 qCDebug(KGET_DEBUG) << "Segmentrange" << start << '-' << end << "not assigned anymore.";
             }
         }
@@ -555,14 +738,14 @@ void DataSourceFactory::brokenSegments(TransferDataSource *source, const QPair<i
 {
     qCDebug(KGET_DEBUG) << "Segments" << segmentRange << "broken," << source;
     if (!source || !m_startedChunks || !m_finishedChunks || (segmentRange.first < 0) || (segmentRange.second < 0)
-        || (static_cast<quint32>(segmentRange.second) > m_finishedChunks->getNumBits())) {
+        || (static_cast<quint32>(segmentRange.second) >= m_finishedChunks->getNumBits())) {
         return;
     }
 
     const int start = segmentRange.first;
     const int end = segmentRange.second;
     if ((start != -1) && (end != -1)) {
-        m_startedChunks->setRange(start, end, false);
+        setChunksStarted(start, end, false);
     }
 
     removeMirror(source->sourceUrl());
@@ -582,28 +765,73 @@ void DataSourceFactory::broken(TransferDataSource *source, TransferDataSource::E
     }
 }
 
-void DataSourceFactory::slotFreeSegments(TransferDataSource *source, QPair<int, int> segmentRange)
+void DataSourceFactory::slotFreeSegments(TransferDataSource *source, QPair<int, int> segmentRange, bool error)
 {
-    qCDebug(KGET_DEBUG) << "Segments freed:" << source << segmentRange;
+    qCDebug(KGET_DEBUG) << "Segments freed:" << source << segmentRange << "error:" << error;
+
+    // moving segments away from a stalled or slow connection is no fault of the mirror
+    if (error) {
+        ++m_sourceStatistics[source].errors;
+    }
 
     const int start = segmentRange.first;
     const int end = segmentRange.second;
     if ((start != -1) && (end != -1)) {
-        m_startedChunks->setRange(start, end, false);
+        setChunksStarted(start, end, false);
         qCDebug(KGET_DEBUG) << "Segmentrange" << start << '-' << end << "not assigned anymore.";
     }
 
     assignSegments(source);
 }
 
+void DataSourceFactory::slotConnectionSpeeds(TransferDataSource *source, const QList<double> &speeds, double &median)
+{
+    m_sourceStatistics[source].connectionSpeeds = speeds;
+
+    QList<double> all;
+    foreach (TransferDataSource *other, m_sources) {
+        all.append(m_sourceStatistics.value(other).connectionSpeeds);
+    }
+    median = 0;
+    if (all.count() >= 2) {
+        std::sort(all.begin(), all.end());
+        median = all[all.count() / 2];
+    }
+}
+
 void DataSourceFactory::finishedSegment(TransferDataSource *source, int segmentNumber, bool connectionFinished)
 {
-    if (!source || (segmentNumber < 0) || (static_cast<quint32>(segmentNumber) > m_finishedChunks->getNumBits())) {
+    if (!source || (segmentNumber < 0) || (static_cast<quint32>(segmentNumber) >= m_finishedChunks->getNumBits())) {
         qCDebug(KGET_DEBUG) << "Incorrect data";
         return;
     }
 
     m_finishedChunks->set(segmentNumber, true);
+    scheduleControlFileUpdate();
+
+#ifdef Q_OS_UNIX
+    // start writing the mapped data of the chunk back to the disk
+    if (m_map) {
+        const KIO::fileoffset_t pageSize = sysconf(_SC_PAGESIZE);
+        const KIO::fileoffset_t chunkStart = static_cast<KIO::fileoffset_t>(segmentNumber) * m_segSize;
+        const KIO::fileoffset_t start = chunkStart - (chunkStart % pageSize);
+        const KIO::fileoffset_t end = qMin(chunkStart + m_segSize, static_cast<KIO::fileoffset_t>(m_size));
+        if (end > start) {
+            ::msync(m_map + start, end - start, MS_ASYNC);
+        }
+    }
+#endif
+
+    if (m_chunkSources.count() <= segmentNumber) {
+        m_chunkSources.resize(m_finishedChunks->getNumBits());
+    }
+    m_chunkSources[segmentNumber] = source;
+    verifyCompletedPieces(segmentNumber);
+
+    const bool duplicated = m_duplicatedChunks.contains(segmentNumber);
+    if (duplicated) {
+        finishDuplicatedChunk(segmentNumber);
+    }
 
     if (!connectionFinished) {
         qCDebug(KGET_DEBUG) << "Some segments still not finished";
@@ -613,10 +841,21 @@ void DataSourceFactory::finishedSegment(TransferDataSource *source, int segmentN
     m_finished = m_finishedChunks->allOn();
     if (m_finished) {
         qDebug() << "All segments have been downloaded.";
+        flushCache();
+        QTimer::singleShot(0, this, &DataSourceFactory::checkFinished);
         return;
     }
 
     assignSegments(source);
+
+    // the cancelled connection can work on something else now
+    if (duplicated) {
+        foreach (TransferDataSource *other, m_sources) {
+            if ((other != source) && (other->changeNeeded() > 0)) {
+                assignSegments(other);
+            }
+        }
+    }
 }
 
 void DataSourceFactory::assignSegments(TransferDataSource *source)
@@ -641,8 +880,8 @@ void DataSourceFactory::assignSegments(TransferDataSource *source)
     int newStart = -1;
     int newEnd = -1;
 
-    // a split needed
-    if (m_startedChunks->allOn()) {
+    // nothing is free anymore, so steal the unfinished segments at the end of the busiest connection
+    if (m_freeChunks.isEmpty()) {
         int unfinished = 0;
         TransferDataSource *target = nullptr;
         foreach (TransferDataSource *source, m_sources) {
@@ -653,6 +892,9 @@ void DataSourceFactory::assignSegments(TransferDataSource *source)
             }
         }
         if (!unfinished || !target) {
+            if (duplicateChunk(source) && (source->changeNeeded() > 0)) {
+                assignSegments(source);
+            }
             return;
         }
 
@@ -660,7 +902,8 @@ void DataSourceFactory::assignSegments(TransferDataSource *source)
         newStart = splitResult.first;
         newEnd = splitResult.second;
     } else {
-        m_startedChunks->getContinuousRange(&newStart, &newEnd, false);
+        newStart = m_freeChunks.constBegin().key();
+        newEnd = qMin(m_freeChunks.constBegin().value(), newStart + chunkShare(source, false) - 1);
     }
 
     if ((newStart == -1) || (newEnd == -1)) {
@@ -674,58 +917,722 @@ void DataSourceFactory::assignSegments(TransferDataSource *source)
     const KIO::fileoffset_t lastSegSize = ((static_cast<uint>(newEnd + 1) == m_startedChunks->getNumBits() && rest) ? rest : m_segSize);
 
     qCDebug(KGET_DEBUG) << "Segments assigned:" << newStart << "-" << newEnd << "segment-size:" << m_segSize << "rest:" << rest;
-    m_startedChunks->setRange(newStart, newEnd, true);
+    setChunksStarted(newStart, newEnd, true);
     source->addSegments(qMakePair(m_segSize, lastSegSize), qMakePair(newStart, newEnd));
 
+    ++m_sourceStatistics[source].requests;
+
     // there should still be segments added to this transfer
     if (source->changeNeeded() > 0) {
         assignSegments(source);
     }
 }
 
+int DataSourceFactory::chunkShare(TransferDataSource *source, bool allConnections) const
+{
+    // every connection that needs segments gets a share of what is free according to the score of
+    // its TransferDataSource, the connections that finish first steal from the others later on
+    qreal totalWeight = 0;
+    foreach (TransferDataSource *other, m_sources) {
+        totalWeight += connectionWeight(other) * qMax(allConnections ? other->parallelSegments() : other->changeNeeded(), 0);
+    }
+    const qreal weight = connectionWeight(source);
+    return qMax(1, static_cast<int>(std::ceil(m_freeChunkCount * weight / qMax(totalWeight, weight))));
+}
+
+void DataSourceFactory::slotRequestSegments(TransferDataSource *source, int lastSegment)
+{
+    // only free chunks are handed out ahead of time, stealing happens once a connection is done
+    if (!m_startedChunks || !m_finishedChunks || m_freeChunks.isEmpty() || (m_status != Job::Running)) {
+        return;
+    }
+
+    // prefer the chunks right after the ones of the connection, so they can be requested at once
+    QMap<int, int>::const_iterator it = m_freeChunks.upperBound(lastSegment + 1);
+    int newStart = m_freeChunks.constBegin().key();
+    int rangeEnd = m_freeChunks.constBegin().value();
+    if (it != m_freeChunks.constBegin()) {
+        --it;
+        if (it.value() >= lastSegment + 1) {
+            newStart = lastSegment + 1;
+            rangeEnd = it.value();
+        }
+    }
+    const int newEnd = qMin(rangeEnd, newStart + chunkShare(source, true) - 1);
+
+    setChunksStarted(newStart, newEnd, true);
+    if (!source->addLookaheadSegments(qMakePair(m_segSize, static_cast<KIO::fileoffset_t>(chunkSize(newEnd))), qMakePair(newStart, newEnd))) {
+        setChunksStarted(newStart, newEnd, false);
+        return;
+    }
+    qCDebug(KGET_DEBUG) << "Segments assigned ahead:" << newStart << "-" << newEnd << "to" << source;
+    ++m_sourceStatistics[source].requests;
+}
+
+void DataSourceFactory::setChunksStarted(int start, int end, bool started)
+{
+    m_startedChunks->setRange(start, end, started);
+
+    // find the first free range that overlaps with or, when adding, touches start to end
+    QMap<int, int>::iterator it = m_freeChunks.upperBound(start);
+    if (it != m_freeChunks.begin()) {
+        QMap<int, int>::iterator prev = it;
+        --prev;
+        if (prev.value() >= start - (started ? 0 : 1)) {
+            it = prev;
+        }
+    }
+
+    int newStart = start;
+    int newEnd = end;
+    while ((it != m_freeChunks.end()) && (it.key() <= end + (started ? 0 : 1))) {
+        newStart = qMin(newStart, it.key());
+        newEnd = qMax(newEnd, it.value());
+        m_freeChunkCount -= it.value() - it.key() + 1;
+        it = m_freeChunks.erase(it);
+    }
+
+    if (!started) {
+        m_freeChunks.insert(newStart, newEnd);
+        m_freeChunkCount += newEnd - newStart + 1;
+        return;
+    }
+
+    // keep what was free before and after the started range
+    if (newStart < start) {
+        m_freeChunks.insert(newStart, start - 1);
+        m_freeChunkCount += start - newStart;
+    }
+    if (newEnd > end) {
+        m_freeChunks.insert(end + 1, newEnd);
+        m_freeChunkCount += newEnd - end;
+    }
+}
+
+void DataSourceFactory::resetFreeChunks()
+{
+    m_freeChunks.clear();
+    m_freeChunkCount = 0;
+
+    if (!m_startedChunks) {
+        return;
+    }
+
+    qint32 start = m_startedChunks->findNext(0, false);
+    while (start != -1) {
+        const qint32 next = m_startedChunks->findNext(start, true);
+        const qint32 end = (next == -1 ? static_cast<qint32>(m_startedChunks->getNumBits()) - 1 : next - 1);
+        m_freeChunks.insert(start, end);
+        m_freeChunkCount += end - start + 1;
+        start = (next == -1 ? -1 : m_startedChunks->findNext(next, false));
+    }
+}
+
+bool DataSourceFactory::duplicateChunk(TransferDataSource *source)
+{
+    // preferably duplicate a chunk of another mirror, to not depend on a single server,
+    // and among those the one of the worst mirror
+    int chunk = -1;
+    for (int pass = 0; (pass < 2) && (chunk == -1); ++pass) {
+        qreal worstScore = 0;
+        foreach (TransferDataSource *other, m_sources) {
+            if ((other == source) == !pass) {
+                continue;
+            }
+            const qreal score = sourceScore(other);
+            if ((chunk != -1) && (score >= worstScore)) {
+                continue;
+            }
+            foreach (const QPair<int, int> &range, other->assignedSegments()) {
+                if ((range.first != -1) && (range.first == range.second) && !m_finishedChunks->get(range.first) && !m_duplicatedChunks.contains(range.first)) {
+                    chunk = range.first;
+                    worstScore = score;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (chunk == -1) {
+        qCDebug(KGET_DEBUG) << "No chunk left to duplicate.";
+        return false;
+    }
+
+    if (!source->addDuplicateSegment(qMakePair(m_segSize, static_cast<KIO::fileoffset_t>(chunkSize(chunk))), chunk)) {
+        return false;
+    }
+
+    qCDebug(KGET_DEBUG) << "Endgame, chunk" << chunk << "is downloaded a second time by" << source;
+    m_duplicatedChunks.insert(chunk, 0);
+    return true;
+}
+
+void DataSourceFactory::finishDuplicatedChunk(int chunk)
+{
+    const KIO::filesize_t duplicated = m_duplicatedChunks.take(chunk);
+
+    // the connection that finished was removed already, so only the other one is cancelled
+    KIO::filesize_t cancelled = 0;
+    foreach (TransferDataSource *source, m_sources) {
+        cancelled += source->cancelSegment(chunk);
+    }
+
+    // the data of the duplicate connection is not counted, so if that one won the
+    // bytes of the cancelled connection are replaced with the whole chunk
+    const KIO::filesize_t size = chunkSize(chunk);
+    const bool duplicateWon = (duplicated >= size);
+    if (duplicateWon) {
+        m_downloadedSize += size - qMin(cancelled, size);
+        Q_EMIT dataSourceFactoryChange(Transfer::Tc_DownloadedSize);
+    }
+    qCDebug(KGET_DEBUG) << "Duplicated chunk" << chunk << "finished by the" << (duplicateWon ? "duplicate" : "original") << "connection";
+}
+
 // TODO implement checks if the correct offsets etc. are used + error recovering e.g. when something else
 // touches the file
 void DataSourceFactory::slotWriteData(KIO::fileoffset_t offset, const QByteArray &data, bool &worked)
 {
-    worked = !m_blocked && !m_movingFile && m_open;
-    if (m_blocked || m_movingFile || !m_open) {
+    // the disk can not keep up, the sources keep the data until resumeWriting() is called
+    worked = !m_movingFile && m_open && !(m_writer && m_writer->isBusy());
+    if (!worked) {
+        m_dataRefused = true;
         return;
     }
 
-    m_blocked = true;
-    m_tempOffset = offset;
-    m_tempData = data;
-    m_putJob->seek(offset);
+    addReceivedBytes(qobject_cast<TransferDataSource *>(sender()), data.size());
+    storeData(offset, data, true);
 }
 
-void DataSourceFactory::slotOffset(KIO::Job *job, KIO::filesize_t offset)
+void DataSourceFactory::slotWriteDuplicateData(KIO::fileoffset_t offset, const QByteArray &data, bool &worked)
 {
-    Q_UNUSED(job)
-    Q_UNUSED(offset)
+    worked = !m_movingFile && m_open && !(m_writer && m_writer->isBusy());
+    if (!worked) {
+        m_dataRefused = true;
+        return;
+    }
+    if (!m_segSize) {
+        return;
+    }
+
+    // the chunk has been finished by the other connection already
+    const int chunk = offset / m_segSize;
+    if (!m_duplicatedChunks.contains(chunk)) {
+        return;
+    }
 
-    m_putJob->write(m_tempData);
+    m_duplicatedChunks[chunk] += data.size();
+    addReceivedBytes(qobject_cast<TransferDataSource *>(sender()), data.size());
+    storeData(offset, data, false);
 }
 
-void DataSourceFactory::slotDataWritten(KIO::Job *job, KIO::filesize_t written)
+void DataSourceFactory::addReceivedBytes(TransferDataSource *source, KIO::filesize_t bytes)
 {
-    Q_UNUSED(job)
+    if (!source) {
+        return;
+    }
 
-    auto tempSize = static_cast<KIO::filesize_t>(m_tempData.size());
-    // the complete data has been written
-    if (written == tempSize) // TODO if not same cache it temporarily!
-    {
-        m_downloadedSize += written;
-        Q_EMIT dataSourceFactoryChange(Transfer::Tc_DownloadedSize);
-        //             m_tempCache.clear();
+    m_sourceStatistics[source].receivedBytes += bytes;
+}
+
+void DataSourceFactory::slotTimeToFirstByte(TransferDataSource *source, qint64 msecs)
+{
+    SourceStatistics &statistics = m_sourceStatistics[source];
+    statistics.timeToFirstByte = (statistics.timeToFirstByte ? STATISTICS_WEIGHT * msecs + (1 - STATISTICS_WEIGHT) * statistics.timeToFirstByte : msecs);
+}
+
+void DataSourceFactory::updateSourceStatistics()
+{
+    foreach (TransferDataSource *source, m_sources) {
+        SourceStatistics &statistics = m_sourceStatistics[source];
+        // sources that have nothing to do keep their speed
+        if (!source->currentSegments() && !statistics.receivedBytes) {
+            continue;
+        }
+
+        const qreal speed = statistics.receivedBytes * 1000.0 / SPEEDTIMER;
+        statistics.speed = (statistics.updates ? STATISTICS_WEIGHT * speed + (1 - STATISTICS_WEIGHT) * statistics.speed : speed);
+        statistics.receivedBytes = 0;
+        ++statistics.updates;
+
+        // remembered for the segment size of the next download from that host
+        if ((statistics.updates >= MIN_SPEED_UPDATES) && (source->currentSegments() > 0)) {
+            hostConnectionSpeeds()->insert(source->sourceUrl().host().toLower(), statistics.speed / source->currentSegments());
+        }
     }
 
-    if (m_finished) {
+    replaceSlowMirror();
+}
+
+qreal DataSourceFactory::sourceScore(TransferDataSource *source) const
+{
+    const SourceStatistics statistics = m_sourceStatistics.value(source);
+    if (!statistics.updates) {
+        return 0;
+    }
+
+    const qreal errorRate = (statistics.requests ? qMin(statistics.errors / static_cast<qreal>(statistics.requests), 1.0) : 0);
+    return statistics.speed * (1 - errorRate) / (1 + statistics.timeToFirstByte / 1000);
+}
+
+qreal DataSourceFactory::connectionWeight(TransferDataSource *source) const
+{
+    // sources without a score yet are treated like an average one
+    qreal total = 0;
+    int known = 0;
+    qreal weight = 0;
+    foreach (TransferDataSource *other, m_sources) {
+        const qreal score = sourceScore(other);
+        if (score > 0) {
+            const qreal otherWeight = score / qMax(other->parallelSegments(), 1);
+            total += otherWeight;
+            ++known;
+            if (other == source) {
+                weight = otherWeight;
+            }
+        }
+    }
+
+    if (weight > 0) {
+        return weight;
+    }
+    return (known ? total / known : 1);
+}
+
+void DataSourceFactory::replaceSlowMirror()
+{
+    if ((m_status != Job::Running) || m_unusedUrls.isEmpty() || (m_sources.count() < 2)) {
+        return;
+    }
+
+    qreal bestScore = 0;
+    foreach (TransferDataSource *source, m_sources) {
+        bestScore = qMax(bestScore, sourceScore(source));
+    }
+
+    TransferDataSource *slowest = nullptr;
+    foreach (TransferDataSource *source, m_sources) {
+        SourceStatistics &statistics = m_sourceStatistics[source];
+        if ((statistics.updates < MIN_SOURCE_UPDATES) || (sourceScore(source) >= bestScore * SLOW_SOURCE_FACTOR)) {
+            statistics.slowUpdates = 0;
+            continue;
+        }
+
+        if ((++statistics.slowUpdates >= SLOW_SOURCE_UPDATES) && (!slowest || (sourceScore(source) < sourceScore(slowest)))) {
+            slowest = source;
+        }
+    }
+
+    if (!slowest) {
+        return;
+    }
+
+    const QUrl url = m_unusedUrls.first();
+    const int connections = m_unusedConnections.first();
+    qCDebug(KGET_DEBUG) << "Replacing the slow mirror" << slowest->sourceUrl() << "with" << url;
+    Q_EMIT log(i18n("Replacing the slow mirror %1 with %2.", slowest->sourceUrl().toString(), url.toString()), Transfer::Log_Info);
+    removeMirror(slowest->sourceUrl());
+    if (m_sources.count() < m_maxMirrorsUsed) {
+        addMirror(url, connections);
+    }
+}
+
+void DataSourceFactory::storeData(KIO::fileoffset_t offset, const QByteArray &data, bool counted)
+{
+    if (m_map && (offset >= 0) && (static_cast<KIO::filesize_t>(offset + data.size()) <= m_size)) {
+        memcpy(m_map + offset, data.constData(), data.size());
+        m_writer->addStoredData(offset, data);
+        if (counted) {
+            m_downloadedSize += data.size();
+            Q_EMIT dataSourceFactoryChange(Transfer::Tc_DownloadedSize);
+        }
+        return;
+    }
+
+    if (!counted) {
+        m_duplicateBytes += data.size();
+    }
+    cacheData(offset, data);
+}
+
+void DataSourceFactory::cacheData(KIO::fileoffset_t offset, const QByteArray &data)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+
+    // data overlapping with cached data is rare (e.g. a segment got redownloaded), simply write
+    // the old data first so that the newer one ends up in the file
+    QMap<KIO::fileoffset_t, QByteArray>::iterator it = m_cache.lowerBound(offset);
+    if (it != m_cache.begin()) {
+        QMap<KIO::fileoffset_t, QByteArray>::iterator prev = it;
+        --prev;
+        if (prev.key() + prev->size() > offset) {
+            flushCacheEntry(prev, false);
+        }
+    }
+    it = m_cache.lowerBound(offset);
+    while ((it != m_cache.end()) && (it.key() < offset + data.size())) {
+        flushCacheEntry(it, false);
+        it = m_cache.lowerBound(offset);
+    }
+
+    m_cachedBytes += data.size();
+    it = m_cache.insert(offset, data);
+
+    // merge with the data ending where the new data starts
+    if (it != m_cache.begin()) {
+        QMap<KIO::fileoffset_t, QByteArray>::iterator prev = it;
+        --prev;
+        if (prev.key() + prev->size() == offset) {
+            appendCacheData(*prev, *it);
+            m_cache.erase(it);
+            it = prev;
+        }
+    }
+
+    // merge with the data starting where the new data ends
+    QMap<KIO::fileoffset_t, QByteArray>::iterator next = it;
+    ++next;
+    if ((next != m_cache.end()) && (it.key() + it->size() == next.key())) {
+        appendCacheData(*it, *next);
+        m_cache.erase(next);
+    }
+
+    const qint64 coalesceSize = static_cast<qint64>(Settings::writeCoalesceSize()) * 1024;
+    if (it->size() >= coalesceSize) {
+        flushCacheEntry(it, true);
+    }
+    // too many small pieces that can not be merged (yet)
+    if (m_cachedBytes >= 4 * coalesceSize) {
+        flushCache();
+    }
+
+    if (!m_cache.isEmpty() && !m_flushTimer->isActive()) {
+        m_flushTimer->start(Settings::writeFlushInterval());
+    }
+}
+
+void DataSourceFactory::appendCacheData(QByteArray &data, QByteArray &next)
+{
+    const int size = data.size() + next.size();
+    if (!data.isDetached() || (data.capacity() < size)) {
+        // collect the data in a buffer that can take a whole write, so that it is not copied again and again
+        const int coalesceSize = Settings::writeCoalesceSize() * 1024;
+        QByteArray merged = BufferPool::acquire(qMax(size, coalesceSize));
+        merged.append(data);
+        BufferPool::release(data);
+        data = merged;
+    }
+    data.append(next);
+    BufferPool::release(next);
+}
+
+void DataSourceFactory::flushCacheEntry(QMap<KIO::fileoffset_t, QByteArray>::iterator it, bool aligned)
+{
+    const KIO::fileoffset_t offset = it.key();
+    QByteArray data = it.value();
+    m_cache.erase(it);
+
+    if (aligned) {
+        const KIO::fileoffset_t alignedEnd = ((offset + data.size()) / WRITE_ALIGNMENT) * WRITE_ALIGNMENT;
+        if ((alignedEnd > offset) && (alignedEnd < offset + data.size())) {
+            const int length = alignedEnd - offset;
+            m_cache.insert(alignedEnd, data.mid(length));
+            data.truncate(length);
+        }
+    }
+
+    // the data is only queued, slotWriteData() refuses new data if the writer is too far behind
+    m_cachedBytes -= data.size();
+    ++m_pendingWrites;
+    m_writer->write(offset, data);
+}
+
+void DataSourceFactory::flushCacheRange(KIO::fileoffset_t start, KIO::fileoffset_t end)
+{
+    QMap<KIO::fileoffset_t, QByteArray>::iterator it = m_cache.lowerBound(start);
+    if (it != m_cache.begin()) {
+        QMap<KIO::fileoffset_t, QByteArray>::iterator prev = it;
+        --prev;
+        if (prev.key() + prev->size() > start) {
+            flushCacheEntry(prev, false);
+        }
+    }
+
+    it = m_cache.lowerBound(start);
+    while ((it != m_cache.end()) && (it.key() < end)) {
+        flushCacheEntry(it, false);
+        it = m_cache.lowerBound(start);
+    }
+}
+
+void DataSourceFactory::flushCache()
+{
+    if (m_flushTimer) {
+        m_flushTimer->stop();
+    }
+    if (!m_writer) {
+        return;
+    }
+
+    while (!m_cache.isEmpty()) {
+        flushCacheEntry(m_cache.begin(), false);
+    }
+}
+
+void DataSourceFactory::slotDataWritten(KIO::fileoffset_t offset, KIO::filesize_t written)
+{
+    Q_UNUSED(offset)
+
+    // writes queued before an error are still reported after m_pendingWrites got reset
+    if (m_pendingWrites > 0) {
+        --m_pendingWrites;
+    }
+    ++m_writeCount;
+    m_writtenBytes += written;
+
+    // written duplicate data is not counted
+    const KIO::filesize_t duplicate = qMin(written, m_duplicateBytes);
+    m_duplicateBytes -= duplicate;
+    m_downloadedSize += written - duplicate;
+    Q_EMIT dataSourceFactoryChange(Transfer::Tc_DownloadedSize);
+
+    if (m_dataRefused && m_writer && !m_writer->isBusy()) {
+        m_dataRefused = false;
+        // a source might get removed while handing on its data
+        foreach (const QUrl &url, m_sources.keys()) {
+            if (TransferDataSource *source = m_sources.value(url)) {
+                source->resumeWriting();
+            }
+        }
+    }
+
+    checkFinished();
+}
+
+void DataSourceFactory::checkFinished()
+{
+    if (m_finished && !m_pendingWrites && !m_pendingVerifications && m_cache.isEmpty() && (m_status != Job::Finished)) {
         m_speedTimer->stop();
-        killPutJob();
+        closeFile();
+        removeControlFile();
         changeStatus(Job::Finished);
     }
-    m_tempData.clear();
-    m_blocked = false;
+}
+
+KIO::filesize_t DataSourceFactory::chunkSize(int chunk) const
+{
+    const KIO::filesize_t offset = static_cast<KIO::filesize_t>(chunk) * m_segSize;
+    return (offset < m_size ? qMin(static_cast<KIO::filesize_t>(m_segSize), m_size - offset) : 0);
+}
+
+QPair<int, int> DataSourceFactory::chunkRange(KIO::fileoffset_t offset, KIO::filesize_t length) const
+{
+    if (!m_segSize || !length) {
+        return qMakePair(-1, -1);
+    }
+
+    return qMakePair(static_cast<int>(offset / m_segSize), static_cast<int>((offset + length - 1) / m_segSize));
+}
+
+void DataSourceFactory::verifyCompletedPieces(int chunk)
+{
+    if (!m_writer || !m_size || !m_finishedChunks) {
+        return;
+    }
+
+    const QPair<QString, PartialChecksums *> pieces = verifier()->availablePartialChecksum(static_cast<Verifier::ChecksumStrength>(Settings::checksumStrength()));
+    if (!pieces.second || !pieces.second->isValid()) {
+        return;
+    }
+
+    const KIO::filesize_t pieceLength = pieces.second->length();
+    const QStringList checksums = pieces.second->checksums();
+    const KIO::fileoffset_t chunkStart = static_cast<KIO::fileoffset_t>(chunk) * m_segSize;
+    const KIO::fileoffset_t chunkEnd = qMin(chunkStart + m_segSize, static_cast<KIO::fileoffset_t>(m_size));
+    const int firstPiece = chunkStart / pieceLength;
+    const int lastPiece = qMin(static_cast<int>((chunkEnd - 1) / pieceLength), checksums.count() - 1);
+
+    for (int piece = firstPiece; piece <= lastPiece; ++piece) {
+        const KIO::fileoffset_t offset = piece * pieceLength;
+        const KIO::filesize_t length = qMin(pieceLength, m_size - offset);
+        const QPair<int, int> chunks = chunkRange(offset, length);
+
+        bool complete = true;
+        for (int i = chunks.first; complete && (i <= chunks.second); ++i) {
+            complete = m_finishedChunks->get(i);
+        }
+        if (!complete) {
+            continue;
+        }
+
+        // the data of the piece has to be in the file before it can be checked
+        flushCacheRange(offset, offset + length);
+        ++m_pendingVerifications;
+        m_writer->verifyPiece(piece, offset, length, Verifier::hashAlgorithm(pieces.first), checksums.at(piece));
+    }
+}
+
+void DataSourceFactory::slotPieceVerified(int piece, bool verified)
+{
+    if (m_pendingVerifications > 0) {
+        --m_pendingVerifications;
+    }
+    if (verified || !m_startedChunks || !m_finishedChunks) {
+        checkFinished();
+        return;
+    }
+
+    const QPair<QString, PartialChecksums *> pieces = verifier()->availablePartialChecksum(static_cast<Verifier::ChecksumStrength>(Settings::checksumStrength()));
+    const KIO::fileoffset_t offset = (pieces.second ? piece * pieces.second->length() : m_size);
+    if (static_cast<KIO::filesize_t>(offset) >= m_size) {
+        checkFinished();
+        return;
+    }
+    const QPair<int, int> chunks = chunkRange(offset, qMin(pieces.second->length(), m_size - offset));
+
+    qCDebug(KGET_DEBUG) << "Piece" << piece << "is broken, redownloading chunks" << chunks;
+    Q_EMIT log(i18n("Piece %1 is broken, it will be downloaded again.", piece), Transfer::Log_Warning);
+
+    // remember the sources the broken data came from
+    QList<TransferDataSource *> suspects;
+    KIO::filesize_t lost = 0;
+    for (int i = chunks.first; i <= chunks.second; ++i) {
+        if (m_finishedChunks->get(i)) {
+            const KIO::fileoffset_t chunkStart = static_cast<KIO::fileoffset_t>(i) * m_segSize;
+            lost += qMin(static_cast<KIO::filesize_t>(m_segSize), m_size - chunkStart);
+        }
+        TransferDataSource *source = (i < m_chunkSources.count() ? m_chunkSources.at(i) : nullptr);
+        if (source && !suspects.contains(source)) {
+            suspects.append(source);
+        }
+    }
+
+    setChunksStarted(chunks.first, chunks.second, false);
+    m_finishedChunks->setRange(chunks.first, chunks.second, false);
+    scheduleControlFileUpdate();
+    m_finished = false;
+    m_downloadedSize -= qMin(lost, m_downloadedSize);
+    Q_EMIT dataSourceFactoryChange(Transfer::Tc_DownloadedSize);
+
+    // the chunks get assigned once the download is started again
+    if (m_status != Job::Running) {
+        return;
+    }
+
+    // preferably download the piece from a different mirror
+    foreach (TransferDataSource *source, m_sources) {
+        if (!suspects.contains(source)) {
+            assignSegments(source);
+        }
+    }
+    if (!m_startedChunks->get(chunks.first)) {
+        foreach (TransferDataSource *source, m_sources) {
+            if (suspects.contains(source)) {
+                assignSegments(source);
+            }
+        }
+    }
+}
+
+void DataSourceFactory::slotWriteError(const QString &errorText)
+{
+    abortWithStorageError(errorText);
+}
+
+bool DataSourceFactory::preallocate()
+{
+    if (!m_writer || !m_size) {
+        return true;
+    }
+
+    bool reserved = false;
+    m_spaceReserved = false;
+    const int mode = Settings::preallocationMode();
+    if (mode != NoPreallocation) {
+        const int error = m_writer->preallocate(m_size, (mode == FullPreallocation), &reserved);
+        if (error) {
+            abortWithStorageError(i18n("Could not allocate %1 for %2: %3", KIO::convertSize(m_size), m_dest.toLocalFile(), qt_error_string(error)));
+            return false;
+        }
+        qCDebug(KGET_DEBUG) << "Allocated" << m_size << "bytes, disk space reserved:" << reserved;
+    }
+
+    // the space is not reserved, so at least check if there is enough
+    if (!reserved) {
+        const KIO::filesize_t needed = m_size - qMin(m_size, m_downloadedSize);
+        const QStorageInfo storage(m_dest.adjusted(QUrl::RemoveFilename).toLocalFile());
+        if (storage.isValid() && (static_cast<KIO::filesize_t>(storage.bytesAvailable()) < needed)) {
+            abortWithStorageError(i18n("Not enough free space to download %1, %2 are needed.", m_dest.toLocalFile(), KIO::convertSize(needed)));
+            return false;
+        }
+    }
+
+    m_spaceReserved = reserved;
+    return true;
+}
+
+void DataSourceFactory::mapFile()
+{
+    if (m_map || !m_writer || !m_size || (Settings::storageMode() != MemoryMappedStorage)) {
+        return;
+    }
+    if (!m_spaceReserved) {
+        qCDebug(KGET_DEBUG) << "Disk space is not reserved, writing the data instead of mapping the file";
+        return;
+    }
+    if ((sizeof(void *) < 8) && (m_size > 1024 * 1024 * 1024)) {
+        qCDebug(KGET_DEBUG) << "File too large to be mapped, writing the data instead";
+        return;
+    }
+
+    m_mappedFile = new QFile(m_dest.toLocalFile());
+    if (m_mappedFile->open(QIODevice::ReadWrite)) {
+        m_map = m_mappedFile->map(0, m_size);
+    }
+    if (!m_map) {
+        qCWarning(KGET_DEBUG) << "Could not map" << m_dest.toLocalFile() << m_mappedFile->errorString() << "writing the data instead";
+        delete m_mappedFile;
+        m_mappedFile = nullptr;
+        return;
+    }
+
+    qCDebug(KGET_DEBUG) << "Mapped" << m_dest.toLocalFile();
+    // cached data has to end up in the file as well
+    flushCache();
+}
+
+void DataSourceFactory::unmapFile()
+{
+    if (!m_mappedFile) {
+        return;
+    }
+
+#ifdef Q_OS_UNIX
+    ::msync(m_map, m_size, MS_SYNC);
+#endif
+    m_mappedFile->unmap(m_map);
+    m_mappedFile->close();
+    delete m_mappedFile;
+    m_mappedFile = nullptr;
+    m_map = nullptr;
+}
+
+void DataSourceFactory::abortWithStorageError(const QString &errorText)
+{
+    qCWarning(KGET_DEBUG) << errorText;
+    Q_EMIT log(errorText, Transfer::Log_Error);
+    Q_EMIT storageError(errorText);
+
+    if (m_status != Job::Aborted) {
+        stop();
+    }
+    closeFile();
+    m_pendingWrites = 0;
+    m_pendingVerifications = 0;
+    m_duplicateBytes = 0;
+    m_startTried = false;
+    changeStatus(Job::Aborted);
 }
 
 void DataSourceFactory::slotPercent(KJob *job, ulong p)
@@ -743,6 +1650,8 @@ void DataSourceFactory::speedChanged()
     if (m_prevDownloadedSizes.size() > 10)
         m_prevDownloadedSizes.removeFirst();
 
+    updateSourceStatistics();
+
     ulong percent = (m_size ? (m_downloadedSize * 100 / m_size) : 0);
     const bool percentChanged = (percent != m_percent);
     m_percent = percent;
@@ -751,21 +1660,51 @@ void DataSourceFactory::speedChanged()
     Q_EMIT dataSourceFactoryChange(change);
 }
 
-void DataSourceFactory::killPutJob()
+void DataSourceFactory::closeFile()
 {
-    if (m_putJob) {
-        qCDebug(KGET_DEBUG) << "Closing the file";
+    unmapFile();
+
+    if (m_writer) {
+        flushCache();
+        qCDebug(KGET_DEBUG) << "Closing the file," << m_writeCount << "writes with an average size of" << averageWriteSize() << "bytes";
         m_open = false;
-        m_putJob->close();
-        m_putJob = nullptr;
+        m_writer->close();
+
+        // only a checksum of the complete file is of use
+        if (m_verifier) {
+            const KIO::filesize_t size = (m_size ? m_size : m_downloadedSize);
+            const bool complete = m_finished && m_writer->isHashing() && !m_writer->checksum().isEmpty() && (m_writer->hashedSize() == size);
+            m_verifier->setCalculatedChecksum(m_writer->hashType(), (complete ? m_writer->checksum() : QString()));
+        }
+
+        delete m_writer;
+        m_writer = nullptr;
     }
 }
 
-void DataSourceFactory::slotPutJobDestroyed(QObject *job)
+bool DataSourceFactory::existingData(QList<QPair<KIO::fileoffset_t, KIO::filesize_t>> *ranges) const
 {
-    Q_UNUSED(job)
+    if (!m_finishedChunks || !m_segSize) {
+        // without chunks it is not known where the data is
+        return !m_downloadedSize;
+    }
+
+    const quint32 numChunks = m_finishedChunks->getNumBits();
+    for (quint32 i = 0; i < numChunks; ++i) {
+        if (!m_finishedChunks->get(i)) {
+            continue;
+        }
+
+        const KIO::fileoffset_t offset = static_cast<KIO::fileoffset_t>(i) * m_segSize;
+        const KIO::filesize_t length = qMin(static_cast<KIO::filesize_t>(m_segSize), m_size - offset);
+        if (!ranges->isEmpty() && (ranges->last().first + static_cast<KIO::fileoffset_t>(ranges->last().second) == offset)) {
+            ranges->last().second += length;
+        } else {
+            ranges->append(qMakePair(offset, length));
+        }
+    }
 
-    m_putJob = nullptr;
+    return true;
 }
 
 bool DataSourceFactory::setNewDestination(const QUrl &newDestination)
@@ -793,12 +1732,7 @@ bool DataSourceFactory::setNewDestination(const QUrl &newDestination)
             changeStatus(Job::Moving);
             m_movingFile = true;
 
-            // still a write in progress
-            if (m_blocked) {
-                QTimer::singleShot(1000, this, &DataSourceFactory::startMove);
-            } else {
-                startMove();
-            }
+            startMove();
             return true;
         }
     }
@@ -807,7 +1741,9 @@ bool DataSourceFactory::setNewDestination(const QUrl &newDestination)
 
 void DataSourceFactory::startMove()
 {
-    killPutJob();
+    closeFile();
+    // a new one is created at the new destination once the download continues
+    removeControlFile();
 
     KIO::Job *move = KIO::file_move(m_dest, m_newDest, -1, KIO::HideProgressInfo);
     connect(move, &KJob::result, this, &DataSourceFactory::newDestResult);
@@ -845,6 +1781,7 @@ void DataSourceFactory::repair()
 void DataSourceFactory::slotRepair(const QList<KIO::fileoffset_t> &offsets, KIO::filesize_t length)
 {
     disconnect(verifier(), SIGNAL(brokenPieces(QList<KIO::fileoffset_t>, KIO::filesize_t)), this, SLOT(slotRepair(QList<KIO::fileoffset_t>, KIO::filesize_t)));
+    verifier()->setCalculatedChecksum(QString(), QString());
 
     if (!m_startedChunks || !m_finishedChunks) {
         qCDebug(KGET_DEBUG) << "Redownload everything";
@@ -853,12 +1790,13 @@ void DataSourceFactory::slotRepair(const QList<KIO::fileoffset_t> &offsets, KIO:
         if (offsets.isEmpty()) {
             m_startedChunks->clear();
             m_finishedChunks->clear();
+            resetFreeChunks();
         }
         qCDebug(KGET_DEBUG) << "Redownload broken pieces";
         for (int i = 0; i < offsets.count(); ++i) {
             const int start = offsets[i] / m_segSize;
             const int end = std::ceil(length / static_cast<double>(m_segSize)) - 1 + start;
-            m_startedChunks->setRange(start, end, false);
+            setChunksStarted(start, end, false);
             m_finishedChunks->setRange(start, end, false);
         }
 
@@ -866,6 +1804,7 @@ void DataSourceFactory::slotRepair(const QList<KIO::fileoffset_t> &offsets, KIO:
     }
     m_prevDownloadedSizes.clear();
     m_prevDownloadedSizes.append(m_downloadedSize);
+    scheduleControlFileUpdate();
 
     // remove all current mirrors and readd the first unused mirror
     const QList<QUrl> mirrors =
@@ -888,6 +1827,131 @@ void DataSourceFactory::slotRepair(const QList<KIO::fileoffset_t> &offsets, KIO:
     start();
 }
 
+QString DataSourceFactory::controlFileName() const
+{
+    const QString dest = m_dest.toLocalFile();
+    return (dest.isEmpty() ? QString() : dest + QLatin1String(".kgetctrl"));
+}
+
+void DataSourceFactory::scheduleControlFileUpdate()
+{
+    if (m_controlTimer && !m_controlTimer->isActive()) {
+        m_controlTimer->start();
+    }
+}
+
+void DataSourceFactory::syncControlFile()
+{
+    if (!m_writer || !m_finishedChunks || !m_segSize || m_movingFile || (m_status == Job::Finished)) {
+        return;
+    }
+
+    // the data of the finished chunks has to be passed to the writer before it syncs
+    flushCache();
+
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << CONTROL_FILE_MAGIC << CONTROL_FILE_VERSION;
+    stream << static_cast<quint64>(m_size) << static_cast<qint64>(m_segSize) << m_finishedChunks->getNumBits();
+    stream << QByteArray(reinterpret_cast<const char *>(m_finishedChunks->getData()), m_finishedChunks->getNumBytes());
+
+    const QHash<QUrl, QPair<bool, int>> allMirrors = mirrors();
+    stream << static_cast<quint32>(allMirrors.count());
+    QHash<QUrl, QPair<bool, int>>::const_iterator it;
+    QHash<QUrl, QPair<bool, int>>::const_iterator itEnd = allMirrors.constEnd();
+    for (it = allMirrors.constBegin(); it != itEnd; ++it) {
+        const QPair<QString, QString> validators = m_validators.value(it.key());
+        stream << it.key() << static_cast<qint32>(it->second) << validators.first << validators.second;
+    }
+
+    // the writer records it after the sync, so the chunks are on the disk even after a power failure
+    m_writer->sync(controlFileName(), record);
+}
+
+bool DataSourceFactory::loadControlFile()
+{
+    const QString fileName = controlFileName();
+    if (fileName.isEmpty() || !QFile::exists(m_dest.toLocalFile())) {
+        return false;
+    }
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint64 size = 0;
+    qint64 segSize = 0;
+    quint32 numBits = 0;
+    QByteArray bits;
+    quint32 numMirrors = 0;
+    stream >> magic >> version;
+    if ((magic != CONTROL_FILE_MAGIC) || (version != CONTROL_FILE_VERSION)) {
+        qCWarning(KGET_DEBUG) << fileName << "is not a control file of a known version";
+        return false;
+    }
+    stream >> size >> segSize >> numBits >> bits >> numMirrors;
+
+    const quint64 expectedBits = (segSize > 0 ? (size + segSize - 1) / segSize : 0);
+    if ((stream.status() != QDataStream::Ok) || !numBits || (numBits != expectedBits) || (bits.size() != static_cast<int>((numBits + 7) / 8))
+        || (m_size && (m_size != size))) {
+        qCWarning(KGET_DEBUG) << fileName << "does not match the download";
+        return false;
+    }
+
+    m_size = size;
+    m_segSize = segSize;
+    delete m_startedChunks;
+    delete m_finishedChunks;
+    m_finishedChunks = new BitSet(reinterpret_cast<const quint8 *>(bits.constData()), numBits);
+    m_startedChunks = new BitSet(*m_finishedChunks);
+    m_chunkSources.clear();
+    resetFreeChunks();
+
+    const bool lastOn = m_finishedChunks->get(numBits - 1);
+    m_downloadedSize = m_segSize * (m_finishedChunks->numOnBits() - lastOn) + lastOn * chunkSize(numBits - 1);
+    m_percent = (m_downloadedSize * 100 / m_size);
+    m_prevDownloadedSizes.clear();
+    m_prevDownloadedSizes.append(m_downloadedSize);
+    qCDebug(KGET_DEBUG) << m_finishedChunks->numOnBits() << "of" << numBits << "chunks are finished already";
+
+    for (quint32 i = 0; (i < numMirrors) && (stream.status() == QDataStream::Ok); ++i) {
+        QUrl url;
+        qint32 connections = 0;
+        QString etag;
+        QString lastModified;
+        stream >> url >> connections >> etag >> lastModified;
+        if (stream.status() != QDataStream::Ok) {
+            break;
+        }
+
+        m_validators[url] = qMakePair(etag, lastModified);
+        if (!m_sources.contains(url) && !m_unusedUrls.contains(url)) {
+            addMirror(url, false, connections, true);
+        }
+    }
+
+    Q_EMIT dataSourceFactoryChange(Transfer::Tc_TotalSize | Transfer::Tc_DownloadedSize | Transfer::Tc_Percent);
+    return true;
+}
+
+void DataSourceFactory::removeControlFile()
+{
+    if (m_controlTimer) {
+        m_controlTimer->stop();
+    }
+
+    const QString fileName = controlFileName();
+    if (!fileName.isEmpty() && QFile::exists(fileName)) {
+        QFile::remove(fileName);
+    }
+}
+
 void DataSourceFactory::load(const QDomElement *element)
 {
     if (!element) {
@@ -941,26 +2005,34 @@ void DataSourceFactory::load(const QDomElement *element)
 
     // load the finishedChunks
     const QDomElement chunks = e.firstChildElement("chunks");
-    const QDomNodeList chunkList = chunks.elementsByTagName("chunk");
-
     const quint32 numBits = chunks.attribute("numBits").toInt();
     const int numBytes = chunks.attribute("numBytes").toInt();
-    QVarLengthArray<quint8> data(numBytes);
+    QByteArray data;
 
-    if (numBytes && (numBytes == chunkList.length())) {
-        for (int i = 0; i < numBytes; ++i) {
-            const quint8 value = chunkList.at(i).toElement().text().toInt();
-            data[i] = value;
+    if (chunks.attribute("version").toInt() >= 2) {
+        data = qUncompress(QByteArray::fromBase64(chunks.text().toLatin1()));
+    } else {
+        // older versions stored every byte in its own element
+        const QDomNodeList chunkList = chunks.elementsByTagName("chunk");
+        if (numBytes == chunkList.length()) {
+            data.resize(numBytes);
+            for (int i = 0; i < numBytes; ++i) {
+                data[i] = static_cast<char>(chunkList.at(i).toElement().text().toInt());
+            }
         }
+    }
 
+    if (numBytes && (numBytes == data.size())) {
+        const quint8 *bits = reinterpret_cast<const quint8 *>(data.constData());
         if (!m_finishedChunks) {
-            m_finishedChunks = new BitSet(data.data(), numBits);
+            m_finishedChunks = new BitSet(bits, numBits);
             qCDebug(KGET_DEBUG) << m_finishedChunks->numOnBits() << " bits on of " << numBits << " bits.";
         }
 
         // set the finished chunks to started
         if (!m_startedChunks) {
-            m_startedChunks = new BitSet(data.data(), numBits);
+            m_startedChunks = new BitSet(bits, numBits);
+            resetFreeChunks();
         }
     }
     m_prevDownloadedSizes.clear();
@@ -1081,18 +2153,14 @@ void DataSourceFactory::save(const QDomElement &element)
         const bool lastOn = m_finishedChunks->get(m_finishedChunks->getNumBits() - 1);
         factory.setAttribute("processedSize", m_segSize * (m_finishedChunks->numOnBits() - lastOn) + lastOn * lastSegSize);
 
+        // the bytes are compressed, the long runs of finished or unfinished chunks make them small
         QDomElement chunks = doc.createElement("chunks");
+        chunks.setAttribute("version", 2);
         chunks.setAttribute("numBits", m_finishedChunks->getNumBits());
         chunks.setAttribute("numBytes", m_finishedChunks->getNumBytes());
 
-        const quint8 *data = m_finishedChunks->getData();
-        for (quint32 i = 0; i < m_finishedChunks->getNumBytes(); ++i) {
-            QDomElement chunk = doc.createElement("chunk");
-            QDomText num = doc.createTextNode(QString::number(data[i]));
-            chunk.setAttribute("number", i);
-            chunk.appendChild(num);
-            chunks.appendChild(chunk);
-        }
+        const QByteArray data = QByteArray::fromRawData(reinterpret_cast<const char *>(m_finishedChunks->getData()), m_finishedChunks->getNumBytes());
+        chunks.appendChild(doc.createTextNode(QString::fromLatin1(qCompress(data).toBase64())));
         factory.appendChild(chunks);
     }
 
@@ -19,18 +19,17 @@
 #include <kio/job.h>
 
 #include <QDomElement>
+#include <QMap>
+#include <QVector>
 
 class BitSet;
+class QFile;
+class FileWriterThread;
 class TransferDataSource;
 class QTimer;
 class Signature;
 class Verifier;
 
-namespace KIO
-{
-class FileJob;
-}
-
 /**
  This class manages multiple DataSources and saves the received data to the file
  */
@@ -39,12 +38,33 @@ class KGET_EXPORT DataSourceFactory : public QObject
     Q_OBJECT
 
 public:
+    /**
+     * How the file is allocated once its size is known
+     * @see Settings::preallocationMode()
+     */
+    enum PreallocationMode {
+        NoPreallocation = 0, ///< the file grows while data is written
+        SparsePreallocation = 1, ///< the file gets its final size without allocating disk space
+        FullPreallocation = 2, ///< the disk space gets reserved, falls back to a sparse file if not supported
+    };
+
+    /**
+     * How downloaded data gets into the file
+     * @see Settings::storageMode()
+     */
+    enum StorageMode {
+        WriteStorage = 0, ///< the data is written by a separate thread
+        MemoryMappedStorage = 1, ///< the data is copied into the mapped file, only if the disk space was reserved
+    };
+
     /**
      * In general use this constructor, if the size is 0, the datasourcefactory will try to
      * find the filesize
+     * @param segSize the size of the segments, if it is 0 it is chosen automatically once
+     * the filesize is known
      * @note when you want to load a datasourcefactory you do not have to specify the url and segSize
      */
-    explicit DataSourceFactory(QObject *parent, const QUrl &dest = QUrl(), KIO::filesize_t size = 0, KIO::fileoffset_t segSize = 512000);
+    explicit DataSourceFactory(QObject *parent, const QUrl &dest = QUrl(), KIO::filesize_t size = 0, KIO::fileoffset_t segSize = 0);
 
     ~DataSourceFactory() override;
 
@@ -87,6 +107,33 @@ public:
         return m_percent;
     }
 
+    /**
+     * @return the number of writes done to the file
+     */
+    quint64 writeCount() const
+    {
+        return m_writeCount;
+    }
+
+    /**
+     * Calculates a segment size that results in enough segments to distribute them
+     * among the connections, while keeping the number of segments of large files low
+     * @param fileSize the size of the file
+     * @param connections the number of connections that are going to be used
+     * @param connectionSpeed the speed of a single connection in bytes/s, 0 if unknown;
+     * slow connections get smaller segments. It is only known from earlier downloads
+     * from the same host, as the segment size is needed before anything is downloaded
+     */
+    static KIO::fileoffset_t automaticSegmentSize(KIO::filesize_t fileSize, int connections, ulong connectionSpeed = 0);
+
+    /**
+     * @return the average size of the writes done to the file
+     */
+    KIO::filesize_t averageWriteSize() const
+    {
+        return (m_writeCount ? m_writtenBytes / m_writeCount : 0);
+    }
+
     QUrl dest() const
     {
         return m_dest;
@@ -205,6 +252,12 @@ Q_SIGNALS:
     void dataSourceFactoryChange(Transfer::ChangesFlags change);
     void log(const QString &message, Transfer::LogLevel logLevel);
 
+    /**
+     * Emitted when the file can not be created, allocated or written to,
+     * the DataSourceFactory is aborted afterwards
+     */
+    void storageError(const QString &errorText);
+
 public Q_SLOTS:
     void save(const QDomElement &element);
     void load(const QDomElement *e);
@@ -221,8 +274,15 @@ private Q_SLOTS:
     void findFileSize();
 
     void slotFoundFileSize(TransferDataSource *source, KIO::filesize_t fileSize, const QPair<int, int> &segmentRange);
+    void slotSegmentSizeNeeded(KIO::filesize_t fileSize, KIO::fileoffset_t &segmentSize);
 
     void assignSegments(TransferDataSource *source);
+
+    /**
+     * Assigns the next segments to a connection of source before it finished its current ones
+     * @param lastSegment the last segment assigned to that connection
+     */
+    void slotRequestSegments(TransferDataSource *source, int lastSegment);
     /**
      * Called when segments are broken
      */
@@ -236,19 +296,51 @@ private Q_SLOTS:
     /**
      * Emitted when a Datasource itself decides to not download a specific segmentRange,
      * e.g. when there are too many connections for this TransferDataSource
+     * @param error only if true this counts as an error of the source
      */
-    void slotFreeSegments(TransferDataSource *source, QPair<int, int> segmentRange);
+    void slotFreeSegments(TransferDataSource *source, QPair<int, int> segmentRange, bool error);
+
+    /**
+     * Stores the connection speeds of source and returns the median of all connections
+     * of the transfer, so that sources can tell whether one of theirs is slow
+     */
+    void slotConnectionSpeeds(TransferDataSource *source, const QList<double> &speeds, double &median);
+
+    /**
+     * Adds the time a connection of source waited for a response to its statistics
+     */
+    void slotTimeToFirstByte(TransferDataSource *source, qint64 msecs);
     void slotWriteData(KIO::fileoffset_t offset, const QByteArray &data, bool &worked);
-    void slotOffset(KIO::Job *job, KIO::filesize_t offset);
-    void slotDataWritten(KIO::Job *job, KIO::filesize_t offset);
+
+    /**
+     * Data of a chunk that is downloaded by two connections, it is only written
+     * if the chunk is not finished yet
+     */
+    void slotWriteDuplicateData(KIO::fileoffset_t offset, const QByteArray &data, bool &worked);
+    void slotDataWritten(KIO::fileoffset_t offset, KIO::filesize_t written);
+    void slotWriteError(const QString &errorText);
+
+    /**
+     * Writes all cached data to the file
+     */
+    void flushCache();
+
+    /**
+     * Changes the status to finished if all data has been downloaded and written
+     */
+    void checkFinished();
+
+    /**
+     * A piece defined by the partial checksums has been checked, if it is broken
+     * it is downloaded again
+     */
+    void slotPieceVerified(int piece, bool verified);
     void slotPercent(KJob *job, ulong percent);
-    void slotOpen(KIO::Job *job);
     void speedChanged();
     /**
-     * Kills the putjob and starts the moving of files
+     * Closes the file and starts the moving of files
      */
     void startMove();
-    void slotPutJobDestroyed(QObject *job);
     void newDestResult(KJob *job);
 
     void slotRepair(const QList<KIO::fileoffset_t> &offsets, KIO::filesize_t length);
@@ -257,6 +349,23 @@ private Q_SLOTS:
 
     void slotUrlChanged(const QUrl &, const QUrl &);
 
+    /**
+     * Compares the validators of a mirror with the ones it sent before, if the
+     * file changed on the server everything is downloaded again
+     */
+    void slotValidators(TransferDataSource *source, const QString &etag, const QString &lastModified);
+
+    /**
+     * Downloads the whole file again, e.g. because it changed on the server
+     */
+    void redownload();
+
+    /**
+     * Writes the cached data and lets the writer record the current state in the
+     * control file once that data is on the disk
+     */
+    void syncControlFile();
+
 private:
     /**
      * Add a mirror that can be used for downloading
@@ -274,8 +383,169 @@ private:
 
     bool checkLocalFile();
 
+    /**
+     * Allocates the file as defined in the settings, and checks for enough free space
+     * @return false if that failed, the download is aborted in that case
+     */
+    bool preallocate();
+
+    /**
+     * Aborts the download because of a problem with the file
+     */
+    void abortWithStorageError(const QString &errorText);
+
+    /**
+     * Maps the file into memory if defined in the settings, in that case
+     * data is copied into m_map instead of being written
+     */
+    void mapFile();
+    void unmapFile();
+
+    /**
+     * Returns the ranges of data that are in the file already
+     * @return false if that is not known
+     */
+    bool existingData(QList<QPair<KIO::fileoffset_t, KIO::filesize_t>> *ranges) const;
+
     void init();
-    void killPutJob();
+
+    /**
+     * Opens the file for writing
+     * @return false if the file could not be opened
+     */
+    bool openFile();
+
+    /**
+     * Writes all pending data and closes the file
+     */
+    void closeFile();
+
+    /**
+     * Adds data to m_cache, merging it with adjacent cached data
+     */
+    void cacheData(KIO::fileoffset_t offset, const QByteArray &data);
+
+    /**
+     * Appends next to data, next is given back to the BufferPool afterwards
+     */
+    void appendCacheData(QByteArray &data, QByteArray &next);
+
+    /**
+     * Writes the cached data of it to the file and removes it from m_cache
+     * @param aligned if true only the part ending at a block boundary is written,
+     * the rest stays in the cache
+     */
+    void flushCacheEntry(QMap<KIO::fileoffset_t, QByteArray>::iterator it, bool aligned);
+
+    /**
+     * Stores data in the file
+     * @param counted if the data should be added to the downloaded size
+     */
+    void storeData(KIO::fileoffset_t offset, const QByteArray &data, bool counted);
+
+    /**
+     * Writes the cached data that overlaps with start to end
+     */
+    void flushCacheRange(KIO::fileoffset_t start, KIO::fileoffset_t end);
+
+    /**
+     * Returns the first and last chunk containing data of the byte range
+     */
+    QPair<int, int> chunkRange(KIO::fileoffset_t offset, KIO::filesize_t length) const;
+
+    /**
+     * @return the size of chunk, only the last chunk can be smaller than m_segSize
+     */
+    KIO::filesize_t chunkSize(int chunk) const;
+
+    /**
+     * Endgame: Once every chunk is started and no connection has anything left to split,
+     * source downloads a chunk that another connection is working on as well; the
+     * connection that finishes it first wins and the other one is cancelled
+     * @return true if a chunk was assigned to source
+     */
+    bool duplicateChunk(TransferDataSource *source);
+
+    /**
+     * Cancels the other connection that downloads the finished chunk
+     */
+    void finishDuplicatedChunk(int chunk);
+
+    /**
+     * Counts the bytes received from the TransferDataSource that sent them
+     */
+    void addReceivedBytes(TransferDataSource *source, KIO::filesize_t bytes);
+
+    /**
+     * Updates the average speed of each TransferDataSource, called every second
+     */
+    void updateSourceStatistics();
+
+    /**
+     * @return a score of how good source is, combining its speed, its time to the first
+     * byte and how often it had errors, 0 if nothing is known yet
+     */
+    qreal sourceScore(TransferDataSource *source) const;
+
+    /**
+     * @return the share of the free chunks a single connection of source should get relative
+     * to the other connections, based on the score of the sources
+     */
+    qreal connectionWeight(TransferDataSource *source) const;
+
+    /**
+     * @return the number of free chunks a connection of source should get at once
+     * @param allConnections if true the free chunks are shared among all connections,
+     * otherwise only among the ones that need segments
+     */
+    int chunkShare(TransferDataSource *source, bool allConnections) const;
+
+    /**
+     * Replaces a mirror that has been much slower than the best one for a while
+     * with an unused one, if there is any
+     */
+    void replaceSlowMirror();
+
+    /**
+     * Verifies the pieces defined by the partial checksums that chunk belongs to,
+     * if all their chunks are finished
+     */
+    void verifyCompletedPieces(int chunk);
+
+    /**
+     * Chooses the segment size if it should be chosen automatically
+     * @note has no effect once the chunks have been created
+     */
+    void chooseSegmentSize();
+
+    /**
+     * Marks the chunks from start to end as started or not and keeps the free
+     * ranges in sync
+     */
+    void setChunksStarted(int start, int end, bool started);
+
+    /**
+     * Creates the free ranges from m_startedChunks
+     */
+    void resetFreeChunks();
+
+    /**
+     * @return the path of the control file next to the destination, it contains what is needed
+     * to resume the download even if the transfer list got lost
+     */
+    QString controlFileName() const;
+
+    /**
+     * Updates the control file soon, multiple changes are recorded at once
+     */
+    void scheduleControlFileUpdate();
+
+    /**
+     * Restores the download state from the control file
+     * @return false if there is no usable control file
+     */
+    bool loadControlFile();
+    void removeControlFile();
     void changeStatus(Job::Status status);
 
 private:
@@ -290,22 +560,84 @@ private:
     ulong m_percent;
 
     /**
-     * the cache of data that could not be written yet
+     * the cache of data that has not been written yet, adjacent ranges are merged
+     * so that they can be written at once
      */
-    QHash<KIO::fileoffset_t, QByteArray> m_cache;
+    QMap<KIO::fileoffset_t, QByteArray> m_cache;
+    qint64 m_cachedBytes;
+    QTimer *m_flushTimer;
+    quint64 m_writeCount;
+    KIO::filesize_t m_writtenBytes;
 
-    KIO::filesize_t m_tempOffset;
-    QByteArray m_tempData;
+    /**
+     * the mapped file, only used if the disk space has been reserved, as writing
+     * to a mapping of a sparse file on a full disk crashes
+     */
+    QFile *m_mappedFile;
+    uchar *m_map;
+    bool m_spaceReserved;
 
     BitSet *m_startedChunks;
     BitSet *m_finishedChunks;
-    KIO::FileJob *m_putJob;
-    bool m_doDownload;
-    bool m_open;
+    FileWriterThread *m_writer;
+
+    /**
+     * the TransferDataSource each finished chunk came from, to know which one
+     * sent a broken piece
+     */
+    QVector<TransferDataSource *> m_chunkSources;
+    int m_pendingVerifications;
+
     /**
-     * the write access is currently blocked, the data gets cached in m_cache
+     * the ranges of chunks that are not started yet, maps the first
+     * chunk of a range to the last one
      */
-    bool m_blocked;
+    QMap<int, int> m_freeChunks;
+    int m_freeChunkCount;
+
+    /**
+     * the chunks that are downloaded by two connections and how many bytes
+     * the duplicate connection returned
+     */
+    QHash<int, KIO::filesize_t> m_duplicatedChunks;
+
+    /**
+     * duplicate data that has not been written yet, it is not counted as downloaded
+     */
+    KIO::filesize_t m_duplicateBytes;
+
+    /**
+     * Statistics about a TransferDataSource to prefer the better ones
+     */
+    struct SourceStatistics {
+        KIO::filesize_t receivedBytes = 0; ///< received since the last update
+        qreal speed = 0; ///< exponentially weighted average in bytes/s
+        qreal timeToFirstByte = 0; ///< exponentially weighted average in ms
+        int requests = 0;
+        int errors = 0;
+        int updates = 0; ///< number of updates while the source was downloading
+        int slowUpdates = 0; ///< consecutive updates the source was much slower than the best one
+        QList<double> connectionSpeeds; ///< of the running connections as last reported, in bytes/s
+    };
+    QHash<TransferDataSource *, SourceStatistics> m_sourceStatistics;
+
+    /**
+     * the ETag and Last-Modified date each mirror sent for the file
+     */
+    QHash<QUrl, QPair<QString, QString>> m_validators;
+    QTimer *m_controlTimer;
+
+    /**
+     * the number of writes that have been queued but are not finished yet
+     */
+    int m_pendingWrites;
+
+    /**
+     * true if data was refused as the writer was busy, the sources get told once it is not anymore
+     */
+    bool m_dataRefused;
+    bool m_doDownload;
+    bool m_open;
     /**
      * If start() was called but did not work this is true, once the conditions changed
      * start() could be recalled
@@ -0,0 +1,588 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+#include "filewriterthread.h"
+#include "bufferpool.h"
+
+#include <KLocalizedString>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include "kget_debug.h"
+
+#include <qplatformdefs.h>
+
+#include <cerrno>
+#include <fcntl.h>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// the number of queued bytes above which isBusy() asks for no more data
+const qint64 MAX_QUEUED_BYTES = 32 * 1024 * 1024;
+// the maximum number of bytes that are read back at once to be hashed
+const qint64 HASH_READ_SIZE = 4 * 1024 * 1024;
+
+FileWriterThread::FileWriterThread(const QString &fileName, QObject *parent)
+    : QThread(parent)
+    , m_fileName(fileName)
+    , m_fd(-1)
+    , m_queuedBytes(0)
+    , m_closing(false)
+    , m_failed(false)
+    , m_hash(nullptr)
+    , m_hashedOffset(0)
+{
+}
+
+FileWriterThread::~FileWriterThread()
+{
+    close();
+    delete m_hash;
+}
+
+void FileWriterThread::setHashing(const QString &type, QCryptographicHash::Algorithm algorithm, const QList<QPair<KIO::fileoffset_t, KIO::filesize_t>> &existing)
+{
+    if (isRunning()) {
+        qCWarning(KGET_DEBUG) << "Hashing has to be set before opening the file";
+        return;
+    }
+
+    delete m_hash;
+    m_hashType = type;
+    m_hash = new QCryptographicHash(algorithm);
+    m_hashedOffset = 0;
+    m_unhashedRanges.clear();
+    m_checksum.clear();
+    for (const QPair<KIO::fileoffset_t, KIO::filesize_t> &range : existing) {
+        addUnhashedRange(range.first, range.first + range.second);
+    }
+}
+
+bool FileWriterThread::isHashing() const
+{
+    return !m_hashType.isEmpty();
+}
+
+QString FileWriterThread::hashType() const
+{
+    return m_hashType;
+}
+
+KIO::filesize_t FileWriterThread::hashedSize() const
+{
+    return m_hashedOffset;
+}
+
+QString FileWriterThread::checksum() const
+{
+    return m_checksum;
+}
+
+bool FileWriterThread::open()
+{
+    if (m_fd != -1) {
+        return true;
+    }
+
+    // read access is needed to hash data that has been written out of order
+    int flags = O_RDWR;
+#ifdef Q_OS_WIN
+    flags |= O_BINARY;
+#endif
+    m_fd = QT_OPEN(QFile::encodeName(m_fileName).constData(), flags);
+    if (m_fd == -1) {
+        qCWarning(KGET_DEBUG) << "Could not open" << m_fileName << "for writing:" << qt_error_string(errno);
+        return false;
+    }
+
+    m_closing = false;
+    m_failed = false;
+    start();
+    return true;
+}
+
+void FileWriterThread::close()
+{
+    if (m_fd == -1) {
+        return;
+    }
+
+    m_mutex.lock();
+    m_closing = true;
+    m_dataAvailable.wakeAll();
+    m_mutex.unlock();
+
+    wait();
+
+    QT_CLOSE(m_fd);
+    m_fd = -1;
+}
+
+bool FileWriterThread::isOpen() const
+{
+    return (m_fd != -1);
+}
+
+void FileWriterThread::write(KIO::fileoffset_t offset, const QByteArray &data)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+
+    WriteRequest request;
+    request.type = WriteRequest::Write;
+    request.offset = offset;
+    request.data = data;
+    enqueue(request);
+}
+
+void FileWriterThread::addStoredData(KIO::fileoffset_t offset, const QByteArray &data)
+{
+    if (data.isEmpty() || !isHashing()) {
+        return;
+    }
+
+    WriteRequest request;
+    request.type = WriteRequest::Store;
+    request.offset = offset;
+    request.data = data;
+    enqueue(request);
+}
+
+void FileWriterThread::verifyPiece(int piece, KIO::fileoffset_t offset, KIO::filesize_t length, QCryptographicHash::Algorithm algorithm, const QString &checksum)
+{
+    WriteRequest request;
+    request.type = WriteRequest::VerifyPiece;
+    request.offset = offset;
+    request.piece = piece;
+    request.length = length;
+    request.algorithm = algorithm;
+    request.checksum = checksum;
+    enqueue(request);
+}
+
+void FileWriterThread::sync(const QString &recordFile, const QByteArray &record)
+{
+    WriteRequest request;
+    request.type = WriteRequest::Sync;
+    request.recordFile = recordFile;
+    request.data = record;
+    enqueue(request);
+}
+
+void FileWriterThread::enqueue(const WriteRequest &request)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_failed) {
+        return;
+    }
+
+    m_queue.enqueue(request);
+    m_queuedBytes += request.data.size();
+    m_dataAvailable.wakeOne();
+}
+
+int FileWriterThread::preallocate(KIO::filesize_t size, bool reserve, bool *reserved)
+{
+    if (reserved) {
+        *reserved = false;
+    }
+    if (m_fd == -1) {
+        return EBADF;
+    }
+
+#if defined(Q_OS_LINUX)
+    if (reserve) {
+        int result;
+        do {
+            result = ::fallocate(m_fd, 0, 0, size);
+        } while ((result == -1) && (errno == EINTR));
+        if (!result) {
+            if (reserved) {
+                *reserved = true;
+            }
+            return 0;
+        }
+        // the filesystem does not support it, create a sparse file instead
+        if ((errno != EOPNOTSUPP) && (errno != ENOSYS)) {
+            return errno;
+        }
+    }
+#elif defined(Q_OS_FREEBSD)
+    if (reserve) {
+        const int result = ::posix_fallocate(m_fd, 0, size);
+        if (!result) {
+            if (reserved) {
+                *reserved = true;
+            }
+            return 0;
+        }
+        if ((result != EINVAL) && (result != EOPNOTSUPP)) {
+            return result;
+        }
+    }
+#else
+    Q_UNUSED(reserve)
+#endif
+
+#ifdef Q_OS_WIN
+    if ((static_cast<KIO::filesize_t>(QFileInfo(m_fileName).size()) < size) && !QFile::resize(m_fileName, size)) {
+        return EIO;
+    }
+#else
+    QT_STATBUF info;
+    if (QT_FSTAT(m_fd, &info) == -1) {
+        return errno;
+    }
+    // only ever enlarge the file, data might have been written already
+    if ((static_cast<KIO::filesize_t>(info.st_size) < size) && (QT_FTRUNCATE(m_fd, size) == -1)) {
+        return errno;
+    }
+#endif
+
+    return 0;
+}
+
+qint64 FileWriterThread::pendingBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_queuedBytes;
+}
+
+bool FileWriterThread::isBusy() const
+{
+    QMutexLocker locker(&m_mutex);
+    return (m_queuedBytes >= MAX_QUEUED_BYTES);
+}
+
+void FileWriterThread::run()
+{
+    forever {
+        m_mutex.lock();
+        while (m_queue.isEmpty() && !m_closing) {
+            // use the idle time to hash data that is in the file already
+            if (m_hash && !m_unhashedRanges.isEmpty() && (m_unhashedRanges.firstKey() <= m_hashedOffset)) {
+                m_mutex.unlock();
+                hashUnhashedRange();
+                m_mutex.lock();
+            } else {
+                m_dataAvailable.wait(&m_mutex);
+            }
+        }
+        if (m_queue.isEmpty()) {
+            m_mutex.unlock();
+            break;
+        }
+        WriteRequest request = m_queue.head();
+        m_mutex.unlock();
+
+        int errorCode = -1;
+        bool pieceVerified = false;
+        if (!m_failed) {
+            switch (request.type) {
+            case WriteRequest::Write:
+                errorCode = writeAll(request.offset, request.data);
+                break;
+            case WriteRequest::Store:
+                errorCode = 0;
+                break;
+            case WriteRequest::VerifyPiece:
+                errorCode = 0;
+                pieceVerified = checkPiece(request);
+                break;
+            case WriteRequest::Sync:
+                errorCode = syncFile();
+                if (!errorCode && !request.recordFile.isEmpty()) {
+                    writeRecord(request);
+                }
+                break;
+            }
+        }
+        if (!errorCode && m_hash && ((request.type == WriteRequest::Write) || (request.type == WriteRequest::Store))) {
+            hashData(request.offset, request.data);
+            // continue with what is in the file already, maybe a gap got closed
+            hashUnhashedRange();
+        }
+
+        m_mutex.lock();
+        m_queue.dequeue();
+        m_queuedBytes -= request.data.size();
+        const bool reportError = (errorCode > 0);
+        if (reportError) {
+            m_failed = true;
+        }
+        m_mutex.unlock();
+
+        if (reportError) {
+            qCWarning(KGET_DEBUG) << "Writing to" << m_fileName << "failed:" << qt_error_string(errorCode);
+            Q_EMIT error(i18n("Could not write to %1: %2", m_fileName, qt_error_string(errorCode)));
+        } else if (!errorCode && (request.type == WriteRequest::Write)) {
+            Q_EMIT written(request.offset, request.data.size());
+        } else if (!errorCode && (request.type == WriteRequest::VerifyPiece)) {
+            Q_EMIT pieceVerified(request.piece, pieceVerified);
+        }
+
+        // usually this is the last reference to the received data
+        BufferPool::release(request.data);
+    }
+
+    // closing skips the idle hashing, so finish what can be hashed still
+    while (hashUnhashedRange()) {
+    }
+
+    // the checksum is only known if there are no gaps
+    if (m_hash && m_unhashedRanges.isEmpty()) {
+        m_checksum = m_hash->result().toHex();
+    }
+}
+
+void FileWriterThread::hashData(KIO::fileoffset_t offset, const QByteArray &data)
+{
+    const KIO::fileoffset_t end = offset + data.size();
+    if (end <= m_hashedOffset) {
+        return;
+    }
+
+    if (offset <= m_hashedOffset) {
+        m_hash->addData(data.constData() + (m_hashedOffset - offset), end - m_hashedOffset);
+        m_hashedOffset = end;
+    } else {
+        addUnhashedRange(offset, end);
+    }
+}
+
+void FileWriterThread::addUnhashedRange(KIO::fileoffset_t start, KIO::fileoffset_t end)
+{
+    if (end <= start) {
+        return;
+    }
+
+    // merge with overlapping or adjacent ranges
+    QMap<KIO::fileoffset_t, KIO::fileoffset_t>::iterator it = m_unhashedRanges.lowerBound(start);
+    if (it != m_unhashedRanges.begin()) {
+        QMap<KIO::fileoffset_t, KIO::fileoffset_t>::iterator prev = it;
+        --prev;
+        if (prev.value() >= start) {
+            start = prev.key();
+            end = qMax(end, prev.value());
+            it = m_unhashedRanges.erase(prev);
+        }
+    }
+    while ((it != m_unhashedRanges.end()) && (it.key() <= end)) {
+        end = qMax(end, it.value());
+        it = m_unhashedRanges.erase(it);
+    }
+
+    m_unhashedRanges.insert(start, end);
+}
+
+void FileWriterThread::removeUnhashedRange(KIO::fileoffset_t start, KIO::fileoffset_t end)
+{
+    if (end <= start) {
+        return;
+    }
+
+    // cut the ranges overlapping with start to end, keeping what is before and after it
+    QMap<KIO::fileoffset_t, KIO::fileoffset_t>::iterator it = m_unhashedRanges.lowerBound(start);
+    if (it != m_unhashedRanges.begin()) {
+        QMap<KIO::fileoffset_t, KIO::fileoffset_t>::iterator prev = it;
+        --prev;
+        if (prev.value() > start) {
+            const KIO::fileoffset_t prevEnd = prev.value();
+            prev.value() = start;
+            if (prevEnd > end) {
+                m_unhashedRanges.insert(end, prevEnd);
+                return;
+            }
+        }
+    }
+    while ((it != m_unhashedRanges.end()) && (it.key() < end)) {
+        const KIO::fileoffset_t rangeEnd = it.value();
+        it = m_unhashedRanges.erase(it);
+        if (rangeEnd > end) {
+            m_unhashedRanges.insert(end, rangeEnd);
+            break;
+        }
+    }
+}
+
+bool FileWriterThread::hashUnhashedRange()
+{
+    if (!m_hash || m_unhashedRanges.isEmpty() || (m_unhashedRanges.firstKey() > m_hashedOffset)) {
+        return false;
+    }
+
+    const KIO::fileoffset_t end = m_unhashedRanges.first();
+    if (end <= m_hashedOffset) {
+        m_unhashedRanges.erase(m_unhashedRanges.begin());
+        return true;
+    }
+
+    const qint64 length = qMin(end - m_hashedOffset, HASH_READ_SIZE);
+    if (m_readBuffer.size() < length) {
+        m_readBuffer.resize(length);
+    }
+    const int errorCode = readAll(m_hashedOffset, m_readBuffer.data(), length);
+    if (errorCode) {
+        qCWarning(KGET_DEBUG) << "Reading" << m_fileName << "to hash it failed:" << qt_error_string(errorCode);
+        abortHashing();
+        return false;
+    }
+
+    m_hash->addData(m_readBuffer.constData(), length);
+    m_hashedOffset += length;
+    if (m_hashedOffset >= end) {
+        m_unhashedRanges.erase(m_unhashedRanges.begin());
+        // do not keep a big buffer around if hashing in order works
+        m_readBuffer.clear();
+    }
+
+    return true;
+}
+
+bool FileWriterThread::checkPiece(const WriteRequest &request)
+{
+    QCryptographicHash hash(request.algorithm);
+    KIO::fileoffset_t offset = request.offset;
+    const KIO::fileoffset_t end = request.offset + request.length;
+    while (offset < end) {
+        const qint64 length = qMin(end - offset, HASH_READ_SIZE);
+        if (m_readBuffer.size() < length) {
+            m_readBuffer.resize(length);
+        }
+        const int errorCode = readAll(offset, m_readBuffer.data(), length);
+        if (errorCode) {
+            // it could not be checked, so it must not count as verified; what was hashed
+            // of it can not be trusted either
+            qCWarning(KGET_DEBUG) << "Reading piece" << request.piece << "of" << m_fileName << "failed:" << qt_error_string(errorCode);
+            if (m_hash) {
+                abortHashing();
+            }
+            return false;
+        }
+        hash.addData(m_readBuffer.constData(), length);
+        offset += length;
+    }
+
+    const bool verified = (QString::fromLatin1(hash.result().toHex()).compare(request.checksum, Qt::CaseInsensitive) == 0);
+    if (!verified) {
+        qCDebug(KGET_DEBUG) << "Piece" << request.piece << "of" << m_fileName << "is broken";
+        // the broken data has been hashed already, so the checksum would be wrong
+        if (m_hash && (m_hashedOffset > request.offset)) {
+            abortHashing();
+        } else if (m_hash) {
+            // otherwise it must not be read back before it got written again
+            removeUnhashedRange(request.offset, end);
+        }
+    }
+
+    return verified;
+}
+
+void FileWriterThread::abortHashing()
+{
+    delete m_hash;
+    m_hash = nullptr;
+    m_unhashedRanges.clear();
+}
+
+int FileWriterThread::writeAll(KIO::fileoffset_t offset, const QByteArray &data)
+{
+    const char *buffer = data.constData();
+    qint64 left = data.size();
+
+#ifdef Q_OS_WIN
+    if (QT_LSEEK(m_fd, offset, SEEK_SET) == -1) {
+        return errno;
+    }
+#endif
+
+    while (left > 0) {
+#ifdef Q_OS_WIN
+        const qint64 done = QT_WRITE(m_fd, buffer, left);
+#else
+        const qint64 done = ::pwrite(m_fd, buffer, left, offset);
+#endif
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buffer += done;
+        offset += done;
+        left -= done;
+    }
+
+    return 0;
+}
+
+int FileWriterThread::syncFile()
+{
+#if defined(Q_OS_WIN)
+    return ::_commit(m_fd) ? errno : 0;
+#else
+    int result;
+    do {
+#if defined(Q_OS_LINUX)
+        // the size is set by preallocate() already, so the metadata does not matter
+        result = ::fdatasync(m_fd);
+#else
+        result = ::fsync(m_fd);
+#endif
+    } while ((result == -1) && (errno == EINTR));
+    return result ? errno : 0;
+#endif
+}
+
+void FileWriterThread::writeRecord(const WriteRequest &request)
+{
+    QSaveFile file(request.recordFile);
+    if (!file.open(QIODevice::WriteOnly) || (file.write(request.data) != request.data.size()) || !file.commit()) {
+        qCWarning(KGET_DEBUG) << "Could not write" << request.recordFile << file.errorString();
+    }
+}
+
+int FileWriterThread::readAll(KIO::fileoffset_t offset, char *buffer, qint64 length)
+{
+#ifdef Q_OS_WIN
+    if (QT_LSEEK(m_fd, offset, SEEK_SET) == -1) {
+        return errno;
+    }
+#endif
+
+    while (length > 0) {
+#ifdef Q_OS_WIN
+        const qint64 done = QT_READ(m_fd, buffer, length);
+#else
+        const qint64 done = ::pread(m_fd, buffer, length, offset);
+#endif
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        // the file is shorter than expected
+        if (!done) {
+            return EIO;
+        }
+        buffer += done;
+        offset += done;
+        length -= done;
+    }
+
+    return 0;
+}
+
+#include "moc_filewriterthread.cpp"
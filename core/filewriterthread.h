@@ -0,0 +1,226 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+#ifndef FILEWRITERTHREAD_H
+#define FILEWRITERTHREAD_H
+
+#include "kget_export.h"
+
+#include <kio/global.h>
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QMap>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+
+/**
+ * Writes data to a local file at arbitrary offsets without blocking the thread
+ * that receives the data.
+ *
+ * Every write is queued and later done with a positional write in a separate
+ * thread, so multiple writes can be pending at the same time. Queuing never blocks,
+ * the caller has to stop handing on data while isBusy() returns true.
+ *
+ * Optionally a checksum of the file is calculated while the data is written. Data that
+ * is written in order is hashed directly, data written ahead of that is read back once
+ * everything before it has been hashed.
+ */
+class KGET_EXPORT FileWriterThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit FileWriterThread(const QString &fileName, QObject *parent = nullptr);
+    ~FileWriterThread() override;
+
+    /**
+     * Calculate a checksum while writing, has to be called before open()
+     * @param type the checksum type as used by Verifier, e.g. "sha256"
+     * @param algorithm the algorithm matching type
+     * @param existing data that is already in the file as offset and length, it
+     * gets hashed once everything before it has been hashed
+     * @see checksum()
+     */
+    void setHashing(const QString &type, QCryptographicHash::Algorithm algorithm, const QList<QPair<KIO::fileoffset_t, KIO::filesize_t>> &existing);
+
+    bool isHashing() const;
+    QString hashType() const;
+
+    /**
+     * @return the number of bytes from the start of the file that were hashed
+     * @note only valid after close()
+     */
+    KIO::filesize_t hashedSize() const;
+
+    /**
+     * @return the checksum of the first hashedSize() bytes, empty if
+     * there were gaps when the file got closed
+     * @note only valid after close()
+     */
+    QString checksum() const;
+
+    /**
+     * Opens the file (it has to exist already) and starts the thread
+     * @return false if the file could not be opened
+     */
+    bool open();
+
+    /**
+     * Writes all pending data, closes the file and stops the thread
+     * @note blocks until everything has been written
+     */
+    void close();
+
+    bool isOpen() const;
+
+    /**
+     * Queues data to be written at offset
+     * @note never blocks, check isBusy() to not queue more than the disk can take
+     */
+    void write(KIO::fileoffset_t offset, const QByteArray &data);
+
+    /**
+     * Queues data that has been stored at offset already, e.g. in a mapping of the file,
+     * so that it gets hashed without reading it back
+     * @note does nothing if isHashing() is false, written() is not emitted for that data
+     */
+    void addStoredData(KIO::fileoffset_t offset, const QByteArray &data);
+
+    /**
+     * Queues the verification of a piece of the file, it is done after all data
+     * queued before has been written
+     * @see pieceVerified()
+     */
+    void verifyPiece(int piece, KIO::fileoffset_t offset, KIO::filesize_t length, QCryptographicHash::Algorithm algorithm, const QString &checksum);
+
+    /**
+     * Queues flushing the file to the disk, it is done after all data queued
+     * before has been written
+     * @param recordFile if not empty record is written to this file once the data is
+     * on the disk, replacing it atomically; so it never describes data that could still get lost
+     */
+    void sync(const QString &recordFile = QString(), const QByteArray &record = QByteArray());
+
+    /**
+     * Makes sure that the file has size bytes
+     * @param reserve if true the disk space is reserved if the filesystem supports that,
+     * otherwise the file is only enlarged without allocating anything (sparse file)
+     * @param reserved set to true if the disk space was actually reserved
+     * @return 0 on success, otherwise the errno of the failed operation
+     */
+    int preallocate(KIO::filesize_t size, bool reserve, bool *reserved = nullptr);
+
+    /**
+     * @return the number of bytes that are queued but have not been written yet
+     */
+    qint64 pendingBytes() const;
+
+    /**
+     * @return true if so much data is pending that no more should be queued
+     * until the thread caught up
+     */
+    bool isBusy() const;
+
+Q_SIGNALS:
+    /**
+     * Emitted once length bytes have been written at offset
+     */
+    void written(KIO::fileoffset_t offset, KIO::filesize_t length);
+
+    /**
+     * Emitted once a piece queued with verifyPiece() has been checked
+     */
+    void pieceVerified(int piece, bool verified);
+
+    /**
+     * Emitted if writing failed, all writes after that are discarded
+     */
+    void error(const QString &errorText);
+
+protected:
+    void run() override;
+
+private:
+    struct WriteRequest;
+    void enqueue(const WriteRequest &request);
+
+    /**
+     * @return 0 on success, otherwise the errno of the failed write
+     */
+    int writeAll(KIO::fileoffset_t offset, const QByteArray &data);
+    int readAll(KIO::fileoffset_t offset, char *buffer, qint64 length);
+
+    /**
+     * @return 0 on success, otherwise the errno of the failed sync
+     */
+    int syncFile();
+    void writeRecord(const WriteRequest &request);
+
+    void hashData(KIO::fileoffset_t offset, const QByteArray &data);
+    void addUnhashedRange(KIO::fileoffset_t start, KIO::fileoffset_t end);
+    void removeUnhashedRange(KIO::fileoffset_t start, KIO::fileoffset_t end);
+
+    /**
+     * Reads back and hashes the next part of an unhashed range, if the hashed
+     * data reached that range already
+     * @return true if something was hashed
+     */
+    bool hashUnhashedRange();
+
+    /**
+     * Stops hashing, e.g. on read errors
+     */
+    void abortHashing();
+
+    bool checkPiece(const WriteRequest &request);
+
+private:
+    struct WriteRequest {
+        enum Type {
+            Write, ///< write data
+            Store, ///< data is already in the file, only hash it
+            VerifyPiece, ///< compare the checksum of a piece
+            Sync ///< flush the file to the disk
+        };
+
+        Type type = Write;
+        KIO::fileoffset_t offset = 0;
+        QByteArray data; ///< the record for Sync
+
+        // only used for Sync
+        QString recordFile;
+
+        // only used for VerifyPiece
+        int piece = -1;
+        KIO::filesize_t length = 0;
+        QCryptographicHash::Algorithm algorithm = QCryptographicHash::Md5;
+        QString checksum;
+    };
+
+    const QString m_fileName;
+    int m_fd;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_dataAvailable;
+    QQueue<WriteRequest> m_queue;
+    qint64 m_queuedBytes;
+    bool m_closing;
+    bool m_failed;
+
+    // only accessed from within the thread while it is running
+    QString m_hashType;
+    QCryptographicHash *m_hash;
+    KIO::fileoffset_t m_hashedOffset;
+    QMap<KIO::fileoffset_t, KIO::fileoffset_t> m_unhashedRanges;
+    QByteArray m_readBuffer;
+    QString m_checksum;
+};
+
+#endif
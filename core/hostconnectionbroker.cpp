@@ -0,0 +1,241 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+#include "hostconnectionbroker.h"
+#include "settings.h"
+
+#include "core/transfer.h"
+
+#include "kget_debug.h"
+
+#include <QSet>
+
+Q_GLOBAL_STATIC(HostConnectionBroker, hostConnectionBroker)
+
+HostConnectionBroker::HostConnectionBroker()
+    : QObject(nullptr)
+{
+}
+
+HostConnectionBroker::~HostConnectionBroker()
+{
+}
+
+HostConnectionBroker *HostConnectionBroker::self()
+{
+    return hostConnectionBroker;
+}
+
+QString HostConnectionBroker::hostOf(const QUrl &url)
+{
+    if (url.isLocalFile()) {
+        return QString();
+    }
+    return url.host().toLower();
+}
+
+QObject *HostConnectionBroker::transferOf(QObject *holder)
+{
+    for (QObject *object = holder; object; object = object->parent()) {
+        if (qobject_cast<Transfer *>(object)) {
+            return object;
+        }
+    }
+    return holder;
+}
+
+int HostConnectionBroker::maxConnections(const QString &host) const
+{
+    // entries look like "example.com=4"
+    foreach (const QString &limit, Settings::hostConnectionLimits()) {
+        const int separator = limit.lastIndexOf('=');
+        if ((separator > 0) && !limit.left(separator).trimmed().compare(host, Qt::CaseInsensitive)) {
+            bool ok = false;
+            const int connections = limit.mid(separator + 1).toInt(&ok);
+            if (ok && (connections >= 0)) {
+                return connections;
+            }
+        }
+    }
+
+    return Settings::maxConnectionsPerHost();
+}
+
+int HostConnectionBroker::connections(const QString &host) const
+{
+    return m_hosts.value(host.toLower()).holders.count();
+}
+
+int HostConnectionBroker::queuedRequests(const QString &host) const
+{
+    return m_hosts.value(host.toLower()).waiting.count();
+}
+
+int HostConnectionBroker::held(const Host &host, QObject *transfer) const
+{
+    int count = 0;
+    foreach (QObject *holder, host.holders) {
+        if (m_transferOf.value(holder) == transfer) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+bool HostConnectionBroker::canGrant(const Host &host, const QString &hostName, QObject *transfer) const
+{
+    const int max = maxConnections(hostName);
+    if (!max) {
+        return true;
+    }
+    if (host.holders.count() >= max) {
+        return false;
+    }
+
+    QSet<QObject *> transfers;
+    transfers.insert(transfer);
+    foreach (QObject *holder, host.holders + host.waiting) {
+        transfers.insert(m_transferOf.value(holder));
+    }
+
+    // beyond its share a transfer only gets connections nobody else is waiting for
+    const int share = qMax(1, max / transfers.count());
+    if (held(host, transfer) < share) {
+        return true;
+    }
+    foreach (QObject *holder, host.waiting) {
+        if (m_transferOf.value(holder) != transfer) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HostConnectionBroker::acquire(QObject *holder, const QUrl &url)
+{
+    const QString hostName = hostOf(url);
+    if (hostName.isEmpty()) {
+        return true;
+    }
+
+    // e.g. redirected to another host
+    if (m_hostOf.contains(holder) && (m_hostOf.value(holder) != hostName)) {
+        release(holder);
+    }
+
+    Host &host = m_hosts[hostName];
+    if (host.holders.contains(holder)) {
+        return true;
+    }
+
+    QObject *transfer = transferOf(holder);
+    m_hostOf[holder] = hostName;
+    m_transferOf[holder] = transfer;
+    connect(holder, &QObject::destroyed, this, &HostConnectionBroker::slotHolderDestroyed, Qt::UniqueConnection);
+
+    if (canGrant(host, hostName, transfer)) {
+        host.waiting.removeAll(holder);
+        host.holders.append(holder);
+        return true;
+    }
+
+    if (!host.waiting.contains(holder)) {
+        qCDebug(KGET_DEBUG) << "Connection limit of" << hostName << "reached, queuing" << holder;
+        host.waiting.append(holder);
+    }
+
+    // refused because of its share, a free connection then goes to whoever has the fewest
+    grantWaiting(hostName);
+    return m_hosts.value(hostName).holders.contains(holder);
+}
+
+void HostConnectionBroker::release(QObject *holder)
+{
+    if (!m_hostOf.contains(holder)) {
+        return;
+    }
+
+    const QString hostName = m_hostOf.take(holder);
+    m_transferOf.remove(holder);
+    disconnect(holder, &QObject::destroyed, this, &HostConnectionBroker::slotHolderDestroyed);
+
+    Host &host = m_hosts[hostName];
+    host.waiting.removeAll(holder);
+    if (host.holders.removeAll(holder)) {
+        grantWaiting(hostName);
+    }
+
+    const Host remaining = m_hosts.value(hostName);
+    if (remaining.holders.isEmpty() && remaining.waiting.isEmpty()) {
+        m_hosts.remove(hostName);
+    }
+}
+
+bool HostConnectionBroker::handOver(QObject *holder, QObject *newHolder)
+{
+    // e.g. the connection of newHolder to another host
+    release(newHolder);
+
+    if (!m_hostOf.contains(holder) || !m_hosts.value(m_hostOf.value(holder)).holders.contains(holder)) {
+        return false;
+    }
+
+    const QString hostName = m_hostOf.take(holder);
+    m_transferOf.remove(holder);
+    disconnect(holder, &QObject::destroyed, this, &HostConnectionBroker::slotHolderDestroyed);
+
+    QList<QObject *> &holders = m_hosts[hostName].holders;
+    holders[holders.indexOf(holder)] = newHolder;
+    m_hostOf[newHolder] = hostName;
+    m_transferOf[newHolder] = transferOf(newHolder);
+    connect(newHolder, &QObject::destroyed, this, &HostConnectionBroker::slotHolderDestroyed, Qt::UniqueConnection);
+
+    return true;
+}
+
+void HostConnectionBroker::grantWaiting(const QString &hostName)
+{
+    const int max = maxConnections(hostName);
+
+    // granting can lead to new requests and releases, so start over after each grant
+    bool granted = true;
+    while (granted && m_hosts.contains(hostName)) {
+        granted = false;
+        Host &host = m_hosts[hostName];
+
+        // the transfer with the fewest connections goes first, otherwise the one waiting longest
+        QObject *next = nullptr;
+        int fewest = 0;
+        foreach (QObject *holder, host.waiting) {
+            const int count = held(host, m_transferOf.value(holder));
+            if (!next || (count < fewest)) {
+                next = holder;
+                fewest = count;
+            }
+        }
+
+        // no need to check the share, nobody waiting has fewer connections
+        if (next && (!max || (host.holders.count() < max))) {
+            host.waiting.removeAll(next);
+            host.holders.append(next);
+            granted = true;
+            qCDebug(KGET_DEBUG) << "Connection to" << hostName << "acquired by" << next;
+            // only the holder is notified, not everything waiting for a connection
+            if (!QMetaObject::invokeMethod(next, "slotConnectionAcquired")) {
+                qCWarning(KGET_DEBUG) << next << "has no slot slotConnectionAcquired(), releasing its connection to" << hostName;
+                release(next);
+            }
+        }
+    }
+}
+
+void HostConnectionBroker::slotHolderDestroyed(QObject *holder)
+{
+    release(holder);
+}
+
+#include "moc_hostconnectionbroker.cpp"
@@ -0,0 +1,103 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+#ifndef KGET_HOST_CONNECTION_BROKER_H
+#define KGET_HOST_CONNECTION_BROKER_H
+
+#include "kget_export.h"
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QUrl>
+
+/**
+ * Limits the number of connections all transfers together open to the same host.
+ *
+ * Everything that opens a connection acquires it here first and releases it once the
+ * connection is closed. If the limit of the host is reached the request is queued and
+ * the slot slotConnectionAcquired() of the holder is called once it got a connection,
+ * every holder has to have that slot. The connections of a host are shared
+ * fairly between the transfers that want them, a transfer that has more than its share
+ * only gets another one if no other transfer is waiting.
+ *
+ * The limit is MaxConnectionsPerHost, it can be overridden per host with
+ * HostConnectionLimits. Local files are not limited.
+ */
+class KGET_EXPORT HostConnectionBroker : public QObject
+{
+    Q_OBJECT
+
+public:
+    HostConnectionBroker();
+    ~HostConnectionBroker() override;
+
+    static HostConnectionBroker *self();
+
+    /**
+     * Acquires a connection to the host of url for holder, the transfer holder
+     * belongs to is determined by its parents
+     * @return true if holder may connect, otherwise the request is queued and the
+     * slot slotConnectionAcquired() of holder is called once it got a connection
+     * @note every holder has at most one connection, acquiring it again does nothing
+     */
+    bool acquire(QObject *holder, const QUrl &url);
+
+    /**
+     * Releases the connection of holder or removes its queued request
+     * @note happens automatically if holder is destroyed
+     */
+    void release(QObject *holder);
+
+    /**
+     * Hands the connection of holder over to newHolder, e.g. when an open socket outlives
+     * the object that connected it; nobody waiting gets the connection in between
+     * @return false if holder has no connection, then newHolder has none either
+     */
+    bool handOver(QObject *holder, QObject *newHolder);
+
+    /**
+     * @return the maximum number of connections to host, 0 if there is no limit
+     */
+    int maxConnections(const QString &host) const;
+
+    /**
+     * @return the number of connections to host that are currently used
+     */
+    int connections(const QString &host) const;
+
+    /**
+     * @return the number of requests for host that are waiting for a connection
+     */
+    int queuedRequests(const QString &host) const;
+
+private Q_SLOTS:
+    void slotHolderDestroyed(QObject *holder);
+
+private:
+    struct Host {
+        QList<QObject *> holders;
+        QList<QObject *> waiting;
+    };
+
+    static QString hostOf(const QUrl &url);
+    static QObject *transferOf(QObject *holder);
+    bool canGrant(const Host &host, const QString &hostName, QObject *transfer) const;
+    int held(const Host &host, QObject *transfer) const;
+
+    /**
+     * Hands free connections of hostName to the waiting requests
+     */
+    void grantWaiting(const QString &hostName);
+
+private:
+    QHash<QString, Host> m_hosts;
+    QHash<QObject *, QString> m_hostOf; ///< the host each holder or waiting request is for
+    QHash<QObject *, QObject *> m_transferOf;
+};
+
+#endif
@@ -631,6 +631,13 @@ QList<TransferFactory *> KGet::factories()
     return m_transferFactories;
 }
 
+void KGet::addTransferFactory(TransferFactory *factory)
+{
+    if (factory && !m_transferFactories.contains(factory)) {
+        m_transferFactories.append(factory);
+    }
+}
+
 QVector<KPluginMetaData> KGet::plugins()
 {
     return m_pluginList;
@@ -233,6 +233,12 @@ public:
      */
     static QList<TransferFactory *> factories();
 
+    /**
+     * Adds a factory that was not loaded by KGet itself, e.g. a plugin
+     * that is loaded from the build directory by a benchmark
+     */
+    static void addTransferFactory(TransferFactory *factory);
+
     /**
      * @returns a list of pluginInfos associated with all transferFactories
      */
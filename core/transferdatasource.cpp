@@ -51,6 +51,26 @@ QPair<int, int> TransferDataSource::removeConnection()
     return QPair<int, int>(-1, -1);
 }
 
+bool TransferDataSource::addDuplicateSegment(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, int segment)
+{
+    Q_UNUSED(segmentSize)
+    Q_UNUSED(segment)
+    return false;
+}
+
+KIO::filesize_t TransferDataSource::cancelSegment(int segment)
+{
+    Q_UNUSED(segment)
+    return 0;
+}
+
+bool TransferDataSource::addLookaheadSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    Q_UNUSED(segmentSize)
+    Q_UNUSED(segmentRange)
+    return false;
+}
+
 QList<QPair<int, int>> TransferDataSource::assignedSegments() const
 {
     return QList<QPair<int, int>>();
@@ -50,7 +50,8 @@ public:
      * if not successful it will try to download the file nevertheless
      * @note if stop is called and no size is found yet then this is aborted, i.e. needs to be
      * called again if start is later called
-     * @param segmentSize the segments should have
+     * @param segmentSize the segments should have, if it is 0 segmentSizeNeeded is emitted
+     * once the size is known
      */
     virtual void findFileSize(KIO::fileoffset_t segmentSize);
 
@@ -71,6 +72,35 @@ public:
      */
     virtual QPair<int, int> removeConnection();
 
+    /**
+     * Downloads a segment that is assigned already with an additional connection, e.g. when
+     * the connection downloading it is slow and nothing else is left to download
+     * @param segmentSize the size of the segment, see addSegments
+     * @param segment the segment to download
+     * @return false if this is not supported
+     * @note the data of that connection is emitted with duplicateData
+     * @note default implementation returns false
+     */
+    virtual bool addDuplicateSegment(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, int segment);
+
+    /**
+     * Stops the connection that downloads only segment, e.g. because another connection
+     * finished it already
+     * @return the number of bytes of segment the connection had downloaded
+     * @note default implementation returns 0
+     */
+    virtual KIO::filesize_t cancelSegment(int segment);
+
+    /**
+     * Adds segments for the connection that emitted requestSegments, it downloads them once
+     * its current segments are finished
+     * @return false if no connection requested segments or if this is not supported, the
+     * segments are not assigned then
+     * @note only valid while requestSegments is emitted
+     * @note default implementation returns false
+     */
+    virtual bool addLookaheadSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+
     QUrl sourceUrl() const
     {
         return m_sourceUrl;
@@ -94,6 +124,15 @@ public:
         m_supposedSize = supposedSize;
     }
 
+    /**
+     * Called once the receiver of data() accepts data again after it refused some, so that
+     * the refused data can be handed on right away
+     * @note refused data is never an error, a failed write is handled by the receiver
+     */
+    virtual void resumeWriting()
+    {
+    }
+
     /**
      * Returns the assignedSegments to this TransferDataSource
      * Each connection is represented by a QPair, where the first int is the beginning
@@ -153,6 +192,13 @@ Q_SIGNALS:
      */
     void foundFileSize(TransferDataSource *source, KIO::filesize_t fileSize, const QPair<int, int> &segmentRange);
 
+    /**
+     * Emitted before foundFileSize if findFileSize was called without a segmentSize
+     * @param fileSize that was found
+     * @param segmentSize set this to the size the segments should have
+     */
+    void segmentSizeNeeded(KIO::filesize_t fileSize, KIO::fileoffset_t &segmentSize);
+
     /**
      * Emitted when the capabilities of the TransferDataSource change
      */
@@ -175,6 +221,12 @@ Q_SIGNALS:
      */
     void data(KIO::fileoffset_t offset, const QByteArray &data, bool &worked);
 
+    /**
+     * Returns the data of a connection added with addDuplicateSegment
+     * @see data(KIO::fileoffset_t, const QByteArray &, bool &)
+     */
+    void duplicateData(KIO::fileoffset_t offset, const QByteArray &data, bool &worked);
+
     /**
      * Returns data in the forms of URL List
      * @param data in form of QUrl list
@@ -225,8 +277,18 @@ Q_SIGNALS:
     /**
      * Emitted when a Datasource itself decides to not download a specific segmentRange,
      * e.g. when there are too many connections for this TransferDataSource
+     * @param error true if the segments are freed because of an error of the source,
+     * false if they are only moved to other connections, e.g. because one stalled
      */
-    void freeSegments(TransferDataSource *source, QPair<int, int> segmentRange);
+    void freeSegments(TransferDataSource *source, QPair<int, int> segmentRange, bool error);
+
+    /**
+     * Emitted with the current speeds of the running connections of source
+     * @param speeds the speeds in bytes/s
+     * @param median set to the median speed of all running connections of the transfer,
+     * 0 if not enough connections are known
+     */
+    void connectionSpeeds(TransferDataSource *source, const QList<double> &speeds, double &median);
 
     void log(const QString &message, Transfer::LogLevel logLevel);
 
@@ -235,6 +297,31 @@ Q_SIGNALS:
      */
     void urlChanged(const QUrl &old, const QUrl &newUrl);
 
+    /**
+     * Emitted with the validators a server sent for the file, if they differ from the ones
+     * the download was started with the file changed
+     * @param source the source that emitted this signal
+     * @param etag the ETag of the file, empty if unknown
+     * @param lastModified the Last-Modified date of the file, empty if unknown
+     */
+    void validators(TransferDataSource *source, const QString &etag, const QString &lastModified);
+
+    /**
+     * Emitted once the response to a request of one of the connections started
+     * @param source the source that emitted this signal
+     * @param msecs the time between sending the request and the start of the response
+     */
+    void timeToFirstByte(TransferDataSource *source, qint64 msecs);
+
+    /**
+     * Emitted when a connection is about to finish its segments, the receiver should assign
+     * the next ones right away with addLookaheadSegments, so that the connection does not
+     * wait for them
+     * @param source the source that emitted this signal
+     * @param lastSegment the last segment assigned to the connection
+     */
+    void requestSegments(TransferDataSource *source, int lastSegment);
+
 protected:
     /**
      * Sets the capabilities and automatically emits capabilitiesChanged
@@ -91,30 +91,34 @@ void VerificationThread::doVerify()
     m_mutex.unlock();
 
     while (run && !m_abort) {
+        // the checksums queued for the same file are calculated in one pass
         m_mutex.lock();
-        const QString type = m_types.takeFirst();
-        const QString checksum = m_checksums.takeFirst();
-        const QUrl url = m_files.takeFirst();
-        m_mutex.unlock();
-
-        if (type.isEmpty() || checksum.isEmpty()) {
-            m_mutex.lock();
-            run = m_files.count();
-            m_mutex.unlock();
-            continue;
+        const QUrl url = m_files.first();
+        QStringList types;
+        QStringList checksums;
+        while (!m_files.isEmpty() && (m_files.first() == url)) {
+            m_files.removeFirst();
+            const QString type = m_types.takeFirst();
+            const QString checksum = m_checksums.takeFirst();
+            if (!type.isEmpty() && !checksum.isEmpty()) {
+                types.append(type);
+                checksums.append(checksum);
+            }
         }
+        m_mutex.unlock();
 
-        const QString hash = Verifier::checksum(url, type, &m_abort);
-        qCDebug(KGET_DEBUG) << "Type:" << type << "Calculated checksum:" << hash << "Entered checksum:" << checksum;
-        const bool fileVerified = (hash == checksum);
+        const QHash<QString, QString> hashes = (types.isEmpty() ? QHash<QString, QString>() : Verifier::checksums(url, types, &m_abort));
 
         if (m_abort) {
             return;
         }
 
         m_mutex.lock();
-        if (!m_abort) {
-            Q_EMIT verified(type, fileVerified, url);
+        for (int i = 0; (i < types.count()) && !m_abort; ++i) {
+            const QString hash = hashes.value(types.at(i));
+            qCDebug(KGET_DEBUG) << "Type:" << types.at(i) << "Calculated checksum:" << hash << "Entered checksum:" << checksums.at(i);
+            const bool fileVerified = (hash == checksums.at(i));
+            Q_EMIT verified(types.at(i), fileVerified, url);
             Q_EMIT verified(fileVerified);
         }
         run = m_files.count();
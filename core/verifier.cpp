@@ -25,12 +25,21 @@
 
 #include <QDomElement>
 #include <QFile>
+#include <QThread>
+#include <QThreadPool>
 
 #include "kget_debug.h"
 #include <QDebug>
 
+#include <memory>
 #include <vector>
 
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 struct VerifierAlgo {
     QString type;
     QCryptographicHash::Algorithm qtType;
@@ -45,6 +54,10 @@ const std::vector<VerifierAlgo> SUPPORTED_ALGOS = {{"sha512", QCryptographicHash
                                                    {"md4", QCryptographicHash::Md4, 32}};
 
 const int VerifierPrivate::PARTSIZE = 500 * 1024;
+// files are hashed in windows of this size, the pages behind the window are dropped from the cache
+const KIO::filesize_t READ_WINDOW = 16 * 1024 * 1024;
+// the block size if a file can not be mapped
+const int READ_BUFFER_SIZE = 1024 * 1024;
 
 VerifierPrivate::~VerifierPrivate()
 {
@@ -63,6 +76,91 @@ static QCryptographicHash::Algorithm qtAlgorithmForType(const QString &type)
     return QCryptographicHash::Md5;
 }
 
+/**
+ * @return the number of pieces of a file, length is set to the default piece length if it is 0
+ */
+static int pieceCount(KIO::filesize_t fileSize, KIO::filesize_t *length)
+{
+    int numPieces = 0;
+
+    // the piece length has been defined
+    if (*length) {
+        numPieces = fileSize / *length;
+    } else {
+        *length = VerifierPrivate::PARTSIZE;
+        numPieces = fileSize / *length;
+        if (numPieces > 100) {
+            numPieces = 100;
+            *length = fileSize / numPieces;
+        }
+    }
+
+    // there is a rest, so increase numPieces by one
+    if (fileSize % *length) {
+        ++numPieces;
+    }
+
+    return numPieces;
+}
+
+bool VerifierPrivate::readFile(QFile *file,
+                               KIO::fileoffset_t offset,
+                               KIO::filesize_t length,
+                               const std::function<void(const char *, qint64)> &consume,
+                               bool *abortPtr)
+{
+    // only what exists can be mapped, reading past the end of a mapping is fatal
+    const bool mappable = (static_cast<KIO::filesize_t>(file->size()) >= offset + length);
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(file->handle(), offset, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    QByteArray buffer;
+    KIO::filesize_t done = 0;
+    while (done < length) {
+        if (abortPtr && *abortPtr) {
+            return false;
+        }
+
+        const KIO::fileoffset_t windowOffset = offset + done;
+        const qint64 size = qMin(READ_WINDOW, length - done);
+        uchar *map = (mappable ? file->map(windowOffset, size) : nullptr);
+        if (map) {
+#ifdef Q_OS_UNIX
+            // the mapping starts at the page that contains windowOffset
+            const quintptr pageSize = sysconf(_SC_PAGESIZE);
+            uchar *page = reinterpret_cast<uchar *>(reinterpret_cast<quintptr>(map) & ~(pageSize - 1));
+            ::madvise(page, map + size - page, MADV_SEQUENTIAL);
+#endif
+            consume(reinterpret_cast<const char *>(map), size);
+            file->unmap(map);
+        } else {
+            if (buffer.isEmpty()) {
+                buffer.resize(READ_BUFFER_SIZE);
+            }
+            if (!file->seek(windowOffset)) {
+                return false;
+            }
+            for (qint64 left = size; left > 0;) {
+                const qint64 read = file->read(buffer.data(), qMin(left, static_cast<qint64>(buffer.size())));
+                if (read <= 0) {
+                    return false;
+                }
+                consume(buffer.constData(), read);
+                left -= read;
+            }
+        }
+
+#ifdef POSIX_FADV_DONTNEED
+        // the data is not needed anymore, so it does not evict what other programs cache
+        ::posix_fadvise(file->handle(), windowOffset, size, POSIX_FADV_DONTNEED);
+#endif
+        done += size;
+    }
+
+    return true;
+}
+
 QString VerifierPrivate::calculatePartialChecksum(QFile *file,
                                                   const QString &type,
                                                   KIO::fileoffset_t startOffset,
@@ -82,38 +180,16 @@ QString VerifierPrivate::calculatePartialChecksum(QFile *file,
         pieceLength = fileSize - startOffset;
     }
 
-    QCryptographicHash hash(qtAlgorithmForType(type));
-
-    // we only read 512kb each time, to save RAM
-    int numData = pieceLength / PARTSIZE;
-    KIO::fileoffset_t dataRest = pieceLength % PARTSIZE;
-
-    if (!numData && !dataRest) {
+    if (pieceLength <= 0) {
         return QString();
     }
 
-    int k = 0;
-    for (k = 0; k < numData; ++k) {
-        if (!file->seek(startOffset + PARTSIZE * k)) {
-            return QString();
-        }
-
-        if (abortPtr && *abortPtr) {
-            return QString();
-        }
-
-        QByteArray data = file->read(PARTSIZE);
-        hash.addData(data);
-    }
-
-    // now read the rest
-    if (dataRest) {
-        if (!file->seek(startOffset + PARTSIZE * k)) {
-            return QString();
-        }
-
-        QByteArray data = file->read(dataRest);
-        hash.addData(data);
+    QCryptographicHash hash(qtAlgorithmForType(type));
+    auto consume = [&hash](const char *data, qint64 size) {
+        hash.addData(data, size);
+    };
+    if (!readFile(file, startOffset, pieceLength, consume, abortPtr)) {
+        return QString();
     }
 
     return hash.result().toHex();
@@ -232,6 +308,11 @@ QString Verifier::cleanChecksumType(const QString &type)
     return hashType;
 }
 
+QCryptographicHash::Algorithm Verifier::hashAlgorithm(const QString &type)
+{
+    return qtAlgorithmForType(type);
+}
+
 bool Verifier::isVerifyable() const
 {
     return QFile::exists(d->dest.toLocalFile()) && d->model->rowCount();
@@ -333,6 +414,16 @@ void Verifier::verify(const QModelIndex &index)
         checksum = d->model->index(row, VerificationModel::Checksum).data().toString();
     }
 
+    // the checksum is known already, no need to read the file; later verifications read it though,
+    // as it might have been changed since
+    const Checksum calculated = d->calculatedChecksum;
+    d->calculatedChecksum = Checksum();
+    if (!type.isEmpty() && !checksum.isEmpty() && (type == calculated.first)) {
+        qCDebug(KGET_DEBUG) << "Type:" << type << "Already calculated checksum:" << calculated.second << "Entered checksum:" << checksum;
+        QMetaObject::invokeMethod(this, "changeStatus", Qt::QueuedConnection, Q_ARG(QString, type), Q_ARG(bool, (calculated.second == checksum)));
+        return;
+    }
+
     d->thread.verify(type, checksum, d->dest);
 }
 
@@ -361,16 +452,12 @@ QString Verifier::checksum(const QUrl &dest, const QString &type, bool *abortPtr
     }
 
     QCryptographicHash hash(qtAlgorithmForType(type));
-
-    char buffer[1024];
-    int len;
-
-    while ((len = file.read(reinterpret_cast<char *>(buffer), sizeof(buffer))) > 0) {
-        hash.addData(buffer, len);
-        if (abortPtr && *abortPtr) {
-            file.close();
-            return QString();
-        }
+    auto consume = [&hash](const char *data, qint64 size) {
+        hash.addData(data, size);
+    };
+    if (!VerifierPrivate::readFile(&file, 0, file.size(), consume, abortPtr)) {
+        file.close();
+        return QString();
     }
     QString final = hash.result().toHex();
     file.close();
@@ -396,43 +483,145 @@ PartialChecksums Verifier::partialChecksums(const QUrl &dest, const QString &typ
         return PartialChecksums();
     }
 
-    int numPieces = 0;
+    const int numPieces = pieceCount(fileSize, &length);
 
-    // the piece length has been defined
-    if (length) {
-        numPieces = fileSize / length;
-    } else {
-        length = VerifierPrivate::PARTSIZE;
-        numPieces = fileSize / length;
-        if (numPieces > 100) {
-            numPieces = 100;
-            length = fileSize / numPieces;
+    file.close();
+
+    // the pieces are independent, so they are hashed in parallel, each thread with its own file handle
+    const QString path = dest.toLocalFile();
+    std::vector<QString> hashes(numPieces);
+    QAtomicInt nextPiece(0);
+    QAtomicInt failed(0);
+    auto hashPieces = [&]() {
+        QFile pieceFile(path);
+        if (!pieceFile.open(QIODevice::ReadOnly)) {
+            failed.storeRelease(1);
+            return;
         }
-    }
 
-    // there is a rest, so increase numPieces by one
-    if (fileSize % length) {
-        ++numPieces;
-    }
+        int piece;
+        while (!failed.loadAcquire() && ((piece = nextPiece.fetchAndAddOrdered(1)) < numPieces)) {
+            const QString hash = VerifierPrivate::calculatePartialChecksum(&pieceFile, type, length * piece, length, fileSize, abortPtr);
+            if (hash.isEmpty()) {
+                failed.storeRelease(1);
+                return;
+            }
+            hashes[piece] = hash;
+        }
+    };
 
-    PartialChecksums partialChecksums;
+    // the calling thread hashes as well
+    const int threads = qBound(1, QThread::idealThreadCount(), numPieces);
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads - 1);
+    for (int i = 1; i < threads; ++i) {
+        pool.start(QRunnable::create(hashPieces));
+    }
+    hashPieces();
+    pool.waitForDone();
 
-    // create all the checksums for the pieces
-    for (int i = 0; i < numPieces; ++i) {
-        QString hash = VerifierPrivate::calculatePartialChecksum(&file, type, length * i, length, fileSize, abortPtr);
-        if (hash.isEmpty()) {
-            file.close();
-            return PartialChecksums();
-        }
+    if (failed.loadAcquire()) {
+        return PartialChecksums();
+    }
+    for (const QString &hash : hashes) {
         checksums.append(hash);
     }
 
+    PartialChecksums partialChecksums;
     partialChecksums.setLength(length);
     partialChecksums.setChecksums(checksums);
-    file.close();
     return partialChecksums;
 }
 
+QHash<QString, QString> Verifier::checksums(const QUrl &dest, const QStringList &types, bool *abortPtr)
+{
+    return checksums(dest, types, QStringList(), nullptr, 0, abortPtr);
+}
+
+QHash<QString, QString> Verifier::checksums(const QUrl &dest,
+                                            const QStringList &types,
+                                            const QStringList &partialTypes,
+                                            QHash<QString, PartialChecksums> *partialChecksums,
+                                            KIO::filesize_t length,
+                                            bool *abortPtr)
+{
+    const QStringList supported = supportedVerficationTypes();
+
+    QFile file(dest.toLocalFile());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QHash<QString, QString>();
+    }
+    const KIO::filesize_t fileSize = file.size();
+
+    // every block that is read is fed to all hashes
+    std::vector<std::pair<QString, std::unique_ptr<QCryptographicHash>>> hashes;
+    foreach (const QString &type, types) {
+        if (supported.contains(type)) {
+            hashes.emplace_back(type, std::unique_ptr<QCryptographicHash>(new QCryptographicHash(qtAlgorithmForType(type))));
+        }
+    }
+
+    // empty files have no pieces
+    std::vector<std::pair<QString, std::unique_ptr<QCryptographicHash>>> pieceHashes;
+    QHash<QString, QStringList> pieces;
+    if (partialChecksums && fileSize) {
+        pieceCount(fileSize, &length);
+        foreach (const QString &type, partialTypes) {
+            if (supported.contains(type)) {
+                pieceHashes.emplace_back(type, std::unique_ptr<QCryptographicHash>(new QCryptographicHash(qtAlgorithmForType(type))));
+            }
+        }
+    }
+
+    if (hashes.empty() && pieceHashes.empty()) {
+        return QHash<QString, QString>();
+    }
+
+    KIO::filesize_t pieceLeft = length;
+    auto consume = [&](const char *data, qint64 read) {
+        for (auto &hash : hashes) {
+            hash.second->addData(data, read);
+        }
+
+        // the block may end several pieces
+        qint64 offset = 0;
+        while (!pieceHashes.empty() && (offset < read)) {
+            const qint64 size = qMin(static_cast<KIO::filesize_t>(read - offset), pieceLeft);
+            for (auto &hash : pieceHashes) {
+                hash.second->addData(data + offset, size);
+            }
+            offset += size;
+            pieceLeft -= size;
+            if (!pieceLeft) {
+                for (auto &hash : pieceHashes) {
+                    pieces[hash.first].append(QString::fromLatin1(hash.second->result().toHex()));
+                    hash.second->reset();
+                }
+                pieceLeft = length;
+            }
+        }
+    };
+    if (!VerifierPrivate::readFile(&file, 0, fileSize, consume, abortPtr)) {
+        return QHash<QString, QString>();
+    }
+
+    // the last piece is shorter
+    if (pieceLeft != length) {
+        for (auto &hash : pieceHashes) {
+            pieces[hash.first].append(QString::fromLatin1(hash.second->result().toHex()));
+        }
+    }
+
+    QHash<QString, QString> result;
+    for (const auto &hash : hashes) {
+        result[hash.first] = QString::fromLatin1(hash.second->result().toHex());
+    }
+    for (const auto &hash : pieceHashes) {
+        (*partialChecksums)[hash.first] = PartialChecksums(length, pieces.value(hash.first));
+    }
+    return result;
+}
+
 void Verifier::addChecksum(const QString &type, const QString &checksum, int verified)
 {
     d->model->addChecksum(type, checksum, verified);
@@ -443,6 +632,15 @@ void Verifier::addChecksums(const QHash<QString, QString> &checksums)
     d->model->addChecksums(checksums);
 }
 
+void Verifier::setCalculatedChecksum(const QString &type, const QString &checksum)
+{
+    if (checksum.isEmpty()) {
+        d->calculatedChecksum = Checksum();
+    } else {
+        d->calculatedChecksum = Checksum(type, checksum);
+    }
+}
+
 void Verifier::addPartialChecksums(const QString &type, KIO::filesize_t length, const QStringList &checksums)
 {
     if (!d->partialSums.contains(type) && length && !checksums.isEmpty()) {
@@ -492,6 +690,14 @@ void Verifier::save(const QDomElement &element)
         }
         verification.appendChild(pieces);
     }
+
+    if (!d->calculatedChecksum.second.isEmpty()) {
+        QDomElement calculated = e.ownerDocument().createElement("calculated");
+        calculated.setAttribute("type", d->calculatedChecksum.first);
+        QDomText value = e.ownerDocument().createTextNode(d->calculatedChecksum.second);
+        calculated.appendChild(value);
+        verification.appendChild(calculated);
+    }
     e.appendChild(verification);
 }
 
@@ -550,6 +756,11 @@ void Verifier::load(const QDomElement &e)
 
         addPartialChecksums(type, length, partialChecksums);
     }
+
+    const QDomElement calculated = verification.firstChildElement("calculated");
+    if (!calculated.isNull()) {
+        setCalculatedChecksum(calculated.attribute("type"), calculated.text());
+    }
 }
 
 #include "moc_verifier.cpp"
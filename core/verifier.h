@@ -23,6 +23,7 @@
 #include <QUrl>
 #include <kio/global.h>
 
+#include <QCryptographicHash>
 #include <QHash>
 #include <QModelIndex>
 #include <QStringList>
@@ -131,6 +132,11 @@ public:
      */
     static QString cleanChecksumType(const QString &type);
 
+    /**
+     * @return the algorithm used to calculate checksums of type, Md5 if type is not supported
+     */
+    static QCryptographicHash::Algorithm hashAlgorithm(const QString &type);
+
     /**
      * Creates the checksum type of the file @p dest
      * @param dest the destination
@@ -150,6 +156,29 @@ public:
      */
     static PartialChecksums partialChecksums(const QUrl &dest, const QString &type, KIO::filesize_t length = 0, bool *abortPtr = nullptr);
 
+    /**
+     * Creates the checksums of several types in one pass over the file @p dest
+     * @param dest the destination
+     * @param types the types of the checksums of the whole file
+     * @param abortPtr makes it possible to abort the calculation of the checksums from another thread
+     * @return the checksums by type, empty if the file could not be read or the calculation was aborted
+     */
+    static QHash<QString, QString> checksums(const QUrl &dest, const QStringList &types, bool *abortPtr);
+
+    /**
+     * Creates the checksums and the partial checksums of several types in one pass over the file @p dest
+     * @param partialTypes the types of the partial checksums
+     * @param partialChecksums the partial checksums by type are stored here
+     * @param length the length of the pieces, chosen as by partialChecksums() if it is 0
+     * @see checksums(const QUrl&, const QStringList&, bool*)
+     */
+    static QHash<QString, QString> checksums(const QUrl &dest,
+                                             const QStringList &types,
+                                             const QStringList &partialTypes,
+                                             QHash<QString, PartialChecksums> *partialChecksums,
+                                             KIO::filesize_t length = 0,
+                                             bool *abortPtr = nullptr);
+
     /**
      * @note only call verify() when this function returns true
      * @return true if the downloaded file exists and a supported checksum is set
@@ -214,6 +243,15 @@ public:
      */
     void addPartialChecksums(const QString &type, KIO::filesize_t length, const QStringList &checksums);
 
+    /**
+     * Sets a checksum of the file that has been calculated already, e.g. while downloading,
+     * the next verify() uses it instead of reading the whole file again if the types match.
+     * It is only used once, as the file might be changed afterwards
+     * @param type the type of the checksum
+     * @param checksum the calculated checksum, an empty checksum removes a set one
+     */
+    void setCalculatedChecksum(const QString &type, const QString &checksum);
+
     /**
      * Returns the length of the "best" partialChecksums
      */
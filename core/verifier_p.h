@@ -26,6 +26,8 @@ class Verifier;
 #include "verificationthread.h"
 #include "verifier.h"
 
+#include <functional>
+
 struct VerifierPrivate {
     VerifierPrivate(Verifier *verifier)
         : q(verifier)
@@ -35,6 +37,17 @@ struct VerifierPrivate {
 
     ~VerifierPrivate();
 
+    /**
+     * Passes length bytes of file from offset on to consume, they are read from a memory
+     * map if possible and in large blocks otherwise
+     * @return false if the file could not be read or abortPtr was set
+     */
+    static bool readFile(QFile *file,
+                         KIO::fileoffset_t offset,
+                         KIO::filesize_t length,
+                         const std::function<void(const char *, qint64)> &consume,
+                         bool *abortPtr);
+
     static QString calculatePartialChecksum(QFile *file,
                                             const QString &type,
                                             KIO::fileoffset_t startOffset,
@@ -52,6 +65,11 @@ struct VerifierPrivate {
 
     QHash<QString, PartialChecksums *> partialSums;
 
+    /**
+     * checksum of the file that was calculated without VerificationThread
+     */
+    Checksum calculatedChecksum;
+
     mutable VerificationThread thread;
 
     static const int PARTSIZE;
@@ -0,0 +1,165 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "bitsettest.h"
+#include "../core/bitset.h"
+
+#include <QtTest>
+
+void BitSetTest::testByteLayout()
+{
+    // the layout is stored in transfers.kgt, so it must not change
+    BitSet bitSet(20);
+    bitSet.set(0, true);
+    bitSet.set(9, true);
+    bitSet.set(19, true);
+
+    QCOMPARE(bitSet.getNumBytes(), 3u);
+    QCOMPARE(bitSet.getData()[0], quint8(0x80));
+    QCOMPARE(bitSet.getData()[1], quint8(0x40));
+    QCOMPARE(bitSet.getData()[2], quint8(0x10));
+    QCOMPARE(bitSet.numOnBits(), 3u);
+
+    bitSet.setAll(true);
+    QCOMPARE(bitSet.numOnBits(), 20u);
+    QVERIFY(bitSet.allOn());
+    QCOMPARE(bitSet.getData()[2], quint8(0xF0));
+}
+
+void BitSetTest::testLoad()
+{
+    // unused bits that are set are ignored
+    const quint8 data[] = {0xFF, 0x00, 0x81, 0xFF};
+    BitSet bitSet(data, 28);
+
+    QCOMPARE(bitSet.numOnBits(), 14u);
+    QVERIFY(bitSet.get(0));
+    QVERIFY(!bitSet.get(8));
+    QVERIFY(bitSet.get(16));
+    QVERIFY(bitSet.get(23));
+    QVERIFY(bitSet.get(27));
+    QVERIFY(!bitSet.get(28));
+    QCOMPARE(bitSet.getData()[3], quint8(0xF0));
+
+    BitSet copy(bitSet);
+    QVERIFY(copy == bitSet);
+    QCOMPARE(copy.numOnBits(), 14u);
+}
+
+void BitSetTest::testSetRange()
+{
+    QFETCH(quint32, numBits);
+    QFETCH(quint32, start);
+    QFETCH(quint32, end);
+
+    BitSet bitSet(numBits);
+    bitSet.setRange(start, end, true);
+    QCOMPARE(bitSet.numOnBits(), end - start + 1);
+    for (quint32 i = 0; i < numBits; ++i) {
+        QCOMPARE(bitSet.get(i), (i >= start) && (i <= end));
+    }
+
+    bitSet.setAll(true);
+    bitSet.setRange(start, end, false);
+    QCOMPARE(bitSet.numOnBits(), numBits - (end - start + 1));
+    for (quint32 i = 0; i < numBits; ++i) {
+        QCOMPARE(bitSet.get(i), (i < start) || (i > end));
+    }
+}
+
+void BitSetTest::testSetRange_data()
+{
+    QTest::addColumn<quint32>("numBits");
+    QTest::addColumn<quint32>("start");
+    QTest::addColumn<quint32>("end");
+
+    QTest::newRow("single bit") << 10u << 3u << 3u;
+    QTest::newRow("within a byte") << 10u << 1u << 6u;
+    QTest::newRow("within a word") << 64u << 5u << 60u;
+    QTest::newRow("whole word") << 64u << 0u << 63u;
+    QTest::newRow("across words") << 200u << 50u << 130u;
+    QTest::newRow("up to the end") << 200u << 100u << 199u;
+    QTest::newRow("everything") << 131u << 0u << 130u;
+}
+
+void BitSetTest::testFindNext()
+{
+    BitSet bitSet(300);
+    QCOMPARE(bitSet.findNext(0, true), -1);
+    QCOMPARE(bitSet.findNext(0, false), 0);
+
+    bitSet.set(70, true);
+    bitSet.set(299, true);
+    QCOMPARE(bitSet.findNext(0, true), 70);
+    QCOMPARE(bitSet.findNext(70, true), 70);
+    QCOMPARE(bitSet.findNext(71, true), 299);
+    QCOMPARE(bitSet.findNext(300, true), -1);
+
+    bitSet.setAll(true);
+    bitSet.set(200, false);
+    QCOMPARE(bitSet.findNext(0, false), 200);
+    QCOMPARE(bitSet.findNext(201, false), -1);
+}
+
+void BitSetTest::testContinuousRange()
+{
+    BitSet bitSet(150);
+    qint32 start = 0;
+    qint32 end = 0;
+
+    bitSet.getContinuousRange(&start, &end, true);
+    QCOMPARE(start, -1);
+    QCOMPARE(end, -1);
+
+    bitSet.getContinuousRange(&start, &end, false);
+    QCOMPARE(start, 0);
+    QCOMPARE(end, 149);
+
+    bitSet.setRange(60, 100, true);
+    bitSet.setRange(120, 130, true);
+    bitSet.getContinuousRange(&start, &end, true);
+    QCOMPARE(start, 60);
+    QCOMPARE(end, 100);
+
+    bitSet.setRange(0, 59, true);
+    bitSet.getContinuousRange(&start, &end, false);
+    QCOMPARE(start, 101);
+    QCOMPARE(end, 119);
+}
+
+void BitSetTest::testOrBitSet()
+{
+    BitSet bitSet(100);
+    bitSet.setRange(0, 9, true);
+
+    BitSet other(130);
+    other.setRange(5, 20, true);
+    other.setRange(90, 129, true);
+
+    bitSet.orBitSet(other);
+    QCOMPARE(bitSet.numOnBits(), 31u);
+    QVERIFY(bitSet.get(20));
+    QVERIFY(!bitSet.get(21));
+    QVERIFY(bitSet.get(99));
+    QCOMPARE(bitSet.findNext(21, true), 90);
+}
+
+QTEST_MAIN(BitSetTest)
+
+#include "moc_bitsettest.cpp"
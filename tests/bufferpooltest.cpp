@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "bufferpooltest.h"
+#include "../core/bufferpool.h"
+
+#include <QtTest>
+
+const int CAPACITY = 256 * 1024;
+
+void BufferPoolTest::init()
+{
+    BufferPool::clear();
+}
+
+void BufferPoolTest::testAcquire()
+{
+    QByteArray buffer = BufferPool::acquire(CAPACITY);
+    QVERIFY(buffer.isEmpty());
+    QVERIFY(buffer.capacity() >= CAPACITY);
+
+    // filling the buffer does not need any allocation
+    const char *data = buffer.constData();
+    buffer.append(QByteArray(CAPACITY, 'a'));
+    QCOMPARE(buffer.constData(), data);
+}
+
+void BufferPoolTest::testReuse()
+{
+    QByteArray buffer = BufferPool::acquire(CAPACITY);
+    buffer.append(QByteArray(1000, 'a'));
+    const char *data = buffer.constData();
+
+    BufferPool::release(buffer);
+    QVERIFY(buffer.isNull());
+    QVERIFY(BufferPool::pooledBytes() >= CAPACITY);
+
+    const QByteArray reused = BufferPool::acquire(CAPACITY);
+    QVERIFY(reused.isEmpty());
+    QCOMPARE(reused.constData(), data);
+    QCOMPARE(BufferPool::pooledBytes(), qint64(0));
+}
+
+void BufferPoolTest::testSharedBuffer()
+{
+    QByteArray buffer = BufferPool::acquire(CAPACITY);
+    buffer.append(QByteArray(1000, 'a'));
+
+    // the data is still used by someone else, so it must not be touched
+    const QByteArray handedOn = buffer;
+    BufferPool::release(buffer);
+    QCOMPARE(BufferPool::pooledBytes(), qint64(0));
+    QCOMPARE(handedOn, QByteArray(1000, 'a'));
+
+    // small buffers are not kept
+    QByteArray small(100, 'b');
+    BufferPool::release(small);
+    QCOMPARE(BufferPool::pooledBytes(), qint64(0));
+}
+
+void BufferPoolTest::testSmallestFits()
+{
+    QByteArray big = BufferPool::acquire(4 * CAPACITY);
+    QByteArray medium = BufferPool::acquire(CAPACITY);
+    const char *mediumData = medium.constData();
+    BufferPool::release(big);
+    BufferPool::release(medium);
+
+    const QByteArray buffer = BufferPool::acquire(CAPACITY / 2);
+    QCOMPARE(buffer.constData(), mediumData);
+    const QByteArray tooBig = BufferPool::acquire(8 * CAPACITY);
+    QVERIFY(tooBig.capacity() >= 8 * CAPACITY);
+    QVERIFY(BufferPool::pooledBytes() >= 4 * CAPACITY);
+}
+
+QTEST_MAIN(BufferPoolTest)
+
+#include "moc_bufferpooltest.cpp"
@@ -0,0 +1,188 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "corebenchmark.h"
+#include "../core/bitset.h"
+#include "../core/verifier.h"
+
+#include <QRandomGenerator>
+#include <QtTest>
+
+const qint64 MiB = 1024 * 1024;
+const qint64 GB = 1000 * 1000 * 1000;
+const qint64 SEGMENT_SIZE = 512 * 1024;
+const int DEFAULT_FILE_SIZE = 64;
+
+void CoreBenchmark::initTestCase()
+{
+    QVERIFY(m_tempDir.isValid());
+
+    bool ok = false;
+    int size = qEnvironmentVariableIntValue("KGET_BENCHMARK_FILE_SIZE", &ok);
+    if (!ok || (size <= 0)) {
+        size = DEFAULT_FILE_SIZE;
+    }
+
+    // random data, so that the file content is realistic
+    m_file = QUrl::fromLocalFile(m_tempDir.filePath(QStringLiteral("checksum.bin")));
+    QFile file(m_file.toLocalFile());
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QByteArray data(MiB, Qt::Uninitialized);
+    for (int i = 0; i < size; ++i) {
+        QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(data.data()), data.size() / sizeof(quint32));
+        QCOMPARE(file.write(data), MiB);
+    }
+}
+
+void CoreBenchmark::bitSetData()
+{
+    QTest::addColumn<quint32>("bits");
+
+    for (qint64 size : {1 * GB, 10 * GB, 100 * GB}) {
+        const quint32 bits = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+        QTest::newRow(qPrintable(QStringLiteral("%1 GB").arg(size / GB))) << bits;
+    }
+}
+
+void CoreBenchmark::bitSetSetRange_data()
+{
+    bitSetData();
+}
+
+void CoreBenchmark::bitSetSetRange()
+{
+    QFETCH(quint32, bits);
+
+    // connections finish ranges of a few segments each, scattered over the file
+    BitSet bitSet(bits);
+    QBENCHMARK {
+        for (quint32 start = 0; start < bits; start += 48) {
+            bitSet.setRange(start, qMin(start + 31, bits - 1), true);
+        }
+        bitSet.setRange(0, bits - 1, false);
+    }
+}
+
+void CoreBenchmark::bitSetGetContinuousRange_data()
+{
+    bitSetData();
+}
+
+void CoreBenchmark::bitSetGetContinuousRange()
+{
+    QFETCH(quint32, bits);
+
+    // the worst case is a download that is nearly finished
+    BitSet bitSet(bits);
+    bitSet.setAll(true);
+    bitSet.set(bits - 2, false);
+
+    qint32 start = -1;
+    qint32 end = -1;
+    QBENCHMARK {
+        bitSet.getContinuousRange(&start, &end, false);
+    }
+    QCOMPARE(start, static_cast<qint32>(bits - 2));
+    QCOMPARE(end, static_cast<qint32>(bits - 2));
+}
+
+void CoreBenchmark::bitSetNumOnBits_data()
+{
+    bitSetData();
+}
+
+void CoreBenchmark::bitSetNumOnBits()
+{
+    QFETCH(quint32, bits);
+
+    BitSet bitSet(bits);
+    bitSet.setRange(0, bits / 2, true);
+
+    quint32 on = 0;
+    QBENCHMARK {
+        on = bitSet.numOnBits();
+    }
+    QCOMPARE(on, bits / 2 + 1);
+}
+
+void CoreBenchmark::bitSetAllOn_data()
+{
+    bitSetData();
+}
+
+void CoreBenchmark::bitSetAllOn()
+{
+    QFETCH(quint32, bits);
+
+    BitSet bitSet(bits);
+    bitSet.setAll(true);
+    bitSet.set(bits - 1, false);
+
+    bool allOn = true;
+    QBENCHMARK {
+        allOn = bitSet.allOn();
+    }
+    QVERIFY(!allOn);
+}
+
+void CoreBenchmark::algorithmData()
+{
+    QTest::addColumn<QString>("type");
+
+    const QStringList types = Verifier::supportedVerficationTypes();
+    for (const QString &type : types) {
+        QTest::newRow(qPrintable(type)) << type;
+    }
+}
+
+void CoreBenchmark::verifierChecksum_data()
+{
+    algorithmData();
+}
+
+void CoreBenchmark::verifierChecksum()
+{
+    QFETCH(QString, type);
+
+    QString checksum;
+    QBENCHMARK {
+        checksum = Verifier::checksum(m_file, type, nullptr);
+    }
+    QCOMPARE(checksum.length(), Verifier::diggestLength(type));
+}
+
+void CoreBenchmark::verifierPartialChecksums_data()
+{
+    algorithmData();
+}
+
+void CoreBenchmark::verifierPartialChecksums()
+{
+    QFETCH(QString, type);
+
+    PartialChecksums checksums;
+    QBENCHMARK {
+        checksums = Verifier::partialChecksums(m_file, type);
+    }
+    QVERIFY(!checksums.checksums().isEmpty());
+}
+
+QTEST_MAIN(CoreBenchmark)
+
+#include "moc_corebenchmark.cpp"
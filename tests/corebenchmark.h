@@ -0,0 +1,65 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#ifndef KGET_COREBENCHMARK_H
+#define KGET_COREBENCHMARK_H
+
+#include <QObject>
+#include <QTemporaryDir>
+#include <QUrl>
+
+/**
+ * Benchmarks of the core primitives that run for every chunk of a download.
+ *
+ * BitSet is measured with the number of chunks of 1 GB to 100 GB files in 512 KiB
+ * segments. The checksums are calculated for a file of KGET_BENCHMARK_FILE_SIZE MiB,
+ * 64 by default, with every supported algorithm.
+ * Use e.g. "-o results.xml,xml" or "-csv" to get machine readable results.
+ */
+class CoreBenchmark : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+
+    void bitSetSetRange_data();
+    void bitSetSetRange();
+    void bitSetGetContinuousRange_data();
+    void bitSetGetContinuousRange();
+    void bitSetNumOnBits_data();
+    void bitSetNumOnBits();
+    void bitSetAllOn_data();
+    void bitSetAllOn();
+
+    void verifierChecksum_data();
+    void verifierChecksum();
+    void verifierPartialChecksums_data();
+    void verifierPartialChecksums();
+
+private:
+    void bitSetData();
+    void algorithmData();
+
+private:
+    QTemporaryDir m_tempDir;
+    QUrl m_file;
+};
+
+#endif
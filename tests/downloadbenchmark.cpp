@@ -0,0 +1,256 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "downloadbenchmark.h"
+#include "httprangeserver.h"
+
+#include "../core/datasourcefactory.h"
+#include "../core/kget.h"
+#include "../core/plugin/transferfactory.h"
+#include "../core/verifier.h"
+#include "../settings.h"
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QtTest>
+
+#include <KConfigGroup>
+#include <KPluginFactory>
+#include <KPluginMetaData>
+#include <KSharedConfig>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+const qint64 MiB = 1024 * 1024;
+const qint64 GiB = 1024 * MiB;
+// the longest a single scenario may take
+const int TIMEOUT = 5 * 60 * 1000;
+
+Q_DECLARE_METATYPE(HttpRangeServer::Faults)
+
+/**
+ * @return the CPU time of all threads of the process in msecs, -1 if it can not be measured
+ */
+static double processCpuTime()
+{
+#ifdef Q_OS_UNIX
+    rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+        return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+    }
+#endif
+    return -1;
+}
+
+void DownloadBenchmark::initTestCase()
+{
+    // neither the configuration of the user nor a proxy must influence the results
+    QStandardPaths::setTestModeEnabled(true);
+    qunsetenv("http_proxy");
+    qunsetenv("HTTP_PROXY");
+    qunsetenv("all_proxy");
+    QVERIFY(m_tempDir.isValid());
+
+    const KPluginMetaData metaData(QStringLiteral(MULTISEGKIO_PLUGIN));
+    const KPluginFactory::Result<TransferFactory> result = KPluginFactory::instantiatePlugin<TransferFactory>(metaData, this);
+    QVERIFY2(result, qPrintable(result.errorString));
+    m_factory = result.plugin;
+    KGet::addTransferFactory(m_factory);
+}
+
+QByteArray DownloadBenchmark::data(qint64 size)
+{
+    // the data is random so that no layer can compress it
+    if (m_data.size() != size) {
+        m_data = QByteArray(size, Qt::Uninitialized);
+        QRandomGenerator generator(size);
+        generator.fillRange(reinterpret_cast<quint32 *>(m_data.data()), size / sizeof(quint32));
+    }
+    return m_data;
+}
+
+void DownloadBenchmark::download_data()
+{
+    QTest::addColumn<qint64>("size");
+    QTest::addColumn<int>("mirrors");
+    QTest::addColumn<int>("connections");
+    QTest::addColumn<HttpRangeServer::Faults>("faults");
+    QTest::addColumn<HttpRangeServer::Faults>("slowMirror");
+    QTest::addColumn<bool>("metalink");
+    QTest::addColumn<bool>("nativeHttp");
+
+    HttpRangeServer::Faults none;
+
+    HttpRangeServer::Faults latency;
+    latency.latency = 50;
+
+    HttpRangeServer::Faults bandwidth;
+    bandwidth.bandwidth = 8 * MiB;
+
+    HttpRangeServer::Faults resets;
+    resets.resetAfter = 2 * MiB;
+    resets.resets = 4;
+
+    HttpRangeServer::Faults slow;
+    slow.bandwidth = 256 * 1024;
+
+    QTest::newRow("single url") << 256 * MiB << 1 << 4 << none << none << false << true;
+    QTest::newRow("single url, one connection") << 256 * MiB << 1 << 1 << none << none << false << true;
+    QTest::newRow("single url, 50 ms latency") << 64 * MiB << 1 << 4 << latency << none << false << true;
+    QTest::newRow("single url, 8 MiB/s per connection") << 64 * MiB << 1 << 4 << bandwidth << none << false << true;
+    QTest::newRow("single url, connection resets") << 64 * MiB << 1 << 4 << resets << none << false << true;
+    QTest::newRow("metalink") << 256 * MiB << 3 << 2 << none << none << true << true;
+    QTest::newRow("metalink, slow mirror") << 64 * MiB << 3 << 2 << none << slow << true << true;
+    QTest::newRow("metalink, connection resets") << 64 * MiB << 3 << 2 << resets << none << true << true;
+
+    // the same with MultiSegKioDataSource
+    QTest::newRow("KIO, single url") << 256 * MiB << 1 << 4 << none << none << false << false;
+    QTest::newRow("KIO, single url, one connection") << 256 * MiB << 1 << 1 << none << none << false << false;
+    QTest::newRow("KIO, single url, 50 ms latency") << 64 * MiB << 1 << 4 << latency << none << false << false;
+    QTest::newRow("KIO, single url, 8 MiB/s per connection") << 64 * MiB << 1 << 4 << bandwidth << none << false << false;
+    QTest::newRow("KIO, single url, connection resets") << 64 * MiB << 1 << 4 << resets << none << false << false;
+    QTest::newRow("KIO, metalink") << 256 * MiB << 3 << 2 << none << none << true << false;
+    QTest::newRow("KIO, metalink, slow mirror") << 64 * MiB << 3 << 2 << none << slow << true << false;
+    QTest::newRow("KIO, metalink, connection resets") << 64 * MiB << 3 << 2 << resets << none << true << false;
+}
+
+void DownloadBenchmark::download()
+{
+    QFETCH(qint64, size);
+    QFETCH(int, mirrors);
+    QFETCH(int, connections);
+    QFETCH(HttpRangeServer::Faults, faults);
+    QFETCH(HttpRangeServer::Faults, slowMirror);
+    QFETCH(bool, metalink);
+    QFETCH(bool, nativeHttp);
+
+    KConfigGroup settings(KSharedConfig::openConfig(QStringLiteral("kget_multisegkiofactory.rc")), QStringLiteral("Segments"));
+    settings.writeEntry("NativeHttp", nativeHttp);
+    settings.sync();
+    m_factory->settingsChanged();
+
+    const QByteArray content = data(size);
+    const QByteArray checksum = QCryptographicHash::hash(content, QCryptographicHash::Sha256);
+
+    // the last mirror is the slow one, if there is one
+    QList<HttpRangeServer *> servers;
+    for (int i = 0; i < mirrors; ++i) {
+        const bool slow = slowMirror.bandwidth && (i == mirrors - 1);
+        servers << new HttpRangeServer(content, slow ? slowMirror : faults);
+        QVERIFY(servers.last()->listen());
+    }
+
+    const QUrl dest = QUrl::fromLocalFile(m_tempDir.filePath(QStringLiteral("download.bin")));
+    QFile::remove(dest.toLocalFile());
+
+    // metalinks know the size and the checksum, a single url has to find the size first
+    auto *factory = new DataSourceFactory(this, dest, metalink ? size : 0);
+    if (metalink) {
+        factory->setMaxMirrorsUsed(mirrors);
+        factory->verifier()->addChecksum(QStringLiteral("sha256"), QString::fromLatin1(checksum.toHex()));
+    }
+    foreach (HttpRangeServer *server, servers) {
+        factory->addMirror(server->url(), connections);
+    }
+
+    // the verification is part of a metalink download
+    QEventLoop loop;
+    auto checkDone = [factory, metalink, &loop]() {
+        const bool verified = !metalink || (factory->verifier()->status() != Verifier::NoResult);
+        if ((factory->status() == Job::Aborted) || ((factory->status() == Job::Finished) && verified)) {
+            loop.quit();
+        }
+    };
+    connect(factory, &DataSourceFactory::dataSourceFactoryChange, &loop, checkDone);
+    connect(factory->verifier(), &Verifier::verified, &loop, checkDone);
+    QTimer::singleShot(TIMEOUT, &loop, &QEventLoop::quit);
+
+    // the servers run in threads of this process, their CPU time is not counted where it can be measured
+    const double cpuStart = processCpuTime();
+    double serverCpu = 0;
+    bool serverCpuKnown = true;
+    foreach (HttpRangeServer *server, servers) {
+        const double serverCpuStart = server->cpuTime();
+        serverCpuKnown = serverCpuKnown && (serverCpuStart >= 0);
+        serverCpu -= serverCpuStart;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    factory->start();
+    loop.exec();
+    const qint64 elapsed = timer.elapsed();
+    double cpu = processCpuTime() - cpuStart;
+    foreach (HttpRangeServer *server, servers) {
+        serverCpu += server->cpuTime();
+    }
+    if (serverCpuKnown) {
+        cpu -= serverCpu;
+    }
+
+    QCOMPARE(factory->status(), Job::Finished);
+    if (metalink) {
+        QCOMPARE(factory->verifier()->status(), Verifier::Verified);
+    }
+
+    QFile file(dest.toLocalFile());
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    QVERIFY(hash.addData(&file));
+    QCOMPARE(hash.result(), checksum);
+
+    int requests = 0;
+    int resets = 0;
+    foreach (HttpRangeServer *server, servers) {
+        requests += server->requests();
+        resets += server->resets();
+    }
+
+    // the writes are flushes of the write cache, each of them is at least one write call; data that is
+    // copied into a mapped file is not written at all. KIO workers run in their own processes, so their
+    // CPU time is not part of the client's
+    const QString writes = (factory->writeCount() || (Settings::storageMode() != DataSourceFactory::MemoryMappedStorage))
+        ? QStringLiteral("%1 cache flushes of %2 KiB").arg(factory->writeCount()).arg(factory->averageWriteSize() / 1024)
+        : QStringLiteral("memory mapped");
+    const QString cpuTime = (cpuStart < 0) ? QStringLiteral("CPU time not measured")
+                                           : QStringLiteral("%1 ms %2 CPU/GiB")
+                                                 .arg(cpu * GiB / size, 0, 'f', 0)
+                                                 .arg(serverCpuKnown ? QStringLiteral("client") : QStringLiteral("client and server"));
+    qInfo().noquote() << QStringLiteral("%1: %2 MB/s, %3 ms, %4, %5, %6 requests, %7 resets")
+                             .arg(QString::fromLatin1(QTest::currentDataTag()))
+                             .arg(elapsed ? (size / 1000.0) / elapsed : 0.0, 0, 'f', 1)
+                             .arg(elapsed)
+                             .arg(writes)
+                             .arg(cpuTime)
+                             .arg(requests)
+                             .arg(resets);
+    QTest::setBenchmarkResult(elapsed, QTest::WalltimeMilliseconds);
+
+    delete factory;
+    qDeleteAll(servers);
+    QFile::remove(dest.toLocalFile());
+}
+
+QTEST_MAIN(DownloadBenchmark)
+
+#include "moc_downloadbenchmark.cpp"
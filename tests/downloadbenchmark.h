@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#ifndef KGET_DOWNLOADBENCHMARK_H
+#define KGET_DOWNLOADBENCHMARK_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QTemporaryDir>
+
+class TransferFactory;
+
+/**
+ * Measures the download path from the sockets to the disk against HttpRangeServer,
+ * with the multisegmentkio plugin of the build directory and DataSourceFactory set
+ * up like single url and metalink transfers do it.
+ *
+ * For every scenario the throughput, the time to completion, the number of writes and
+ * the CPU time of the client per GiB are reported, the time also as benchmark result.
+ * The scenarios run with KGet's own HTTP connections and with KIO.
+ */
+class DownloadBenchmark : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void download_data();
+    void download();
+
+private:
+    QByteArray data(qint64 size);
+
+private:
+    QTemporaryDir m_tempDir;
+    QByteArray m_data;
+    TransferFactory *m_factory = nullptr;
+};
+
+#endif
@@ -0,0 +1,127 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "filewriterthreadtest.h"
+#include "../core/filewriterthread.h"
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QtTest>
+
+// bigger than what the thread reads back at once to hash it
+const int BLOCK_SIZE = 1024 * 1024;
+const int BLOCKS = 10;
+
+static QByteArray block(int number)
+{
+    QByteArray data(BLOCK_SIZE, 0);
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+        data[i] = static_cast<char>((i * 31 + number * 7) % 251);
+    }
+    return data;
+}
+
+void FileWriterThreadTest::init()
+{
+    QVERIFY(m_dir.isValid());
+    m_fileName = m_dir.path() + QStringLiteral("/file");
+    QFile file(m_fileName);
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QVERIFY(file.resize(static_cast<qint64>(BLOCK_SIZE) * BLOCKS));
+}
+
+void FileWriterThreadTest::store(qint64 offset, const QByteArray &data)
+{
+    QFile file(m_fileName);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(offset));
+    QCOMPARE(file.write(data), static_cast<qint64>(data.size()));
+}
+
+QByteArray FileWriterThreadTest::fileChecksum() const
+{
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(&file);
+    return hash.result().toHex();
+}
+
+void FileWriterThreadTest::testOutOfOrder()
+{
+    FileWriterThread writer(m_fileName);
+    writer.setHashing(QStringLiteral("sha256"), QCryptographicHash::Sha256, {});
+    QVERIFY(writer.open());
+
+    // everything behind the first block has to be read back once it is there,
+    // the stored blocks are written to the file directly before the thread knows of them
+    for (int i = BLOCKS - 1; i > 0; --i) {
+        if (i % 3) {
+            writer.write(static_cast<qint64>(i) * BLOCK_SIZE, block(i));
+        } else {
+            store(static_cast<qint64>(i) * BLOCK_SIZE, block(i));
+            writer.addStoredData(static_cast<qint64>(i) * BLOCK_SIZE, block(i));
+        }
+    }
+    writer.write(0, block(0));
+    writer.close();
+
+    QCOMPARE(writer.hashedSize(), static_cast<KIO::filesize_t>(BLOCK_SIZE) * BLOCKS);
+    QCOMPARE(writer.checksum().toLatin1(), fileChecksum());
+}
+
+void FileWriterThreadTest::testExistingData()
+{
+    // the second half is in the file already, e.g. from before a restart
+    const qint64 half = static_cast<qint64>(BLOCK_SIZE) * BLOCKS / 2;
+    for (int i = BLOCKS / 2; i < BLOCKS; ++i) {
+        store(static_cast<qint64>(i) * BLOCK_SIZE, block(i));
+    }
+
+    FileWriterThread writer(m_fileName);
+    writer.setHashing(QStringLiteral("sha256"), QCryptographicHash::Sha256, {qMakePair<KIO::fileoffset_t, KIO::filesize_t>(half, half)});
+    QVERIFY(writer.open());
+    for (int i = BLOCKS / 2 - 1; i >= 0; --i) {
+        writer.write(static_cast<qint64>(i) * BLOCK_SIZE, block(i));
+    }
+    writer.close();
+
+    QCOMPARE(writer.hashedSize(), static_cast<KIO::filesize_t>(BLOCK_SIZE) * BLOCKS);
+    QCOMPARE(writer.checksum().toLatin1(), fileChecksum());
+}
+
+void FileWriterThreadTest::testGap()
+{
+    FileWriterThread writer(m_fileName);
+    writer.setHashing(QStringLiteral("sha256"), QCryptographicHash::Sha256, {});
+    QVERIFY(writer.open());
+    writer.write(0, block(0));
+    writer.write(2 * BLOCK_SIZE, block(2));
+    writer.close();
+
+    // the second block is missing, so the checksum is not known
+    QCOMPARE(writer.hashedSize(), static_cast<KIO::filesize_t>(BLOCK_SIZE));
+    QVERIFY(writer.checksum().isEmpty());
+}
+
+QTEST_MAIN(FileWriterThreadTest)
+
+#include "moc_filewriterthreadtest.cpp"
@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#ifndef KGET_FILEWRITERTHREAD_TEST_H
+#define KGET_FILEWRITERTHREAD_TEST_H
+
+#include <QObject>
+#include <QTemporaryDir>
+
+class FileWriterThreadTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void testOutOfOrder();
+    void testExistingData();
+    void testGap();
+
+private:
+    /**
+     * Writes data at offset to the file directly, like data stored in a mapping of it
+     */
+    void store(qint64 offset, const QByteArray &data);
+    QByteArray fileChecksum() const;
+
+    QTemporaryDir m_dir;
+    QString m_fileName;
+};
+
+#endif
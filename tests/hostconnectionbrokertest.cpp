@@ -0,0 +1,211 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "hostconnectionbrokertest.h"
+#include "../core/hostconnectionbroker.h"
+#include "../settings.h"
+
+#include <QtTest>
+
+const QUrl URL = QUrl("http://example.com/file");
+
+void HostConnectionBrokerTest::initTestCase()
+{
+    m_oldMax = Settings::maxConnectionsPerHost();
+    m_oldLimits = Settings::hostConnectionLimits();
+    Settings::setMaxConnectionsPerHost(2);
+    Settings::setHostConnectionLimits(QStringList());
+}
+
+void HostConnectionBrokerTest::cleanupTestCase()
+{
+    Settings::setMaxConnectionsPerHost(m_oldMax);
+    Settings::setHostConnectionLimits(m_oldLimits);
+}
+
+void HostConnectionBrokerTest::testLimit()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    QObject first;
+    QObject second;
+    BrokerHolder third;
+
+    QVERIFY(broker->acquire(&first, URL));
+    QVERIFY(broker->acquire(&second, URL));
+    QVERIFY(!broker->acquire(&third, URL));
+    QCOMPARE(broker->connections("example.com"), 2);
+    QCOMPARE(broker->queuedRequests("example.com"), 1);
+
+    // acquiring again does not take another connection
+    QVERIFY(broker->acquire(&first, URL));
+    QCOMPARE(broker->connections("example.com"), 2);
+
+    // other hosts have their own limit
+    QObject other;
+    QVERIFY(broker->acquire(&other, QUrl("http://example.org/file")));
+
+    broker->release(&first);
+    broker->release(&second);
+    broker->release(&third);
+    broker->release(&other);
+    QCOMPARE(broker->connections("example.com"), 0);
+    QCOMPARE(broker->queuedRequests("example.com"), 0);
+}
+
+void HostConnectionBrokerTest::testQueue()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    BrokerHolder first;
+    BrokerHolder second;
+    BrokerHolder third;
+    BrokerHolder fourth;
+
+    QVERIFY(broker->acquire(&first, URL));
+    QVERIFY(broker->acquire(&second, URL));
+    QVERIFY(!broker->acquire(&third, URL));
+    QVERIFY(!broker->acquire(&fourth, URL));
+    QCOMPARE(third.acquired, 0);
+
+    // the request waiting longest goes first, only it gets notified
+    broker->release(&first);
+    QCOMPARE(third.acquired, 1);
+    QCOMPARE(fourth.acquired, 0);
+    QCOMPARE(first.acquired + second.acquired, 0);
+    QCOMPARE(broker->queuedRequests("example.com"), 1);
+
+    // a cancelled request does not get a connection
+    broker->release(&fourth);
+    broker->release(&second);
+    QCOMPARE(fourth.acquired, 0);
+    QCOMPARE(broker->connections("example.com"), 1);
+
+    broker->release(&third);
+}
+
+void HostConnectionBrokerTest::testHostLimit()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    Settings::setHostConnectionLimits(QStringList() << "example.com=1" << "unlimited.example.com=0");
+    QCOMPARE(broker->maxConnections("example.com"), 1);
+    QCOMPARE(broker->maxConnections("unlimited.example.com"), 0);
+    QCOMPARE(broker->maxConnections("example.org"), 2);
+
+    QObject first;
+    BrokerHolder second;
+    QVERIFY(broker->acquire(&first, URL));
+    QVERIFY(!broker->acquire(&second, URL));
+    broker->release(&first);
+    broker->release(&second);
+
+    QList<QObject *> holders;
+    for (int i = 0; i < 5; ++i) {
+        holders.append(new QObject);
+        QVERIFY(broker->acquire(holders.last(), QUrl("http://unlimited.example.com/file")));
+    }
+    qDeleteAll(holders);
+
+    Settings::setHostConnectionLimits(QStringList());
+}
+
+void HostConnectionBrokerTest::testLocalFile()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    QObject holders[3];
+    for (int i = 0; i < 3; ++i) {
+        QVERIFY(broker->acquire(&holders[i], QUrl::fromLocalFile("/tmp/file")));
+    }
+}
+
+void HostConnectionBrokerTest::testDestroyed()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    QObject *first = new QObject;
+    QObject *second = new QObject;
+    BrokerHolder third;
+
+    QVERIFY(broker->acquire(first, URL));
+    QVERIFY(broker->acquire(second, URL));
+    QVERIFY(!broker->acquire(&third, URL));
+
+    delete first;
+    QCOMPARE(third.acquired, 1);
+    QCOMPARE(broker->connections("example.com"), 2);
+
+    delete second;
+    broker->release(&third);
+    QCOMPARE(broker->connections("example.com"), 0);
+}
+
+void HostConnectionBrokerTest::testMissingSlot()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    QObject first;
+    QObject second;
+    QObject withoutSlot;
+
+    QVERIFY(broker->acquire(&first, URL));
+    QVERIFY(broker->acquire(&second, URL));
+    QVERIFY(!broker->acquire(&withoutSlot, URL));
+
+    // it could never be told about its connection, so it does not keep it
+    QTest::ignoreMessage(QtWarningMsg, QRegularExpression("has no slot slotConnectionAcquired"));
+    broker->release(&first);
+    QCOMPARE(broker->connections("example.com"), 1);
+    QCOMPARE(broker->queuedRequests("example.com"), 0);
+
+    broker->release(&second);
+}
+
+void HostConnectionBrokerTest::testHandOver()
+{
+    HostConnectionBroker *broker = HostConnectionBroker::self();
+    QObject first;
+    QObject second;
+    BrokerHolder waiting;
+    QObject socket;
+
+    QVERIFY(broker->acquire(&first, URL));
+    QVERIFY(broker->acquire(&second, URL));
+    QVERIFY(!broker->acquire(&waiting, URL));
+
+    // the connection stays in use, nobody waiting gets it
+    QVERIFY(broker->handOver(&first, &socket));
+    QCOMPARE(broker->connections("example.com"), 2);
+    QCOMPARE(waiting.acquired, 0);
+
+    // releasing the old holder does not free the connection of the new one
+    broker->release(&first);
+    QCOMPARE(waiting.acquired, 0);
+
+    // only a connection that is held can be handed over
+    QObject other;
+    QVERIFY(!broker->handOver(&first, &other));
+    QCOMPARE(broker->connections("example.com"), 2);
+
+    broker->release(&socket);
+    QCOMPARE(waiting.acquired, 1);
+
+    broker->release(&second);
+    broker->release(&waiting);
+    QCOMPARE(broker->connections("example.com"), 0);
+}
+
+QTEST_MAIN(HostConnectionBrokerTest)
+
+#include "moc_hostconnectionbrokertest.cpp"
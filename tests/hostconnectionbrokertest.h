@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#ifndef KGET_HOSTCONNECTIONBROKER_TEST_H
+#define KGET_HOSTCONNECTIONBROKER_TEST_H
+
+#include <QObject>
+#include <QStringList>
+
+/**
+ * Counts how often the broker handed it a connection
+ */
+class BrokerHolder : public QObject
+{
+    Q_OBJECT
+
+public:
+    int acquired = 0;
+
+private Q_SLOTS:
+    void slotConnectionAcquired()
+    {
+        ++acquired;
+    }
+};
+
+class HostConnectionBrokerTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+    void testLimit();
+    void testQueue();
+    void testHostLimit();
+    void testLocalFile();
+    void testDestroyed();
+    void testMissingSlot();
+    void testHandOver();
+
+private:
+    int m_oldMax;
+    QStringList m_oldLimits;
+};
+
+#endif
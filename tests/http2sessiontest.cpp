@@ -0,0 +1,441 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "http2sessiontest.h"
+#include "../transfer-plugins/multisegmentkio/http2session.h"
+#include "../transfer-plugins/multisegmentkio/http2stream.h"
+
+#include <QFile>
+#include <QPointer>
+#include <QSslCertificate>
+#include <QSslConfiguration>
+#include <QSslKey>
+#include <QSslSocket>
+#include <QStandardPaths>
+#include <QTcpServer>
+#include <QtTest>
+
+#include <nghttp2/nghttp2.h>
+
+#include <cstring>
+
+const int SEGMENT_SIZE = 16 * 1024;
+const int SEGMENTS = 4;
+
+static QByteArray testData()
+{
+    QByteArray data;
+    data.reserve(SEGMENT_SIZE * SEGMENTS);
+    for (int i = 0; i < SEGMENT_SIZE * SEGMENTS; ++i) {
+        data.append(static_cast<char>(i % 251));
+    }
+    return data;
+}
+
+/**
+ * @return the status of the response to a request with the range header, body and
+ * contentRange are set accordingly
+ */
+static int rangeResponse(const QByteArray &range, QByteArray *body, QByteArray *contentRange)
+{
+    const QByteArray data = testData();
+    if (!range.startsWith("bytes=")) {
+        *body = data;
+        contentRange->clear();
+        return 200;
+    }
+
+    const int dash = range.indexOf('-');
+    const int first = range.mid(6, dash - 6).toInt();
+    const int last = qMin(range.mid(dash + 1).toInt(), data.size() - 1);
+    *body = data.mid(first, last - first + 1);
+    *contentRange = "bytes " + QByteArray::number(first) + '-' + QByteArray::number(last) + '/' + QByteArray::number(data.size());
+    return 206;
+}
+
+class TlsRangeConnection;
+
+/**
+ * A https server on the loopback interface that serves testData() with range requests,
+ * with HTTP/2 if it is enabled and with HTTP/1.1 otherwise
+ */
+class TlsRangeServer : public QTcpServer
+{
+public:
+    TlsRangeServer(bool http2, int refusingConnections)
+        : m_http2(http2)
+        , m_refusingConnections(refusingConnections)
+    {
+    }
+
+    bool start()
+    {
+        QFile certificate(QFINDTESTDATA("testserver.crt"));
+        QFile key(QFINDTESTDATA("testserver.key"));
+        if (!certificate.open(QIODevice::ReadOnly) || !key.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+        m_certificate = QSslCertificate(certificate.readAll());
+        m_key = QSslKey(key.readAll(), QSsl::Rsa);
+        return !m_certificate.isNull() && !m_key.isNull() && listen(QHostAddress::LocalHost);
+    }
+
+    QSslCertificate certificate() const
+    {
+        return m_certificate;
+    }
+
+    QUrl url() const
+    {
+        return QUrl(QStringLiteral("https://127.0.0.1:%1/file.bin").arg(serverPort()));
+    }
+
+    int connections = 0;
+    int requests = 0;
+
+protected:
+    void incomingConnection(qintptr descriptor) override;
+
+private:
+    friend class TlsRangeConnection;
+
+    bool m_http2;
+    int m_refusingConnections; ///< connections that refuse the streams with GOAWAY
+    QSslCertificate m_certificate;
+    QSslKey m_key;
+};
+
+/**
+ * A connection of TlsRangeServer, it deletes itself once the client disconnected
+ */
+class TlsRangeConnection : public QObject
+{
+public:
+    TlsRangeConnection(TlsRangeServer *server, QSslSocket *socket, bool refuse)
+        : QObject(server)
+        , m_server(server)
+        , m_socket(socket)
+        , m_session(nullptr)
+        , m_refuse(refuse)
+    {
+        m_socket->setParent(this);
+        connect(m_socket, &QSslSocket::encrypted, this, &TlsRangeConnection::encrypted);
+        connect(m_socket, &QIODevice::readyRead, this, &TlsRangeConnection::readyRead);
+        connect(m_socket, &QAbstractSocket::disconnected, this, &QObject::deleteLater);
+    }
+
+    ~TlsRangeConnection() override
+    {
+        if (m_session) {
+            nghttp2_session_del(m_session);
+        }
+    }
+
+private:
+    struct Stream {
+        QByteArray range;
+        QByteArray body;
+        int sent = 0;
+    };
+
+    static int onBeginHeaders(nghttp2_session *, const nghttp2_frame *frame, void *userData)
+    {
+        if ((frame->hd.type == NGHTTP2_HEADERS) && (frame->headers.cat == NGHTTP2_HCAT_REQUEST)) {
+            static_cast<TlsRangeConnection *>(userData)->m_streams.insert(frame->hd.stream_id, Stream());
+        }
+        return 0;
+    }
+
+    static int onHeader(nghttp2_session *,
+                        const nghttp2_frame *frame,
+                        const uint8_t *name,
+                        size_t nameLength,
+                        const uint8_t *value,
+                        size_t valueLength,
+                        uint8_t,
+                        void *userData)
+    {
+        auto *connection = static_cast<TlsRangeConnection *>(userData);
+        if (connection->m_streams.contains(frame->hd.stream_id) && (QByteArray(reinterpret_cast<const char *>(name), nameLength) == "range")) {
+            connection->m_streams[frame->hd.stream_id].range = QByteArray(reinterpret_cast<const char *>(value), valueLength);
+        }
+        return 0;
+    }
+
+    static int onFrameReceived(nghttp2_session *, const nghttp2_frame *frame, void *userData)
+    {
+        auto *connection = static_cast<TlsRangeConnection *>(userData);
+        if (((frame->hd.type == NGHTTP2_HEADERS) || (frame->hd.type == NGHTTP2_DATA)) && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+            && connection->m_streams.contains(frame->hd.stream_id)) {
+            connection->respond(frame->hd.stream_id);
+        }
+        return 0;
+    }
+
+    static int onStreamClosed(nghttp2_session *, int32_t streamId, uint32_t, void *userData)
+    {
+        static_cast<TlsRangeConnection *>(userData)->m_streams.remove(streamId);
+        return 0;
+    }
+
+    static ssize_t readBody(nghttp2_session *, int32_t streamId, uint8_t *buffer, size_t length, uint32_t *dataFlags, nghttp2_data_source *, void *userData)
+    {
+        Stream &stream = static_cast<TlsRangeConnection *>(userData)->m_streams[streamId];
+        const size_t size = qMin(length, static_cast<size_t>(stream.body.size() - stream.sent));
+        memcpy(buffer, stream.body.constData() + stream.sent, size);
+        stream.sent += size;
+        if (stream.sent == stream.body.size()) {
+            *dataFlags |= NGHTTP2_DATA_FLAG_EOF;
+        }
+        return size;
+    }
+
+    static nghttp2_nv header(const char *name, const QByteArray &value)
+    {
+        nghttp2_nv nv;
+        nv.name = reinterpret_cast<uint8_t *>(const_cast<char *>(name));
+        nv.namelen = strlen(name);
+        nv.value = reinterpret_cast<uint8_t *>(const_cast<char *>(value.constData()));
+        nv.valuelen = value.size();
+        nv.flags = NGHTTP2_NV_FLAG_NONE;
+        return nv;
+    }
+
+    void encrypted()
+    {
+        if (m_socket->sslConfiguration().nextNegotiatedProtocol() != "h2") {
+            return;
+        }
+
+        nghttp2_session_callbacks *callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, onBeginHeaders);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, onHeader);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, onFrameReceived);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, onStreamClosed);
+        nghttp2_session_server_new(&m_session, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+
+        nghttp2_submit_settings(m_session, NGHTTP2_FLAG_NONE, nullptr, 0);
+        sendPending();
+    }
+
+    void readyRead()
+    {
+        const QByteArray data = m_socket->readAll();
+        if (m_session) {
+            nghttp2_session_mem_recv(m_session, reinterpret_cast<const uint8_t *>(data.constData()), data.size());
+            sendPending();
+            return;
+        }
+
+        // HTTP/1.1, every request is answered right away
+        m_request += data;
+        int end;
+        while ((end = m_request.indexOf("\r\n\r\n")) != -1) {
+            QByteArray range;
+            foreach (const QByteArray &line, m_request.left(end).split('\n')) {
+                if (line.toLower().startsWith("range:")) {
+                    range = line.mid(line.indexOf(':') + 1).trimmed();
+                }
+            }
+            m_request.remove(0, end + 4);
+            ++m_server->requests;
+
+            QByteArray body;
+            QByteArray contentRange;
+            const int status = rangeResponse(range, &body, &contentRange);
+            QByteArray response = (status == 206 ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
+            if (!contentRange.isEmpty()) {
+                response += "Content-Range: " + contentRange + "\r\n";
+            }
+            response += "Content-Length: " + QByteArray::number(body.size()) + "\r\nAccept-Ranges: bytes\r\n\r\n";
+            m_socket->write(response + body);
+        }
+    }
+
+    void respond(qint32 streamId)
+    {
+        ++m_server->requests;
+        // e.g. a server that is shutting down, the stream was not processed and can be sent again
+        if (m_refuse) {
+            nghttp2_submit_goaway(m_session, NGHTTP2_FLAG_NONE, 0, NGHTTP2_NO_ERROR, nullptr, 0);
+            return;
+        }
+
+        Stream &stream = m_streams[streamId];
+        QByteArray contentRange;
+        const QByteArray status = QByteArray::number(rangeResponse(stream.range, &stream.body, &contentRange));
+        const QByteArray length = QByteArray::number(stream.body.size());
+        const nghttp2_nv headers[] = {header(":status", status), header("content-length", length), header("content-range", contentRange)};
+
+        nghttp2_data_provider provider;
+        provider.source.ptr = nullptr;
+        provider.read_callback = readBody;
+        nghttp2_submit_response(m_session, streamId, headers, (contentRange.isEmpty() ? 2 : 3), &provider);
+    }
+
+    void sendPending()
+    {
+        const uint8_t *data = nullptr;
+        ssize_t length;
+        while ((length = nghttp2_session_mem_send(m_session, &data)) > 0) {
+            m_socket->write(reinterpret_cast<const char *>(data), length);
+        }
+    }
+
+private:
+    TlsRangeServer *m_server;
+    QSslSocket *m_socket;
+    nghttp2_session *m_session;
+    const bool m_refuse;
+    QHash<qint32, Stream> m_streams;
+    QByteArray m_request;
+};
+
+void TlsRangeServer::incomingConnection(qintptr descriptor)
+{
+    auto *socket = new QSslSocket;
+    if (!socket->setSocketDescriptor(descriptor)) {
+        delete socket;
+        return;
+    }
+
+    QSslConfiguration config = socket->sslConfiguration();
+    config.setLocalCertificate(m_certificate);
+    config.setPrivateKey(m_key);
+    config.setPeerVerifyMode(QSslSocket::VerifyNone);
+    if (m_http2) {
+        config.setAllowedNextProtocols(QList<QByteArray>() << "h2" << "http/1.1");
+    } else {
+        config.setAllowedNextProtocols(QList<QByteArray>() << "http/1.1");
+    }
+    socket->setSslConfiguration(config);
+
+    ++connections;
+    new TlsRangeConnection(this, socket, (connections <= m_refusingConnections));
+    socket->startServerEncryption();
+}
+
+/**
+ * Collects what a stream downloads at the offsets it reports
+ */
+class StreamReceiver
+{
+public:
+    explicit StreamReceiver(Http2Stream *stream)
+        : file(SEGMENT_SIZE * SEGMENTS, '\0')
+    {
+        QObject::connect(stream, &HttpConnection::data, stream, [this](KIO::fileoffset_t offset, const QByteArray &data, bool &worked) {
+            file.replace(offset, data.size(), data);
+            worked = true;
+        });
+        QObject::connect(stream, &HttpConnection::finishedSegment, stream, [this](HttpConnection *, int, bool connectionFinished) {
+            finished = connectionFinished;
+        });
+        QObject::connect(stream, &HttpConnection::error, stream, [this](HttpConnection *, const QString &, Transfer::LogLevel) {
+            failed = true;
+        });
+    }
+
+    QByteArray file;
+    bool finished = false;
+    bool failed = false;
+};
+
+void Http2SessionTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+
+    // the certificate of the server is self signed
+    QFile certificate(QFINDTESTDATA("testserver.crt"));
+    QVERIFY(certificate.open(QIODevice::ReadOnly));
+    QSslConfiguration config = QSslConfiguration::defaultConfiguration();
+    config.addCaCertificate(QSslCertificate(certificate.readAll()));
+    QSslConfiguration::setDefaultConfiguration(config);
+}
+
+void Http2SessionTest::testSharedSession()
+{
+    auto *first = new QObject;
+    auto *second = new QObject;
+
+    // one session per origin
+    Http2Session *session = Http2Session::session(QUrl(QStringLiteral("https://example.com/file")), first);
+    QCOMPARE(Http2Session::session(QUrl(QStringLiteral("https://EXAMPLE.com:443/other")), second), session);
+    Http2Session *other = Http2Session::session(QUrl(QStringLiteral("https://example.com:8443/file")), first);
+    QVERIFY(other != session);
+
+    // it lives as long as it is used
+    QPointer<Http2Session> guard(session);
+    QPointer<Http2Session> otherGuard(other);
+    session->removeUser(first);
+    QTest::qWait(0);
+    QVERIFY(guard);
+
+    delete second;
+    QTRY_VERIFY(guard.isNull());
+    QVERIFY(otherGuard);
+    delete first;
+    QTRY_VERIFY(otherGuard.isNull());
+}
+
+void Http2SessionTest::testFallback()
+{
+    TlsRangeServer server(false, 0);
+    QVERIFY(server.start());
+
+    QObject user;
+    Http2Session *session = Http2Session::session(server.url(), &user);
+    auto *stream = new Http2Stream(session, server.url(), qMakePair(SEGMENT_SIZE, SEGMENT_SIZE), qMakePair(0, SEGMENTS - 1), &user);
+    StreamReceiver receiver(stream);
+    stream->start();
+
+    // the stream uses an own connection once the session found no HTTP/2 support
+    QTRY_VERIFY_WITH_TIMEOUT(receiver.finished || receiver.failed, 10000);
+    QVERIFY(!receiver.failed);
+    QCOMPARE(session->protocol(), Http2Session::Http1);
+    QCOMPARE(receiver.file, testData());
+    QCOMPARE(server.connections, 2);
+    QCOMPARE(server.requests, 1);
+}
+
+void Http2SessionTest::testResubmit()
+{
+    TlsRangeServer server(true, 1);
+    QVERIFY(server.start());
+
+    QObject user;
+    Http2Session *session = Http2Session::session(server.url(), &user);
+    auto *stream = new Http2Stream(session, server.url(), qMakePair(SEGMENT_SIZE, SEGMENT_SIZE), qMakePair(0, SEGMENTS - 1), &user);
+    StreamReceiver receiver(stream);
+    stream->start();
+
+    // the refused stream is sent again over a new connection
+    QTRY_VERIFY_WITH_TIMEOUT(receiver.finished || receiver.failed, 10000);
+    QVERIFY(!receiver.failed);
+    QCOMPARE(session->protocol(), Http2Session::Http2);
+    QCOMPARE(receiver.file, testData());
+    QCOMPARE(server.connections, 2);
+    QCOMPARE(server.requests, 2);
+}
+
+QTEST_MAIN(Http2SessionTest)
+
+#include "moc_http2sessiontest.cpp"
@@ -0,0 +1,243 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "httpconnectiontest.h"
+#include "httprangeserver.h"
+#include "../transfer-plugins/multisegmentkio/httpconnection.h"
+
+#include <QSslSocket>
+#include <QStandardPaths>
+#include <QtTest>
+
+const int SEGMENT_SIZE = 1024;
+const int SEGMENTS = 8;
+
+static QByteArray testData()
+{
+    QByteArray data;
+    data.reserve(SEGMENT_SIZE * SEGMENTS);
+    for (int i = 0; i < SEGMENT_SIZE * SEGMENTS; ++i) {
+        data.append(static_cast<char>(i % 251));
+    }
+    return data;
+}
+
+/**
+ * Collects what a connection downloads at the offsets it reports
+ */
+class Receiver
+{
+public:
+    explicit Receiver(HttpConnection *connection)
+        : file(SEGMENT_SIZE * SEGMENTS, '\0')
+    {
+        QObject::connect(connection, &HttpConnection::data, connection, [this](KIO::fileoffset_t offset, const QByteArray &data, bool &worked) {
+            if (offset + data.size() > file.size()) {
+                file.resize(offset + data.size());
+            }
+            file.replace(offset, data.size(), data);
+            received += data.size();
+            worked = true;
+        });
+        QObject::connect(connection, &HttpConnection::finishedSegment, connection, [this](HttpConnection *, int segment, bool connectionFinished) {
+            finishedSegments << segment;
+            finished = connectionFinished;
+        });
+        QObject::connect(connection, &HttpConnection::finishedDownload, connection, [this](KIO::filesize_t size) {
+            downloadedSize = size;
+            finished = true;
+        });
+        QObject::connect(connection, &HttpConnection::error, connection, [this](HttpConnection *, const QString &, Transfer::LogLevel level) {
+            failed = true;
+            logLevel = level;
+        });
+    }
+
+    QByteArray file;
+    qint64 received = 0;
+    QList<int> finishedSegments;
+    KIO::filesize_t downloadedSize = 0;
+    bool finished = false;
+    bool failed = false;
+    Transfer::LogLevel logLevel = Transfer::Log_Info;
+};
+
+void HttpConnectionTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+void HttpConnectionTest::testChunked_data()
+{
+    QTest::addColumn<int>("first");
+    QTest::addColumn<int>("last");
+
+    QTest::newRow("whole file, size unknown") << -1 << -1;
+    QTest::newRow("range") << 2 << 5;
+}
+
+void HttpConnectionTest::testChunked()
+{
+    QFETCH(int, first);
+    QFETCH(int, last);
+
+    const QByteArray data = testData();
+    HttpRangeServer::Faults faults;
+    faults.chunked = true;
+    HttpRangeServer server(data, faults);
+    QVERIFY(server.listen());
+
+    HttpConnection connection(server.url(), qMakePair<KIO::fileoffset_t, KIO::fileoffset_t>(SEGMENT_SIZE, SEGMENT_SIZE), qMakePair(first, last), nullptr);
+    Receiver receiver(&connection);
+    connection.start();
+    QTRY_VERIFY(receiver.finished || receiver.failed);
+    QVERIFY(!receiver.failed);
+
+    if (first == -1) {
+        // without Content-Length the size is only known once the last chunk arrived
+        QCOMPARE(receiver.downloadedSize, static_cast<KIO::filesize_t>(data.size()));
+        QCOMPARE(receiver.file, data);
+    } else {
+        const int start = first * SEGMENT_SIZE;
+        const int size = (last - first + 1) * SEGMENT_SIZE;
+        QCOMPARE(receiver.received, static_cast<qint64>(size));
+        QCOMPARE(receiver.file.mid(start, size), data.mid(start, size));
+        QCOMPARE(receiver.finishedSegments, QList<int>({2, 3, 4, 5}));
+
+        // the trailer of the last chunk has been read, so the connection can be reused
+        QSslSocket *socket = connection.takeSocket();
+        QVERIFY(socket);
+        delete socket;
+    }
+}
+
+void HttpConnectionTest::testRedirect()
+{
+    const QByteArray data = testData();
+    HttpRangeServer::Faults faults;
+    faults.redirectPath = "/old.bin";
+    HttpRangeServer server(data, faults);
+    QVERIFY(server.listen());
+
+    HttpConnection connection(server.url(QStringLiteral("/old.bin")),
+                              qMakePair<KIO::fileoffset_t, KIO::fileoffset_t>(SEGMENT_SIZE, SEGMENT_SIZE),
+                              qMakePair(0, SEGMENTS - 1),
+                              nullptr);
+    Receiver receiver(&connection);
+    QSignalSpy urlChanged(&connection, &HttpConnection::urlChanged);
+    connection.start();
+    QTRY_VERIFY(receiver.finished || receiver.failed);
+    QVERIFY(!receiver.failed);
+
+    QCOMPARE(urlChanged.count(), 1);
+    QCOMPARE(urlChanged.first().first().toUrl(), server.url());
+    QCOMPARE(connection.url(), server.url());
+    QCOMPARE(receiver.file, data);
+    QCOMPARE(server.requests(), 2);
+}
+
+void HttpConnectionTest::testKeepAlive()
+{
+    const QByteArray data = testData();
+    HttpRangeServer server(data, HttpRangeServer::Faults());
+    QVERIFY(server.listen());
+
+    const QPair<KIO::fileoffset_t, KIO::fileoffset_t> segmentSize(SEGMENT_SIZE, SEGMENT_SIZE);
+    HttpConnection first(server.url(), segmentSize, qMakePair(0, 3), nullptr);
+    Receiver firstReceiver(&first);
+    first.start();
+    QTRY_VERIFY(firstReceiver.finished || firstReceiver.failed);
+    QVERIFY(!firstReceiver.failed);
+
+    QSslSocket *socket = first.takeSocket();
+    QVERIFY(socket);
+    // a taken socket can not be taken twice
+    QVERIFY(!first.takeSocket());
+
+    HttpConnection second(server.url(), segmentSize, qMakePair(4, SEGMENTS - 1), nullptr);
+    second.setSocket(socket);
+    Receiver secondReceiver(&second);
+    second.start();
+    QTRY_VERIFY(secondReceiver.finished || secondReceiver.failed);
+    QVERIFY(!secondReceiver.failed);
+
+    const int half = SEGMENT_SIZE * SEGMENTS / 2;
+    QCOMPARE(firstReceiver.file.left(half), data.left(half));
+    QCOMPARE(secondReceiver.file.mid(half), data.mid(half));
+    QCOMPARE(server.requests(), 2);
+    QCOMPARE(server.connections(), 1);
+}
+
+void HttpConnectionTest::testResumeWithoutRange()
+{
+    const QByteArray data = testData();
+    HttpRangeServer::Faults faults;
+    faults.ignoreRange = true;
+    HttpRangeServer server(data, faults);
+    QVERIFY(server.listen());
+
+    // the server sends the whole file with 200, which can not be used for a range in the middle
+    HttpConnection connection(server.url(), qMakePair<KIO::fileoffset_t, KIO::fileoffset_t>(SEGMENT_SIZE, SEGMENT_SIZE), qMakePair(2, 5), nullptr);
+    Receiver receiver(&connection);
+    QSignalSpy canResume(&connection, &HttpConnection::canResume);
+    connection.start();
+    QTRY_VERIFY(receiver.finished || receiver.failed);
+
+    QVERIFY(receiver.failed);
+    QCOMPARE(receiver.logLevel, Transfer::Log_Warning);
+    QCOMPARE(receiver.received, static_cast<qint64>(0));
+    QCOMPARE(canResume.count(), 0);
+    QVERIFY(!connection.isRunning());
+}
+
+void HttpConnectionTest::testSplit()
+{
+    const QByteArray data = testData();
+    HttpRangeServer server(data, HttpRangeServer::Faults());
+    QVERIFY(server.listen());
+
+    HttpConnection connection(server.url(), qMakePair<KIO::fileoffset_t, KIO::fileoffset_t>(SEGMENT_SIZE, SEGMENT_SIZE), qMakePair(0, SEGMENTS - 1), nullptr);
+    Receiver receiver(&connection);
+
+    // split once the response to the request of all segments arrives, before its body is read
+    QPair<int, int> freed(-1, -1);
+    connect(&connection, &HttpConnection::timeToFirstByte, &connection, [&connection, &freed]() {
+        freed = connection.split();
+    });
+    connection.start();
+    QTRY_VERIFY(receiver.finished || receiver.failed);
+    QVERIFY(!receiver.failed);
+
+    QCOMPARE(freed, qMakePair(SEGMENTS / 2, SEGMENTS - 1));
+    QCOMPARE(connection.assignedSegments(), qMakePair(SEGMENTS / 2 - 1, SEGMENTS / 2 - 1));
+    QCOMPARE(receiver.finishedSegments, QList<int>({0, 1, 2, 3}));
+
+    // nothing beyond the new end is handed on
+    const int half = SEGMENT_SIZE * SEGMENTS / 2;
+    QCOMPARE(receiver.received, static_cast<qint64>(half));
+    QCOMPARE(receiver.file.left(half), data.left(half));
+    QCOMPARE(receiver.file.mid(half), QByteArray(half, '\0'));
+
+    // the rest of the response is still pending, so the connection can not be reused
+    QVERIFY(!connection.takeSocket());
+}
+
+QTEST_MAIN(HttpConnectionTest)
+
+#include "moc_httpconnectiontest.cpp"
@@ -0,0 +1,302 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#include "httprangeserver.h"
+
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#endif
+
+// how much unsent data a connection keeps at most, so that the bandwidth is not exceeded by buffering
+const qint64 SEND_BUFFER_SIZE = 256 * 1024;
+const qint64 CHUNK_SIZE = 64 * 1024;
+// the bandwidth is handed out in ticks of this many msecs
+const int PACING_INTERVAL = 10;
+
+/**
+ * Serves the requests of one connection one after another
+ */
+class RangeConnection : public QObject
+{
+public:
+    RangeConnection(HttpRangeServer *server, QTcpSocket *socket)
+        : QObject(socket)
+        , m_server(server)
+        , m_socket(socket)
+        , m_pacer(nullptr)
+        , m_busy(false)
+        , m_head(false)
+        , m_chunked(false)
+        , m_pos(0)
+        , m_end(0)
+        , m_sent(0)
+        , m_budget(0)
+    {
+        connect(m_socket, &QIODevice::readyRead, this, &RangeConnection::readRequest);
+        connect(m_socket, &QIODevice::bytesWritten, this, &RangeConnection::sendBody);
+        connect(m_socket, &QAbstractSocket::disconnected, m_socket, &QObject::deleteLater);
+
+        if (m_server->m_faults.bandwidth) {
+            m_pacer = new QTimer(this);
+            m_pacer->setInterval(PACING_INTERVAL);
+            connect(m_pacer, &QTimer::timeout, this, [this]() {
+                m_budget = qMax(m_server->m_faults.bandwidth * PACING_INTERVAL / 1000, static_cast<qint64>(1));
+                sendBody();
+            });
+            m_pacer->start();
+        }
+    }
+
+private:
+    void readRequest()
+    {
+        m_request += m_socket->readAll();
+        if (m_busy) {
+            return;
+        }
+
+        const int end = m_request.indexOf("\r\n\r\n");
+        if (end == -1) {
+            return;
+        }
+        const QList<QByteArray> lines = m_request.left(end).split('\n');
+        m_request.remove(0, end + 4);
+        m_busy = true;
+        m_server->m_requests.ref();
+
+        const QList<QByteArray> requestLine = lines.value(0).trimmed().split(' ');
+        m_head = (requestLine.value(0) == "HEAD");
+        m_path = requestLine.value(1);
+        m_range.clear();
+        for (const QByteArray &line : lines) {
+            if (line.toLower().startsWith("range:")) {
+                m_range = line.mid(line.indexOf(':') + 1).trimmed();
+            }
+        }
+
+        if (m_server->m_faults.latency) {
+            QTimer::singleShot(m_server->m_faults.latency, this, &RangeConnection::respond);
+        } else {
+            respond();
+        }
+    }
+
+    void respond()
+    {
+        const qint64 size = m_server->m_data.size();
+        qint64 first = 0;
+        qint64 last = size - 1;
+        const bool ranged = m_range.startsWith("bytes=") && !m_server->m_faults.ignoreRange;
+        if (ranged) {
+            const QByteArray range = m_range.mid(6);
+            const int dash = range.indexOf('-');
+            first = range.left(dash).toLongLong();
+            if (dash + 1 < range.size()) {
+                last = qMin(range.mid(dash + 1).toLongLong(), size - 1);
+            }
+        }
+
+        QByteArray header;
+        m_chunked = false;
+        if (!m_server->m_faults.redirectPath.isEmpty() && (m_path == m_server->m_faults.redirectPath)) {
+            header = "HTTP/1.1 302 Found\r\nLocation: /file.bin\r\nContent-Length: 0\r\n\r\n";
+            m_pos = m_end = 0;
+        } else if (ranged && ((first >= size) || (first > last))) {
+            header = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + QByteArray::number(size) + "\r\nContent-Length: 0\r\n\r\n";
+            m_pos = m_end = 0;
+        } else {
+            header = (ranged ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
+            if (ranged) {
+                header += "Content-Range: bytes " + QByteArray::number(first) + '-' + QByteArray::number(last) + '/' + QByteArray::number(size) + "\r\n";
+            }
+            m_chunked = m_server->m_faults.chunked && !m_head;
+            if (m_chunked) {
+                header += "Transfer-Encoding: chunked\r\n";
+            } else {
+                header += "Content-Length: " + QByteArray::number(last - first + 1) + "\r\n";
+            }
+            if (!m_server->m_faults.ignoreRange) {
+                header += "Accept-Ranges: bytes\r\n";
+            }
+            header += "Connection: keep-alive\r\n\r\n";
+            m_pos = first;
+            m_end = (m_head ? first : last + 1);
+        }
+
+        m_socket->write(header);
+        sendBody();
+    }
+
+    void sendBody()
+    {
+        while (m_busy && (m_pos < m_end) && (m_socket->bytesToWrite() < SEND_BUFFER_SIZE)) {
+            qint64 chunk = qMin(CHUNK_SIZE, m_end - m_pos);
+            if (m_pacer) {
+                chunk = qMin(chunk, m_budget);
+                if (!chunk) {
+                    return;
+                }
+                m_budget -= chunk;
+            }
+
+            const qint64 resetAfter = m_server->m_faults.resetAfter;
+            if (resetAfter && (m_sent + chunk >= resetAfter) && m_server->takeReset()) {
+                writeBody(m_server->m_data.constData() + m_pos, qMax(resetAfter - m_sent, static_cast<qint64>(0)));
+                m_socket->flush();
+                m_busy = false;
+                m_socket->abort();
+                return;
+            }
+
+            writeBody(m_server->m_data.constData() + m_pos, chunk);
+            m_pos += chunk;
+            m_sent += chunk;
+        }
+
+        if (m_busy && (m_pos >= m_end)) {
+            if (m_chunked) {
+                m_socket->write("0\r\n\r\n");
+            }
+            m_busy = false;
+            // the next request may have arrived already
+            if (!m_request.isEmpty()) {
+                readRequest();
+            }
+        }
+    }
+
+    void writeBody(const char *data, qint64 size)
+    {
+        if (!size) {
+            return;
+        }
+        if (m_chunked) {
+            m_socket->write(QByteArray::number(size, 16) + "\r\n");
+        }
+        m_socket->write(data, size);
+        if (m_chunked) {
+            m_socket->write("\r\n");
+        }
+    }
+
+private:
+    HttpRangeServer *m_server;
+    QTcpSocket *m_socket;
+    QTimer *m_pacer;
+    QByteArray m_request;
+    QByteArray m_path;
+    QByteArray m_range;
+    bool m_busy;
+    bool m_head;
+    bool m_chunked;
+    qint64 m_pos;
+    qint64 m_end;
+    qint64 m_sent; ///< body bytes sent on this connection
+    qint64 m_budget; ///< bytes that may be sent until the next tick
+};
+
+HttpRangeServer::HttpRangeServer(const QByteArray &data, const Faults &faults)
+    : m_data(data)
+    , m_faults(faults)
+    , m_thread(new QThread)
+    , m_server(new QTcpServer)
+    , m_port(0)
+    , m_resetsLeft(faults.resets)
+{
+    m_server->moveToThread(m_thread);
+    QObject::connect(m_server, &QTcpServer::newConnection, m_server, [this]() {
+        newConnection();
+    });
+    QObject::connect(m_thread, &QThread::finished, m_server, &QObject::deleteLater);
+    m_thread->start();
+}
+
+HttpRangeServer::~HttpRangeServer()
+{
+    m_thread->quit();
+    m_thread->wait();
+    delete m_thread;
+}
+
+bool HttpRangeServer::listen()
+{
+    bool listening = false;
+    QMetaObject::invokeMethod(
+        m_server,
+        [this, &listening]() {
+            listening = m_server->listen(QHostAddress::LocalHost);
+            m_port = m_server->serverPort();
+        },
+        Qt::BlockingQueuedConnection);
+    return listening;
+}
+
+QUrl HttpRangeServer::url(const QString &path) const
+{
+    QUrl url;
+    url.setScheme(QStringLiteral("http"));
+    url.setHost(QStringLiteral("127.0.0.1"));
+    url.setPort(m_port);
+    url.setPath(path);
+    return url;
+}
+
+double HttpRangeServer::cpuTime() const
+{
+    double msecs = -1;
+#ifdef Q_OS_LINUX
+    QMetaObject::invokeMethod(
+        m_server,
+        [&msecs]() {
+            rusage usage;
+            if (!getrusage(RUSAGE_THREAD, &usage)) {
+                msecs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+            }
+        },
+        Qt::BlockingQueuedConnection);
+#endif
+    return msecs;
+}
+
+void HttpRangeServer::newConnection()
+{
+    while (QTcpSocket *socket = m_server->nextPendingConnection()) {
+        m_connections.ref();
+        new RangeConnection(this, socket);
+    }
+}
+
+bool HttpRangeServer::takeReset()
+{
+    int left = m_resetsLeft.loadAcquire();
+    while (left > 0) {
+        if (m_resetsLeft.testAndSetOrdered(left, left - 1)) {
+            m_resets.ref();
+            return true;
+        }
+        left = m_resetsLeft.loadAcquire();
+    }
+    return false;
+}
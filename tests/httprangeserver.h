@@ -0,0 +1,105 @@
+/***************************************************************************
+ *   This file is part of the KDE project                                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA .        *
+ ***************************************************************************/
+
+#ifndef KGET_HTTPRANGESERVER_H
+#define KGET_HTTPRANGESERVER_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QUrl>
+
+class QThread;
+class QTcpServer;
+
+/**
+ * A HTTP/1.1 server on the loopback interface that serves data with range requests,
+ * it runs in its own thread so that it does not compete with the client's event loop.
+ *
+ * Every path serves the same data. Faults like the latency of a distant server, a slow
+ * mirror or connections that get reset can be simulated, as well as servers that redirect,
+ * send chunked bodies or do not support ranges.
+ */
+class HttpRangeServer
+{
+public:
+    struct Faults {
+        int latency = 0; ///< msecs before each response is sent
+        qint64 bandwidth = 0; ///< bytes per second of each connection, 0 for no limit
+        qint64 resetAfter = 0; ///< body bytes after which a connection gets reset
+        int resets = 0; ///< how many connections get reset after resetAfter bytes
+        bool chunked = false; ///< bodies are sent with chunked transfer encoding and without Content-Length
+        bool ignoreRange = false; ///< range requests are answered with 200 and the whole data
+        QByteArray redirectPath; ///< requests for this path are redirected to /file.bin
+    };
+
+    HttpRangeServer(const QByteArray &data, const Faults &faults);
+    ~HttpRangeServer();
+
+    /**
+     * Starts listening on a free port of the loopback interface
+     */
+    bool listen();
+
+    QUrl url(const QString &path = QStringLiteral("/file.bin")) const;
+
+    int requests() const
+    {
+        return m_requests.loadAcquire();
+    }
+
+    int resets() const
+    {
+        return m_resets.loadAcquire();
+    }
+
+    int connections() const
+    {
+        return m_connections.loadAcquire();
+    }
+
+    /**
+     * @return the CPU time the thread of the server used so far in msecs, so that
+     * it can be told apart from the CPU time of the client in the same process;
+     * -1 if the CPU time of a thread can not be measured on this platform
+     */
+    double cpuTime() const;
+
+private:
+    void newConnection();
+
+    /**
+     * @return true if the calling connection should be reset
+     */
+    bool takeReset();
+
+    friend class RangeConnection;
+
+private:
+    const QByteArray m_data;
+    const Faults m_faults;
+    QThread *m_thread;
+    QTcpServer *m_server;
+    quint16 m_port;
+    QAtomicInt m_requests;
+    QAtomicInt m_resetsLeft;
+    QAtomicInt m_resets;
+    QAtomicInt m_connections;
+};
+
+#endif
@@ -122,6 +122,34 @@ void VerfierTest::testPartialChecksums_data()
                                                     << expectedResult(true, "sha1");
 }
 
+void VerfierTest::testChecksums()
+{
+    QFETCH(KIO::filesize_t, length);
+
+    // one pass gives the same results as one pass per type
+    QHash<QString, PartialChecksums> partialChecksums;
+    const QHash<QString, QString> checksums = Verifier::checksums(m_file, m_supported, m_supported, &partialChecksums, length, nullptr);
+    QCOMPARE(checksums.count(), m_supported.count());
+    QCOMPARE(partialChecksums.count(), m_supported.count());
+
+    foreach (const QString &type, m_supported) {
+        QCOMPARE(checksums.value(type), Verifier::checksum(m_file, type, nullptr));
+
+        const PartialChecksums expected = Verifier::partialChecksums(m_file, type, length, nullptr);
+        QCOMPARE(partialChecksums.value(type).length(), expected.length());
+        QCOMPARE(partialChecksums.value(type).checksums(), expected.checksums());
+    }
+}
+
+void VerfierTest::testChecksums_data()
+{
+    QTest::addColumn<KIO::filesize_t>("length");
+
+    QTest::newRow("default length") << KIO::filesize_t(0);
+    QTest::newRow("500 KiB") << KIO::filesize_t(500 * 1024);
+    QTest::newRow("not a multiple of the buffer") << KIO::filesize_t(123457);
+}
+
 void VerfierTest::testIsChecksum()
 {
     QFETCH(QString, type);
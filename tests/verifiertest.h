@@ -38,6 +38,8 @@ private Q_SLOTS:
     void testChecksum_data();
     void testPartialChecksums();
     void testPartialChecksums_data();
+    void testChecksums();
+    void testChecksums_data();
     void testIsChecksum();
     void testIsChecksum_data();
     void testAvailableChecksum();
@@ -10,6 +10,7 @@
 */
 
 #include "transferKio.h"
+#include "core/hostconnectionbroker.h"
 #include "core/signature.h"
 #include "core/verifier.h"
 #include "settings.h"
@@ -92,8 +93,15 @@ void TransferKio::start()
 {
     if (!m_movingFile && (status() != Finished)) {
         m_stopped = false;
-        if (!m_copyjob)
+        if (!m_copyjob) {
+            // too many connections to the server already, started once one is free
+            if (!HostConnectionBroker::self()->acquire(this, m_source)) {
+                setStatus(Job::Running, i18nc("transfer state: waiting for a free connection", "Waiting for a connection..."), "network-connect");
+                setTransferChange(Tc_Status, true);
+                return;
+            }
             createJob();
+        }
 
         qCDebug(KGET_DEBUG) << "TransferKio::start";
         setStatus(Job::Running,
@@ -115,6 +123,7 @@ void TransferKio::stop()
         m_copyjob->kill(KJob::EmitResult);
         m_copyjob = nullptr;
     }
+    HostConnectionBroker::self()->release(this);
 
     qCDebug(KGET_DEBUG) << "Stop";
     setStatus(Job::Stopped);
@@ -171,6 +180,7 @@ void TransferKio::slotResult(KJob *kioJob)
     }
     // when slotResult gets called, the m_copyjob has already been deleted!
     m_copyjob = nullptr;
+    HostConnectionBroker::self()->release(this);
 
     // If it is an ftp file, there's still work to do
     Transfer::ChangesFlags flags = (m_source.scheme() != "ftp") ? Tc_Status : Tc_None;
@@ -205,6 +215,13 @@ void TransferKio::slotResult(KJob *kioJob)
     setTransferChange(flags, true);
 }
 
+void TransferKio::slotConnectionAcquired()
+{
+    if (!m_stopped && !m_copyjob) {
+        start();
+    }
+}
+
 void TransferKio::slotInfoMessage(KJob *kioJob, const QString &msg)
 {
     Q_UNUSED(kioJob)
@@ -67,6 +67,7 @@ private Q_SLOTS:
     void newDestResult(KJob *result);
     void slotVerified(bool isVerified);
     void slotStatResult(KJob *kioJob);
+    void slotConnectionAcquired();
 
 private:
     Verifier *m_verifier;
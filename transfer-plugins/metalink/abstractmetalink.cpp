@@ -193,6 +193,12 @@ void AbstractMetalink::updateStatus(DataSourceFactory *sender, bool *changeStatu
     }
 }
 
+void AbstractMetalink::slotStorageError(const QString &errorText)
+{
+    setError(errorText, "dialog-cancel", Job::NotSolveable);
+    setTransferChange(Tc_Status, true);
+}
+
 void AbstractMetalink::slotVerified(bool isVerified)
 {
     Q_UNUSED(isVerified)
@@ -83,6 +83,11 @@ protected Q_SLOTS:
     void slotVerified(bool isVerified);
     virtual void slotSignatureVerified();
 
+    /**
+     * A file of the metalink could not be allocated or written to
+     */
+    void slotStorageError(const QString &errorText);
+
 protected:
     /**
      * Starts the type of metalink download
@@ -79,6 +79,7 @@ void MetalinkHttp::load(const QDomElement *element)
     connect(fac->verifier(), &Verifier::verified, this, &MetalinkHttp::slotVerified);
     connect(fac->signature(), SIGNAL(verified(int)), this, SLOT(slotSignatureVerified()));
     connect(fac, &DataSourceFactory::log, this, &Transfer::setLog);
+    connect(fac, &DataSourceFactory::storageError, this, &MetalinkHttp::slotStorageError);
 
     fac->load(element);
 
@@ -195,6 +196,7 @@ bool MetalinkHttp::metalinkHttpInit()
     connect(dataFactory->verifier(), &Verifier::verified, this, &MetalinkHttp::slotVerified);
     connect(dataFactory->signature(), SIGNAL(verified(int)), this, SLOT(slotSignatureVerified()));
     connect(dataFactory, &DataSourceFactory::log, this, &Transfer::setLog);
+    connect(dataFactory, &DataSourceFactory::storageError, this, &MetalinkHttp::slotStorageError);
 
     // add the Mirrors Sources
 
@@ -132,7 +132,6 @@ bool MetalinkXml::metalinkInit(const QUrl &src, const QByteArray &data)
     QList<KGetMetalink::File>::const_iterator it;
     QList<KGetMetalink::File>::const_iterator itEnd = m_metalink.files.files.constEnd();
     m_totalSize = 0;
-    KIO::fileoffset_t segSize = 500 * 1024; // TODO use config here!
     const QUrl tempDest = QUrl(m_dest.adjusted(QUrl::RemoveFilename));
     QUrl dest;
     for (it = m_metalink.files.files.constBegin(); it != itEnd; ++it) {
@@ -149,7 +148,7 @@ bool MetalinkXml::metalinkInit(const QUrl &src, const QByteArray &data)
         m_totalSize += fileSize;
 
         // create a DataSourceFactory for each separate file
-        auto *dataFactory = new DataSourceFactory(this, dest, fileSize, segSize);
+        auto *dataFactory = new DataSourceFactory(this, dest, fileSize);
         dataFactory->setMaxMirrorsUsed(MetalinkSettings::mirrorsPerFile());
 
         // TODO compare available file size (<size>) with the sizes of the server while downloading?
@@ -159,6 +158,7 @@ bool MetalinkXml::metalinkInit(const QUrl &src, const QByteArray &data)
         connect(dataFactory->verifier(), &Verifier::verified, this, &MetalinkXml::slotVerified);
         connect(dataFactory->signature(), &Signature::verified, this, &MetalinkXml::slotSignatureVerified);
         connect(dataFactory, &DataSourceFactory::log, this, &Transfer::setLog);
+        connect(dataFactory, &DataSourceFactory::storageError, this, &MetalinkXml::slotStorageError);
 
         // add the DataSources
         for (int i = 0; i < urlList.size(); ++i) {
@@ -288,6 +288,7 @@ void MetalinkXml::load(const QDomElement *element)
         connect(file->verifier(), &Verifier::verified, this, &MetalinkXml::slotVerified);
         connect(file->signature(), &Signature::verified, this, &MetalinkXml::slotSignatureVerified);
         connect(file, &DataSourceFactory::log, this, &Transfer::setLog);
+        connect(file, &DataSourceFactory::storageError, this, &MetalinkXml::slotStorageError);
 
         // start the DataSourceFactories that were Started when KGet was closed
         if (file->status() == Job::Running) {
@@ -0,0 +1,29 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#include "http2datasource.h"
+#include "http2session.h"
+#include "http2stream.h"
+
+Http2DataSource::Http2DataSource(const QUrl &srcUrl, QObject *parent)
+    : HttpDataSource(srcUrl, parent)
+{
+}
+
+Http2DataSource::~Http2DataSource()
+{
+}
+
+HttpConnection *Http2DataSource::newConnection(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    // streams redirected to another server fall back to HTTP/1.1, the following ones use its session
+    Http2Session *session = Http2Session::session(m_sourceUrl, this);
+    return new Http2Stream(session, m_sourceUrl, segmentSize, segmentRange, this);
+}
+
+#include "moc_http2datasource.cpp"
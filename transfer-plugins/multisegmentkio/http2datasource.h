@@ -0,0 +1,31 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_HTTP2DATASOURCE_H
+#define KGET_HTTP2DATASOURCE_H
+
+#include "httpdatasource.h"
+
+/**
+ * Downloads https urls with all segments as streams of one HTTP/2 connection,
+ * so that only one connection has to be opened and its window grows for all of them.
+ * The connection is shared with the other transfers downloading from the same server.
+ */
+class Http2DataSource : public HttpDataSource
+{
+    Q_OBJECT
+
+public:
+    Http2DataSource(const QUrl &srcUrl, QObject *parent);
+    ~Http2DataSource() override;
+
+protected:
+    HttpConnection *newConnection(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) override;
+};
+
+#endif
@@ -0,0 +1,368 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#include "http2session.h"
+#include "http2stream.h"
+#include "httpconnection.h"
+
+#include "core/hostconnectionbroker.h"
+
+#include "kget_debug.h"
+#include <QDebug>
+
+#include <QSslConfiguration>
+#include <QSslSocket>
+#include <QVector>
+
+// the windows are far larger than the defaults of 64 KiB, so that a high latency does not limit bulk downloads
+const qint32 STREAM_WINDOW_SIZE = 16 * 1024 * 1024;
+const qint32 CONNECTION_WINDOW_SIZE = 64 * 1024 * 1024;
+const quint32 MAX_CONCURRENT_STREAMS = 100;
+
+typedef QHash<QString, Http2Session *> Http2Sessions;
+Q_GLOBAL_STATIC(Http2Sessions, s_sessions)
+
+static int onHeader(nghttp2_session *session,
+                    const nghttp2_frame *frame,
+                    const uint8_t *name,
+                    size_t nameLength,
+                    const uint8_t *value,
+                    size_t valueLength,
+                    uint8_t flags,
+                    void *userData)
+{
+    Q_UNUSED(session)
+    Q_UNUSED(flags)
+    if ((frame->hd.type == NGHTTP2_HEADERS) && (frame->headers.cat == NGHTTP2_HCAT_RESPONSE)) {
+        Http2Stream *stream = static_cast<Http2Session *>(userData)->stream(frame->hd.stream_id);
+        if (stream) {
+            stream->header(QByteArray(reinterpret_cast<const char *>(name), nameLength), QByteArray(reinterpret_cast<const char *>(value), valueLength));
+        }
+    }
+    return 0;
+}
+
+static int onFrameReceived(nghttp2_session *session, const nghttp2_frame *frame, void *userData)
+{
+    Q_UNUSED(session)
+    if ((frame->hd.type == NGHTTP2_HEADERS) && (frame->headers.cat == NGHTTP2_HCAT_RESPONSE)) {
+        Http2Stream *stream = static_cast<Http2Session *>(userData)->stream(frame->hd.stream_id);
+        if (stream) {
+            stream->headersReceived();
+        }
+    } else if (frame->hd.type == NGHTTP2_GOAWAY) {
+        static_cast<Http2Session *>(userData)->goAwayReceived(frame->goaway.last_stream_id, frame->goaway.error_code);
+    }
+    return 0;
+}
+
+static int onDataChunkReceived(nghttp2_session *session, uint8_t flags, int32_t streamId, const uint8_t *data, size_t length, void *userData)
+{
+    Q_UNUSED(flags)
+    Http2Stream *stream = static_cast<Http2Session *>(userData)->stream(streamId);
+    if (stream) {
+        stream->dataReceived(reinterpret_cast<const char *>(data), length);
+    } else {
+        // nobody is interested in the data, so it is acknowledged right away
+        nghttp2_session_consume(session, streamId, length);
+    }
+    return 0;
+}
+
+static int onStreamClosed(nghttp2_session *session, int32_t streamId, uint32_t errorCode, void *userData)
+{
+    Q_UNUSED(session)
+    static_cast<Http2Session *>(userData)->streamClosed(streamId, errorCode);
+    return 0;
+}
+
+Http2Session::Http2Session(const QUrl &url, QObject *parent)
+    : QObject(parent)
+    , m_url(url)
+    , m_socket(nullptr)
+    , m_session(nullptr)
+    , m_protocol(Unknown)
+    , m_waitingForConnection(false)
+    , m_receiving(false)
+    , m_draining(false)
+{
+}
+
+Http2Session::~Http2Session()
+{
+    close();
+    if (!s_sessions.isDestroyed() && (s_sessions->value(origin()) == this)) {
+        s_sessions->remove(origin());
+    }
+}
+
+Http2Session *Http2Session::session(const QUrl &url, QObject *user)
+{
+    const QString origin = HttpConnection::origin(url);
+    Http2Session *session = s_sessions->value(origin);
+    if (!session) {
+        qCDebug(KGET_DEBUG) << "Create Http2Session for" << origin;
+        session = new Http2Session(url, nullptr);
+        s_sessions->insert(origin, session);
+    }
+
+    if (!session->m_users.contains(user)) {
+        session->m_users.insert(user);
+        connect(user, &QObject::destroyed, session, &Http2Session::removeUser);
+    }
+    return session;
+}
+
+void Http2Session::removeUser(QObject *user)
+{
+    if (!m_users.remove(user)) {
+        return;
+    }
+    disconnect(user, &QObject::destroyed, this, &Http2Session::removeUser);
+
+    // the streams of the last user might still be deleted later
+    if (m_users.isEmpty()) {
+        qCDebug(KGET_DEBUG) << "Http2Session for" << origin() << "is not used anymore";
+        s_sessions->remove(origin());
+        deleteLater();
+    }
+}
+
+QString Http2Session::origin() const
+{
+    return HttpConnection::origin(m_url);
+}
+
+Http2Stream *Http2Session::stream(qint32 streamId) const
+{
+    return m_streams.value(streamId);
+}
+
+void Http2Session::connectToServer()
+{
+    if (m_socket || (m_protocol != Unknown)) {
+        return;
+    }
+    // all streams share this connection, so only one is needed
+    if (!HostConnectionBroker::self()->acquire(this, m_url)) {
+        m_waitingForConnection = true;
+        return;
+    }
+    m_waitingForConnection = false;
+
+    m_socket = new QSslSocket(this);
+    QSslConfiguration config = m_socket->sslConfiguration();
+    config.setAllowedNextProtocols(QList<QByteArray>() << "h2" << "http/1.1");
+    m_socket->setSslConfiguration(config);
+
+    connect(m_socket, &QSslSocket::encrypted, this, &Http2Session::slotEncrypted);
+    connect(m_socket, &QIODevice::readyRead, this, &Http2Session::slotReadyRead);
+    connect(m_socket, &QAbstractSocket::disconnected, this, &Http2Session::slotDisconnected);
+    connect(m_socket, &QAbstractSocket::errorOccurred, this, &Http2Session::slotDisconnected);
+
+    qCDebug(KGET_DEBUG) << "Connecting to" << origin();
+    m_socket->connectToHostEncrypted(m_url.host(), m_url.port(443));
+}
+
+void Http2Session::slotConnectionAcquired()
+{
+    if (m_waitingForConnection) {
+        connectToServer();
+    }
+}
+
+void Http2Session::slotEncrypted()
+{
+    if (m_socket->sslConfiguration().nextNegotiatedProtocol() != "h2") {
+        qCDebug(KGET_DEBUG) << origin() << "does not support HTTP/2, using HTTP/1.1";
+        close();
+        m_protocol = Http1;
+        Q_EMIT ready();
+        return;
+    }
+
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, onHeader);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, onFrameReceived);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, onDataChunkReceived);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, onStreamClosed);
+
+    // data is acknowledged once it has been written, see consume()
+    nghttp2_option *option;
+    nghttp2_option_new(&option);
+    nghttp2_option_set_no_auto_window_update(option, 1);
+
+    nghttp2_session_client_new2(&m_session, callbacks, this, option);
+    nghttp2_option_del(option);
+    nghttp2_session_callbacks_del(callbacks);
+
+    const nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, MAX_CONCURRENT_STREAMS},
+                                               {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, STREAM_WINDOW_SIZE}};
+    nghttp2_submit_settings(m_session, NGHTTP2_FLAG_NONE, settings, 2);
+    nghttp2_session_set_local_window_size(m_session, NGHTTP2_FLAG_NONE, 0, CONNECTION_WINDOW_SIZE);
+
+    qCDebug(KGET_DEBUG) << "Using HTTP/2 for" << origin();
+    m_protocol = Http2;
+    sendPending();
+    Q_EMIT ready();
+}
+
+qint32 Http2Session::submitRequest(Http2Stream *stream, const QList<QPair<QByteArray, QByteArray>> &headers)
+{
+    if (!m_session) {
+        return -1;
+    }
+
+    QVector<nghttp2_nv> nva;
+    nva.reserve(headers.count());
+    for (const QPair<QByteArray, QByteArray> &header : headers) {
+        nghttp2_nv nv;
+        nv.name = reinterpret_cast<uint8_t *>(const_cast<char *>(header.first.constData()));
+        nv.namelen = header.first.size();
+        nv.value = reinterpret_cast<uint8_t *>(const_cast<char *>(header.second.constData()));
+        nv.valuelen = header.second.size();
+        nv.flags = NGHTTP2_NV_FLAG_NONE;
+        nva.append(nv);
+    }
+
+    const int32_t streamId = nghttp2_submit_request(m_session, nullptr, nva.constData(), nva.count(), nullptr, nullptr);
+    if (streamId < 0) {
+        qCDebug(KGET_DEBUG) << "Could not send the request:" << nghttp2_strerror(streamId);
+        return -1;
+    }
+
+    m_streams.insert(streamId, stream);
+    sendPending();
+    return streamId;
+}
+
+void Http2Session::resetStream(qint32 streamId)
+{
+    if (m_session && m_streams.remove(streamId)) {
+        nghttp2_submit_rst_stream(m_session, NGHTTP2_FLAG_NONE, streamId, NGHTTP2_CANCEL);
+        sendPending();
+        checkDrained();
+    }
+}
+
+void Http2Session::consume(qint32 streamId, size_t length)
+{
+    if (m_session) {
+        nghttp2_session_consume(m_session, streamId, length);
+        sendPending();
+    }
+}
+
+void Http2Session::streamClosed(qint32 streamId, quint32 errorCode)
+{
+    Http2Stream *stream = m_streams.take(streamId);
+    if (stream) {
+        stream->streamClosed(errorCode);
+    }
+}
+
+void Http2Session::goAwayReceived(qint32 lastStreamId, quint32 errorCode)
+{
+    // the streams after lastStreamId are closed as refused by nghttp2 and get sent again
+    qCDebug(KGET_DEBUG) << origin() << "sent GOAWAY with" << errorCode << "last stream:" << lastStreamId;
+    m_draining = true;
+}
+
+void Http2Session::checkDrained()
+{
+    if (m_draining && m_streams.isEmpty() && !m_receiving) {
+        lose(QStringLiteral("GOAWAY"));
+    }
+}
+
+void Http2Session::slotReadyRead()
+{
+    if (!m_session) {
+        return;
+    }
+
+    const QByteArray data = m_socket->readAll();
+    m_receiving = true;
+    const ssize_t read = nghttp2_session_mem_recv(m_session, reinterpret_cast<const uint8_t *>(data.constData()), data.size());
+    m_receiving = false;
+    if (read < 0) {
+        lose(QString::fromLatin1(nghttp2_strerror(read)));
+        return;
+    }
+    sendPending();
+    checkDrained();
+}
+
+void Http2Session::sendPending()
+{
+    if (!m_session || m_receiving) {
+        return;
+    }
+
+    const uint8_t *data = nullptr;
+    ssize_t length;
+    while ((length = nghttp2_session_mem_send(m_session, &data)) > 0) {
+        m_socket->write(reinterpret_cast<const char *>(data), length);
+    }
+    if (length < 0) {
+        lose(QString::fromLatin1(nghttp2_strerror(length)));
+    }
+}
+
+void Http2Session::slotDisconnected()
+{
+    if (!m_socket || (m_protocol == Http1)) {
+        return;
+    }
+
+    // an established connection is simply opened again, e.g. the server closes idle ones
+    if (m_protocol == Http2) {
+        lose(m_socket->errorString());
+    } else {
+        fail(m_socket->errorString());
+    }
+}
+
+void Http2Session::lose(const QString &reason)
+{
+    qCDebug(KGET_DEBUG) << "HTTP/2 connection to" << origin() << "ended:" << reason;
+    close();
+    m_protocol = Unknown;
+    m_streams.clear();
+    Q_EMIT lost();
+}
+
+void Http2Session::fail(const QString &errorText)
+{
+    qCDebug(KGET_DEBUG) << "HTTP/2 connection to" << origin() << "failed:" << errorText;
+    close();
+    // the next stream tries again
+    m_protocol = Unknown;
+    m_streams.clear();
+    Q_EMIT failed(errorText);
+}
+
+void Http2Session::close()
+{
+    if (m_session) {
+        nghttp2_session_del(m_session);
+        m_session = nullptr;
+    }
+    if (m_socket) {
+        m_socket->disconnect(this);
+        m_socket->abort();
+        m_socket->deleteLater();
+        m_socket = nullptr;
+    }
+    m_waitingForConnection = false;
+    m_draining = false;
+    HostConnectionBroker::self()->release(this);
+}
+
+#include "moc_http2session.cpp"
@@ -0,0 +1,169 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_HTTP2SESSION_H
+#define KGET_HTTP2SESSION_H
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPair>
+#include <QSet>
+#include <QUrl>
+
+#include <nghttp2/nghttp2.h>
+
+class Http2Stream;
+class QSslSocket;
+
+/**
+ * A single HTTP/2 connection to a server that the segments of all downloads from it
+ * share as streams, there is one session per origin.
+ *
+ * The protocol is negotiated via ALPN, if the server does not speak HTTP/2 protocol()
+ * becomes Http1 and the streams fall back to their own HTTP/1.1 connections.
+ * Data is only acknowledged to the server once it has been written with consume(), so
+ * the flow control windows limit how much data is buffered if the disk is slow.
+ *
+ * Once the server sends GOAWAY the session drains: the streams it still serves finish,
+ * the refused ones and new ones wait until the connection is done and a new one is opened.
+ */
+class Http2Session : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Protocol { Unknown, Http2, Http1 };
+
+    ~Http2Session() override;
+
+    /**
+     * @return the session for the origin of url, it is created if there is none yet
+     * @param user keeps the session alive until it is destroyed or calls removeUser()
+     */
+    static Http2Session *session(const QUrl &url, QObject *user);
+
+    /**
+     * The session is deleted once it has no users anymore
+     */
+    void removeUser(QObject *user);
+
+    Protocol protocol() const
+    {
+        return m_protocol;
+    }
+
+    /**
+     * @see HttpConnection::origin()
+     */
+    QString origin() const;
+
+    /**
+     * Connects to the server if that did not happen already, ready() is emitted once
+     * the protocol is known
+     */
+    void connectToServer();
+
+    /**
+     * Sends a GET request for stream
+     * @param headers the headers including the pseudo headers
+     * @return the id of the stream, -1 if it could not be sent
+     */
+    qint32 submitRequest(Http2Stream *stream, const QList<QPair<QByteArray, QByteArray>> &headers);
+
+    /**
+     * Cancels the stream, its data is not received anymore
+     */
+    void resetStream(qint32 streamId);
+
+    /**
+     * Acknowledges length bytes of data of the stream, so that the server sends more
+     */
+    void consume(qint32 streamId, size_t length);
+
+    /**
+     * @return the stream with streamId, nullptr if there is none
+     */
+    Http2Stream *stream(qint32 streamId) const;
+
+    /**
+     * Called by the session callbacks once a stream got closed
+     */
+    void streamClosed(qint32 streamId, quint32 errorCode);
+
+    /**
+     * Called by the session callbacks once the server sent GOAWAY
+     */
+    void goAwayReceived(qint32 lastStreamId, quint32 errorCode);
+
+    /**
+     * @return true if the server does not accept new streams on the connection anymore,
+     * new streams have to wait for lost()
+     */
+    bool isDraining() const
+    {
+        return m_draining;
+    }
+
+Q_SIGNALS:
+    /**
+     * Emitted once the protocol is known, the streams can be sent then
+     */
+    void ready();
+
+    /**
+     * Emitted if no connection could be established, all streams are closed
+     */
+    void failed(const QString &errorText);
+
+    /**
+     * Emitted once an established connection ended, because the server closed it, it broke
+     * or it was drained after GOAWAY; all streams are closed and can be sent again,
+     * connectToServer() opens a new connection for them
+     */
+    void lost();
+
+private Q_SLOTS:
+    void slotEncrypted();
+    void slotReadyRead();
+    void slotDisconnected();
+    void slotConnectionAcquired();
+
+private:
+    Http2Session(const QUrl &url, QObject *parent);
+
+    /**
+     * Sends everything nghttp2 has queued
+     */
+    void sendPending();
+    void fail(const QString &errorText);
+
+    /**
+     * Closes an established connection and emits lost()
+     */
+    void lose(const QString &reason);
+
+    /**
+     * Closes a drained connection once its last stream is done
+     */
+    void checkDrained();
+    void close();
+
+private:
+    const QUrl m_url;
+    QSslSocket *m_socket;
+    nghttp2_session *m_session;
+    Protocol m_protocol;
+    bool m_waitingForConnection;
+    bool m_receiving; ///< nghttp2 must not send from within its callbacks
+    bool m_draining; ///< GOAWAY was received, no new streams are accepted
+    QHash<qint32, Http2Stream *> m_streams;
+    QSet<QObject *> m_users;
+};
+
+#endif
@@ -0,0 +1,352 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#include "http2stream.h"
+#include "http2session.h"
+#include "multisegkiosettings.h"
+
+#include "core/bufferpool.h"
+
+#include "kget_debug.h"
+#include "kget_version.h"
+
+#include <QDebug>
+
+#include <QTimer>
+
+// how often a request is sent again on a new connection without getting any data in between
+const int MAX_RESUBMITS = 3;
+
+Http2Stream::Http2Stream(Http2Session *session,
+                         const QUrl &src,
+                         const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize,
+                         const QPair<int, int> &segmentRange,
+                         QObject *parent)
+    : HttpConnection(src, segmentSize, segmentRange, parent)
+    , m_session(session)
+    , m_streamId(-1)
+    , m_http2(false)
+    , m_resubmits(0)
+{
+    if (m_session) {
+        connect(m_session, &Http2Session::ready, this, &Http2Stream::slotSessionReady);
+        connect(m_session, &Http2Session::failed, this, &Http2Stream::slotSessionFailed);
+        connect(m_session, &Http2Session::lost, this, &Http2Stream::slotSessionLost);
+    }
+}
+
+Http2Stream::~Http2Stream()
+{
+    // HttpConnection can not call the reimplemented closeSocket() anymore
+    if (m_http2) {
+        dropBuffer();
+        if (m_session) {
+            m_session->resetStream(m_streamId);
+        }
+    }
+}
+
+void Http2Stream::start()
+{
+    if (m_running) {
+        return;
+    }
+
+    m_http2 = m_session && (m_session->protocol() != Http2Session::Http1) && (m_session->origin() == origin(m_url));
+    if (!m_http2) {
+        HttpConnection::start();
+        return;
+    }
+
+    // the session holds the connection to the server for all streams
+    m_running = true;
+    m_timeout->start();
+    if (m_session->protocol() == Http2Session::Unknown) {
+        m_state = Connecting;
+        m_session->connectToServer();
+    } else {
+        submit();
+    }
+}
+
+void Http2Stream::stop()
+{
+    if (m_http2) {
+        closeSocket();
+    }
+    HttpConnection::stop();
+}
+
+void Http2Stream::slotSessionReady()
+{
+    if (!m_running || !m_http2 || (m_state != Connecting)) {
+        return;
+    }
+
+    if (m_session->protocol() == Http2Session::Http1) {
+        m_http2 = false;
+        m_running = false;
+        m_state = Idle;
+        HttpConnection::start();
+    } else {
+        submit();
+    }
+}
+
+void Http2Stream::slotSessionFailed(const QString &errorText)
+{
+    if (m_running && m_http2) {
+        m_streamId = -1;
+        fail(errorText);
+    }
+}
+
+void Http2Stream::slotSessionLost()
+{
+    // the streams are closed already, unless they are waiting for the new connection
+    if (m_running && m_http2) {
+        if (m_state == Connecting) {
+            m_session->connectToServer();
+        } else if (m_state != Idle) {
+            m_streamId = -1;
+            resubmit();
+        }
+    }
+}
+
+void Http2Stream::resubmit()
+{
+    // a server that keeps dropping the request is an error of the source after all
+    if (++m_resubmits > MAX_RESUBMITS) {
+        fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+        return;
+    }
+
+    qCDebug(KGET_DEBUG) << "Sending the request for" << m_url << "at" << m_offset << "again, attempt" << m_resubmits;
+    // the data that was not written yet is requested again
+    m_writePending = false;
+    dropBuffer();
+    m_streamId = -1;
+    submit();
+}
+
+void Http2Stream::connectToServer()
+{
+    if (m_http2) {
+        submit();
+    } else {
+        HttpConnection::connectToServer();
+    }
+}
+
+void Http2Stream::sendRequest()
+{
+    if (m_http2) {
+        submit();
+    } else {
+        HttpConnection::sendRequest();
+    }
+}
+
+void Http2Stream::closeSocket()
+{
+    if (m_http2) {
+        dropBuffer();
+        if (m_session) {
+            m_session->resetStream(m_streamId);
+        }
+        m_streamId = -1;
+    }
+    HttpConnection::closeSocket();
+}
+
+void Http2Stream::submit()
+{
+    if (!m_session) {
+        fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+        return;
+    }
+    m_session->resetStream(m_streamId);
+    m_streamId = -1;
+    // wait for lost() or ready() for a connection that takes new streams
+    if (m_session->isDraining() || (m_session->protocol() == Http2Session::Unknown)) {
+        m_state = Connecting;
+        m_session->connectToServer();
+        return;
+    }
+    if (m_session->protocol() != Http2Session::Http2) {
+        fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+        return;
+    }
+
+    QByteArray path = m_url.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority | QUrl::RemoveFragment);
+    if (path.isEmpty()) {
+        path = "/";
+    }
+
+    QList<QPair<QByteArray, QByteArray>> headers;
+    headers << qMakePair(QByteArray(":method"), QByteArray("GET"));
+    headers << qMakePair(QByteArray(":scheme"), m_url.scheme().toLatin1());
+    headers << qMakePair(QByteArray(":authority"), m_url.authority(QUrl::FullyEncoded).toLatin1());
+    headers << qMakePair(QByteArray(":path"), path);
+    headers << qMakePair(QByteArray("user-agent"), QByteArray("KGet/" KGET_VERSION_STRING));
+    headers << qMakePair(QByteArray("accept"), QByteArray("*/*"));
+    headers << qMakePair(QByteArray("accept-encoding"), QByteArray("identity"));
+    // the whole file is requested if its size is not known yet
+    if (!m_findFilesize) {
+        headers << qMakePair(QByteArray("range"), "bytes=" + QByteArray::number(m_offset) + '-' + QByteArray::number(m_offset + m_totalBytesLeft - 1));
+    }
+
+    m_statusLine.clear();
+    m_headers.clear();
+    m_state = ReadingHeaders;
+    m_timeout->start();
+    m_requestTimer.start();
+    m_streamId = m_session->submitRequest(this, headers);
+    qCDebug(KGET_DEBUG) << "Requesting" << m_url << "at" << m_offset << "as stream" << m_streamId;
+    if (m_streamId == -1) {
+        fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+    }
+}
+
+void Http2Stream::header(const QByteArray &name, const QByteArray &value)
+{
+    // the names are lower case already
+    if (name == ":status") {
+        // HTTP/2 has no reason phrase
+        m_statusLine = "HTTP/2 " + value + ' ';
+    } else {
+        m_headers.insert(name, value);
+    }
+}
+
+void Http2Stream::headersReceived()
+{
+    if (!m_running || (m_state != ReadingHeaders)) {
+        return;
+    }
+    m_timeout->start();
+
+    // 1xx responses are followed by the actual one
+    if (m_statusLine.split(' ').value(1).startsWith('1')) {
+        m_statusLine.clear();
+        m_headers.clear();
+        return;
+    }
+
+    handleResponse();
+}
+
+void Http2Stream::dataReceived(const char *data, size_t length)
+{
+    if (!m_running || (m_state != ReadingBody)) {
+        if (m_session) {
+            m_session->consume(m_streamId, length);
+        }
+        return;
+    }
+    m_timeout->start();
+    m_receivedBytes += length;
+    m_resubmits = 0;
+
+    const int bufferSize = MultiSegKioSettings::saveSegSize() * 1024;
+    if (m_buffer.isEmpty() && (m_buffer.capacity() < bufferSize)) {
+        m_buffer = BufferPool::acquire(bufferSize);
+    }
+
+    // the server sends more than is still needed, e.g. after split()
+    size_t kept = length;
+    if (!m_findFilesize) {
+        kept = qMin(kept, static_cast<size_t>(m_totalBytesLeft - qMin(m_totalBytesLeft, static_cast<KIO::filesize_t>(m_buffer.size()))));
+    }
+    m_buffer.append(data, kept);
+    if (m_session && (kept < length)) {
+        m_session->consume(m_streamId, length - kept);
+    }
+
+    if (m_bodyLeft > 0) {
+        m_bodyLeft -= qMin(m_bodyLeft, static_cast<qint64>(length));
+        if (!m_bodyLeft) {
+            m_state = Idle;
+        }
+    }
+
+    // while the buffer can not be written more data arrives, but at most what the window allows
+    const bool rangeFinished = !m_findFilesize && (static_cast<KIO::filesize_t>(m_buffer.size()) >= m_totalBytesLeft);
+    if (!m_writePending && ((m_buffer.size() >= bufferSize) || rangeFinished || (m_state == Idle))) {
+        if (flush() && (m_state == Idle)) {
+            responseFinished();
+        }
+    }
+}
+
+void Http2Stream::streamClosed(quint32 errorCode)
+{
+    if (!m_running || !m_http2) {
+        return;
+    }
+
+    // refused streams were not processed by the server, e.g. after GOAWAY, so they are simply sent again
+    if (errorCode == NGHTTP2_REFUSED_STREAM) {
+        qCDebug(KGET_DEBUG) << "Stream" << m_streamId << "of" << m_url << "was refused";
+        m_streamId = -1;
+        resubmit();
+        return;
+    }
+    if (errorCode) {
+        qCDebug(KGET_DEBUG) << "Stream" << m_streamId << "of" << m_url << "was reset with" << errorCode;
+        fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+        return;
+    }
+
+    // the body ended with the stream
+    if ((m_state == ReadingBody) && (m_bodyLeft == -1)) {
+        m_state = Idle;
+        if (m_writePending || !flush()) {
+            return;
+        }
+        if (m_findFilesize || !m_totalBytesLeft) {
+            responseFinished();
+            return;
+        }
+    }
+
+    // the response is incomplete
+    if (m_state != Idle) {
+        fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+    }
+}
+
+bool Http2Stream::flush()
+{
+    if (m_buffer.isEmpty() || writeBuffer()) {
+        return true;
+    }
+
+    m_writePending = true;
+    m_writeRetry->start();
+    return false;
+}
+
+void Http2Stream::bufferWritten(int size)
+{
+    // only now the server may send more data
+    if (m_http2 && m_session) {
+        m_session->consume(m_streamId, size);
+    }
+}
+
+void Http2Stream::dropBuffer()
+{
+    if (m_session && !m_buffer.isEmpty()) {
+        m_session->consume(m_streamId, m_buffer.size());
+    }
+    BufferPool::release(m_buffer);
+}
+
+#include "moc_http2stream.cpp"
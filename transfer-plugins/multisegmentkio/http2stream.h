@@ -0,0 +1,89 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_HTTP2STREAM_H
+#define KGET_HTTP2STREAM_H
+
+#include "httpconnection.h"
+
+#include <QPointer>
+
+class Http2Session;
+
+/**
+ * Downloads a range of segments as a stream of a shared Http2Session.
+ *
+ * If the server does not support HTTP/2, or a redirect leads to another server, the
+ * range is downloaded with an own HTTP/1.1 connection as done by HttpConnection.
+ */
+class Http2Stream : public HttpConnection
+{
+    Q_OBJECT
+
+public:
+    Http2Stream(Http2Session *session,
+                const QUrl &src,
+                const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize,
+                const QPair<int, int> &segmentRange,
+                QObject *parent);
+    ~Http2Stream() override;
+
+    /**
+     * The following are called by the session
+     */
+    void header(const QByteArray &name, const QByteArray &value);
+    void headersReceived();
+    void dataReceived(const char *data, size_t length);
+    void streamClosed(quint32 errorCode);
+
+public Q_SLOTS:
+    void start() override;
+    void stop() override;
+
+private Q_SLOTS:
+    void slotSessionReady();
+    void slotSessionFailed(const QString &errorText);
+    void slotSessionLost();
+
+protected:
+    void connectToServer() override;
+    void sendRequest() override;
+    void closeSocket() override;
+    void bufferWritten(int size) override;
+
+private:
+    /**
+     * Requests the range on a new stream
+     */
+    void submit();
+
+    /**
+     * Sends the request again once the session has a new connection, e.g. if the
+     * connection got lost or the stream was refused after GOAWAY
+     */
+    void resubmit();
+
+    /**
+     * Hands the data that will not be written back to the flow control
+     */
+    void dropBuffer();
+
+    /**
+     * Writes the buffer, retries later if that does not work
+     * @return false if the buffer could not be written yet
+     */
+    bool flush();
+
+private:
+    QPointer<Http2Session> m_session;
+    qint32 m_streamId;
+    bool m_http2; ///< the range is downloaded as a stream of m_session
+    int m_resubmits; ///< times the request was sent again without getting data
+};
+
+#endif
@@ -0,0 +1,813 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#include "httpconnection.h"
+#include "multisegkiosettings.h"
+
+#include "core/bufferpool.h"
+#include "core/hostconnectionbroker.h"
+
+#include "kget_debug.h"
+#include "kget_version.h"
+
+#include <KLocalizedString>
+#include <QDebug>
+
+#include <QSslSocket>
+#include <QTimer>
+
+// the data the socket keeps at most while the buffer can not be written, so that the server slows down
+const qint64 SOCKET_BUFFER_SIZE = 1024 * 1024;
+const int MAX_REDIRECTS = 10;
+// seconds without data before the connection is given up, if StallTimeout is disabled
+const int DEFAULT_TIMEOUT = 60;
+// msecs after which refused data is handed on again, if the receiver did not call resumeWriting() before
+const int WRITE_RETRY_INTERVAL = 50;
+
+HttpConnection::HttpConnection(const QUrl &src,
+                               const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize,
+                               const QPair<int, int> &segmentRange,
+                               QObject *parent)
+    : QObject(parent)
+    , m_url(src)
+    , m_socket(nullptr)
+    , m_timeout(new QTimer(this))
+    , m_writeRetry(new QTimer(this))
+    , m_state(Idle)
+    , m_running(false)
+    , m_waitingForConnection(false)
+    , m_findFilesize((segmentRange.first == -1) && (segmentRange.second == -1))
+    , m_canResume(false)
+    , m_keepAlive(false)
+    , m_reused(false)
+    , m_socketRequests(0)
+    , m_writePending(false)
+    , m_redirects(0)
+    , m_currentSegment(segmentRange.first)
+    , m_endSegment(segmentRange.second)
+    , m_offset(segmentSize.first * segmentRange.first)
+    , m_currentSegSize(segmentSize.first)
+    , m_bytesWritten(0)
+    , m_totalBytesLeft(0)
+    , m_receivedBytes(0)
+    , m_segSize(segmentSize)
+    , m_requestedEnd(-1)
+    , m_pipelinedRequests(0)
+    , m_bodyLeft(-1)
+    , m_chunked(false)
+{
+    if (m_endSegment - m_currentSegment == 0) {
+        m_currentSegSize = m_segSize.second;
+    }
+
+    if (m_findFilesize) {
+        m_offset = 0;
+        m_currentSegSize = 0;
+        m_currentSegment = 0;
+        m_endSegment = 0;
+    } else {
+        m_totalBytesLeft = m_segSize.first * (m_endSegment - m_currentSegment) + m_segSize.second;
+    }
+
+    const int timeout = MultiSegKioSettings::stallTimeout();
+    m_timeout->setSingleShot(true);
+    m_timeout->setInterval((timeout ? timeout : DEFAULT_TIMEOUT) * 1000);
+    connect(m_timeout, &QTimer::timeout, this, &HttpConnection::slotTimeout);
+
+    m_writeRetry->setSingleShot(true);
+    m_writeRetry->setInterval(WRITE_RETRY_INTERVAL);
+    connect(m_writeRetry, &QTimer::timeout, this, &HttpConnection::slotWriteRest);
+}
+
+HttpConnection::~HttpConnection()
+{
+    closeSocket();
+    BufferPool::release(m_buffer);
+    HostConnectionBroker::self()->release(this);
+}
+
+QString HttpConnection::origin(const QUrl &url)
+{
+    return url.scheme().toLower() + QLatin1String("://") + url.host().toLower() + QLatin1Char(':')
+        + QString::number(url.port(url.scheme() == QLatin1String("https") ? 443 : 80));
+}
+
+void HttpConnection::setSocket(QSslSocket *socket)
+{
+    closeSocket();
+    m_socket = socket;
+    m_socket->setParent(this);
+    m_reused = true;
+    m_socketRequests = 1;
+    m_state = Idle;
+    connectSocket();
+}
+
+QSslSocket *HttpConnection::takeSocket()
+{
+    if (!m_socket || (m_state != Idle) || !m_keepAlive || m_socket->bytesAvailable() || (m_socket->state() != QAbstractSocket::ConnectedState)) {
+        return nullptr;
+    }
+
+    QSslSocket *socket = m_socket;
+    m_socket = nullptr;
+    socket->disconnect(this);
+    socket->setParent(nullptr);
+    return socket;
+}
+
+void HttpConnection::connectSocket()
+{
+    m_socket->setReadBufferSize(SOCKET_BUFFER_SIZE);
+    connect(m_socket, &QIODevice::readyRead, this, &HttpConnection::slotReadyRead);
+    connect(m_socket, &QAbstractSocket::disconnected, this, &HttpConnection::slotDisconnected);
+    connect(m_socket, &QAbstractSocket::errorOccurred, this, &HttpConnection::slotSocketError);
+    connect(m_socket, QOverload<const QList<QSslError> &>::of(&QSslSocket::sslErrors), this, &HttpConnection::slotSslErrors);
+}
+
+void HttpConnection::closeSocket()
+{
+    if (m_socket) {
+        m_socket->disconnect(this);
+        m_socket->abort();
+        m_socket->deleteLater();
+        m_socket = nullptr;
+    }
+    m_state = Idle;
+    m_reused = false;
+    m_socketRequests = 0;
+    m_requestedEnd = -1;
+    m_pipelinedRequests = 0;
+}
+
+void HttpConnection::start()
+{
+    if (m_running) {
+        return;
+    }
+    // too many connections to the host already, start once there is one for this connection
+    if (!HostConnectionBroker::self()->acquire(this, m_url)) {
+        qCDebug(KGET_DEBUG) << "Waiting for a connection to" << m_url.host();
+        m_waitingForConnection = true;
+        return;
+    }
+    m_waitingForConnection = false;
+    m_running = true;
+
+    if (m_socket && (m_state == Idle) && (m_socket->state() == QAbstractSocket::ConnectedState)) {
+        sendRequest();
+    } else {
+        connectToServer();
+    }
+}
+
+void HttpConnection::stop()
+{
+    qCDebug(KGET_DEBUG) << m_url;
+
+    m_running = false;
+    m_waitingForConnection = false;
+    m_writePending = false;
+    m_timeout->stop();
+    // the response can not be read anymore, so the connection can not be reused
+    if (m_state != Idle) {
+        closeSocket();
+    }
+    BufferPool::release(m_buffer);
+    HostConnectionBroker::self()->release(this);
+}
+
+void HttpConnection::slotConnectionAcquired()
+{
+    if (m_waitingForConnection) {
+        start();
+    }
+}
+
+void HttpConnection::connectToServer()
+{
+    closeSocket();
+
+    m_socket = new QSslSocket(this);
+    connectSocket();
+    m_state = Connecting;
+    m_timeout->start();
+
+    if (m_url.scheme() == QLatin1String("https")) {
+        connect(m_socket, &QSslSocket::encrypted, this, &HttpConnection::slotConnected);
+        m_socket->connectToHostEncrypted(m_url.host(), m_url.port(443));
+    } else {
+        connect(m_socket, &QAbstractSocket::connected, this, &HttpConnection::slotConnected);
+        m_socket->connectToHost(m_url.host(), m_url.port(80));
+    }
+}
+
+void HttpConnection::slotConnected()
+{
+    qCDebug(KGET_DEBUG) << "Connected to" << m_url.host();
+    if (m_running) {
+        sendRequest();
+    }
+}
+
+QByteArray HttpConnection::requestText(KIO::fileoffset_t start, KIO::fileoffset_t end) const
+{
+    QByteArray path = m_url.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority | QUrl::RemoveFragment);
+    if (path.isEmpty()) {
+        path = "/";
+    }
+
+    QByteArray request = "GET " + path + " HTTP/1.1\r\n";
+    request += "Host: " + m_url.authority(QUrl::FullyEncoded).toLatin1() + "\r\n";
+    request += "User-Agent: KGet/" KGET_VERSION_STRING "\r\n";
+    request += "Accept: */*\r\n";
+    request += "Accept-Encoding: identity\r\n";
+    request += "Connection: keep-alive\r\n";
+    if (end != -1) {
+        request += "Range: bytes=" + QByteArray::number(start) + '-' + QByteArray::number(end) + "\r\n";
+    }
+    request += "\r\n";
+    return request;
+}
+
+void HttpConnection::sendRequest()
+{
+    // the whole file is requested if its size is not known yet
+    m_requestedEnd = (m_findFilesize ? -1 : m_offset + m_totalBytesLeft - 1);
+    m_pipelinedRequests = 0;
+
+    qCDebug(KGET_DEBUG) << "Requesting" << m_url << "at" << m_offset << "reused connection:" << m_reused;
+    m_statusLine.clear();
+    m_headers.clear();
+    m_state = ReadingHeaders;
+    m_timeout->start();
+    m_requestTimer.start();
+    m_socket->write(requestText(m_offset, m_requestedEnd));
+    Q_EMIT requestStarted(m_socketRequests > 0);
+    ++m_socketRequests;
+}
+
+void HttpConnection::pipelineRequest()
+{
+    // only a response that leaves the connection open can be followed by another one
+    const bool readingBody = (m_state == ReadingBody) || (m_state == ReadingChunkSize) || (m_state == ReadingChunkEnd) || (m_state == ReadingTrailer);
+    if (!m_running || !m_socket || !m_keepAlive || !readingBody || m_findFilesize || (m_requestedEnd == -1)) {
+        return;
+    }
+
+    const KIO::fileoffset_t end = m_offset + m_totalBytesLeft - 1;
+    if (end <= m_requestedEnd) {
+        return;
+    }
+
+    qCDebug(KGET_DEBUG) << "Pipelining the request of" << m_url << "from" << m_requestedEnd + 1 << "to" << end;
+    m_socket->write(requestText(m_requestedEnd + 1, end));
+    m_requestedEnd = end;
+    ++m_pipelinedRequests;
+    ++m_socketRequests;
+    Q_EMIT requestStarted(true);
+}
+
+void HttpConnection::slotReadyRead()
+{
+    while (m_socket && !m_writePending) {
+        // the end of a chunked body still gets read once the range is finished, so that the connection can be reused
+        const bool readingChunkEnd = (m_state == ReadingChunkSize) || (m_state == ReadingChunkEnd) || (m_state == ReadingTrailer);
+        if (!m_running && !readingChunkEnd) {
+            return;
+        }
+
+        bool progress = false;
+        switch (m_state) {
+        case ReadingHeaders:
+            progress = readHeaders();
+            break;
+        case ReadingBody:
+            progress = readBody();
+            break;
+        case ReadingChunkSize:
+        case ReadingChunkEnd:
+        case ReadingTrailer:
+            progress = readChunkLine();
+            break;
+        case Idle:
+        case Connecting:
+            break;
+        }
+
+        if (!progress) {
+            return;
+        }
+    }
+}
+
+bool HttpConnection::readHeaders()
+{
+    if (!m_socket->canReadLine()) {
+        return false;
+    }
+    m_timeout->start();
+
+    const QByteArray line = m_socket->readLine().trimmed();
+    if (m_statusLine.isEmpty()) {
+        m_statusLine = line;
+        return true;
+    }
+
+    if (!line.isEmpty()) {
+        const int colon = line.indexOf(':');
+        if (colon > 0) {
+            m_headers.insert(line.left(colon).trimmed().toLower(), line.mid(colon + 1).trimmed());
+        }
+        return true;
+    }
+
+    // 1xx responses are followed by the actual one
+    if (m_statusLine.split(' ').value(1).startsWith('1')) {
+        m_statusLine.clear();
+        m_headers.clear();
+        return true;
+    }
+
+    return handleResponse();
+}
+
+bool HttpConnection::handleResponse()
+{
+    if (m_requestTimer.isValid()) {
+        Q_EMIT timeToFirstByte(m_requestTimer.elapsed());
+        m_requestTimer.invalidate();
+    }
+
+    const QList<QByteArray> status = m_statusLine.split(' ');
+    const int code = status.value(1).toInt();
+    const bool http11 = (status.value(0) == "HTTP/1.1");
+    const QByteArray connection = m_headers.value("connection").toLower();
+    m_keepAlive = (http11 ? !connection.contains("close") : connection.contains("keep-alive"));
+    m_reused = false;
+    qCDebug(KGET_DEBUG) << m_url << "responded with" << m_statusLine;
+
+    if ((code == 301) || (code == 302) || (code == 303) || (code == 307) || (code == 308)) {
+        const QUrl location = m_url.resolved(QUrl::fromEncoded(m_headers.value("location")));
+        if (!location.isValid() || (++m_redirects > MAX_REDIRECTS)
+            || ((location.scheme() != QLatin1String("http")) && (location.scheme() != QLatin1String("https")))) {
+            fail(KIO::buildErrorString(KIO::ERR_CYCLIC_LINK, m_url.toString()));
+            return false;
+        }
+
+        qCDebug(KGET_DEBUG) << "Redirected to" << location;
+        m_url = location;
+        Q_EMIT urlChanged(m_url);
+
+        // a new host may need another connection
+        closeSocket();
+        m_running = false;
+        start();
+        return false;
+    }
+
+    if ((code != 200) && (code != 206)) {
+        const QString reason = QString::fromLatin1(m_statusLine.mid(m_statusLine.indexOf(' ', m_statusLine.indexOf(' ') + 1) + 1));
+        fail(i18n("The server %1 responded with the error %2 %3.", m_url.host(), code, reason));
+        return false;
+    }
+
+    // the whole file was sent, that is only useful if it was requested from the start
+    if ((code == 200) && m_offset) {
+        qCDebug(KGET_DEBUG) << m_url << "does not allow resuming.";
+        fail(KIO::buildErrorString(KIO::ERR_CANNOT_RESUME, m_url.toString()), Transfer::Log_Warning);
+        return false;
+    }
+
+    if (code == 206) {
+        // Content-Range: bytes start-end/size
+        const QByteArray range = m_headers.value("content-range");
+        const int dash = range.indexOf('-');
+        const int space = range.indexOf(' ');
+        if ((dash == -1) || (range.mid(space + 1, dash - space - 1).toLongLong() != m_offset)) {
+            fail(KIO::buildErrorString(KIO::ERR_CANNOT_RESUME, m_url.toString()), Transfer::Log_Warning);
+            return false;
+        }
+        if (!m_canResume) {
+            m_canResume = true;
+            Q_EMIT canResume();
+        }
+        bool ok = false;
+        const KIO::filesize_t size = range.mid(range.indexOf('/') + 1).toULongLong(&ok);
+        if (ok) {
+            setTotalSize(size);
+        }
+    } else if (m_headers.contains("content-length")) {
+        setTotalSize(m_headers.value("content-length").toULongLong());
+    }
+
+    if (!m_canResume && (m_headers.value("accept-ranges").toLower() == "bytes")) {
+        m_canResume = true;
+        Q_EMIT canResume();
+    }
+
+    Q_EMIT validators(QString::fromLatin1(m_headers.value("etag")), QString::fromLatin1(m_headers.value("last-modified")));
+
+    m_chunked = m_headers.value("transfer-encoding").toLower().contains("chunked");
+    if (m_chunked) {
+        m_state = ReadingChunkSize;
+    } else if (m_headers.contains("content-length")) {
+        m_bodyLeft = m_headers.value("content-length").toLongLong();
+        m_state = (m_bodyLeft ? ReadingBody : Idle);
+    } else {
+        // the body ends with the connection
+        m_bodyLeft = -1;
+        m_keepAlive = false;
+        m_state = ReadingBody;
+    }
+
+    // the range might have been extended while waiting for the response
+    pipelineRequest();
+
+    if (m_state == Idle) {
+        responseFinished();
+    }
+    return m_running;
+}
+
+void HttpConnection::setTotalSize(KIO::filesize_t size)
+{
+    if (!m_findFilesize) {
+        Q_EMIT totalSize(size, qMakePair(-1, -1));
+        return;
+    }
+
+    // the segment size is chosen based on the file size, as in Segment::slotTotalSize
+    if (m_segSize.first <= 0) {
+        KIO::fileoffset_t segmentSize = 0;
+        Q_EMIT segmentSizeNeeded(size, segmentSize);
+        if (segmentSize <= 0) {
+            segmentSize = qMax(static_cast<KIO::fileoffset_t>(size), static_cast<KIO::fileoffset_t>(1));
+        }
+        m_segSize = qMakePair(segmentSize, segmentSize);
+    }
+
+    int numSegments = size / m_segSize.first;
+    const KIO::fileoffset_t rest = size % m_segSize.first;
+    if (rest) {
+        ++numSegments;
+        m_segSize.second = rest;
+    }
+
+    m_endSegment = numSegments - 1;
+    m_currentSegment = 0;
+    m_currentSegSize = (numSegments == 1 ? m_segSize.second : m_segSize.first);
+    m_totalBytesLeft = size;
+    m_findFilesize = false;
+
+    Q_EMIT totalSize(size, qMakePair(m_currentSegment, m_endSegment));
+}
+
+bool HttpConnection::readBody()
+{
+    const qint64 available = m_socket->bytesAvailable();
+    if (!available) {
+        return false;
+    }
+    m_timeout->start();
+
+    // the server sends more than is still needed, e.g. after split()
+    if (!m_findFilesize && (static_cast<KIO::filesize_t>(m_buffer.size()) >= m_totalBytesLeft)) {
+        qCDebug(KGET_DEBUG) << "Got everything needed from" << m_url << ", dropping the rest of the response";
+        closeSocket();
+        if (!writeBuffer()) {
+            m_writePending = true;
+            m_writeRetry->start();
+        }
+        return false;
+    }
+
+    const int bufferSize = MultiSegKioSettings::saveSegSize() * 1024;
+    if (m_buffer.isEmpty() && (m_buffer.capacity() < bufferSize)) {
+        m_buffer = BufferPool::acquire(bufferSize);
+    }
+
+    qint64 wanted = qMin(available, static_cast<qint64>(qMax(bufferSize - m_buffer.size(), 1)));
+    if (m_bodyLeft >= 0) {
+        wanted = qMin(wanted, m_bodyLeft);
+    }
+    if (!m_findFilesize) {
+        wanted = qMin(wanted, static_cast<qint64>(m_totalBytesLeft - m_buffer.size()));
+    }
+
+    // read straight into the buffer that is handed on
+    const int size = m_buffer.size();
+    m_buffer.resize(size + wanted);
+    const qint64 read = m_socket->read(m_buffer.data() + size, wanted);
+    m_buffer.resize(size + qMax(read, static_cast<qint64>(0)));
+    if (read <= 0) {
+        return false;
+    }
+    m_receivedBytes += read;
+
+    if (m_bodyLeft > 0) {
+        m_bodyLeft -= read;
+        if (!m_bodyLeft) {
+            m_state = (m_chunked ? ReadingChunkEnd : Idle);
+        }
+    }
+
+    const bool rangeFinished = !m_findFilesize && (static_cast<KIO::filesize_t>(m_buffer.size()) >= m_totalBytesLeft);
+    if ((m_buffer.size() >= bufferSize) || rangeFinished || (m_state == Idle)) {
+        if (!writeBuffer()) {
+            m_writePending = true;
+            m_writeRetry->start();
+            return false;
+        }
+    }
+
+    if (m_state == Idle) {
+        responseFinished();
+    }
+    return true;
+}
+
+bool HttpConnection::readChunkLine()
+{
+    if (!m_socket->canReadLine()) {
+        return false;
+    }
+    m_timeout->start();
+
+    const QByteArray line = m_socket->readLine().trimmed();
+    switch (m_state) {
+    case ReadingChunkSize: {
+        bool ok = false;
+        const qint64 size = line.left(line.indexOf(';')).trimmed().toLongLong(&ok, 16);
+        if (!ok) {
+            fail(KIO::buildErrorString(KIO::ERR_CONNECTION_BROKEN, m_url.host()));
+            return false;
+        }
+        m_bodyLeft = size;
+        m_state = (size ? ReadingBody : ReadingTrailer);
+        break;
+    }
+    case ReadingChunkEnd:
+        m_state = ReadingChunkSize;
+        break;
+    case ReadingTrailer:
+        if (line.isEmpty()) {
+            m_state = Idle;
+            if (!m_buffer.isEmpty() && !writeBuffer()) {
+                m_writePending = true;
+                m_writeRetry->start();
+                return false;
+            }
+            responseFinished();
+        }
+        break;
+    default:
+        break;
+    }
+
+    return true;
+}
+
+void HttpConnection::responseFinished()
+{
+    if (!m_running) {
+        return;
+    }
+    m_timeout->stop();
+
+    if (m_findFilesize) {
+        // the size was not known, so the download finished with the response
+        m_running = false;
+        Q_EMIT finishedDownload(m_bytesWritten);
+        return;
+    }
+
+    // the range got extended by merge() after it had been requested
+    if (m_totalBytesLeft) {
+        if (m_pipelinedRequests && m_keepAlive && m_socket) {
+            // the rest has been requested already, its response follows on the connection
+            --m_pipelinedRequests;
+            m_statusLine.clear();
+            m_headers.clear();
+            m_state = ReadingHeaders;
+            m_timeout->start();
+        } else if (m_keepAlive && m_socket) {
+            sendRequest();
+        } else {
+            connectToServer();
+        }
+    }
+}
+
+void HttpConnection::bufferWritten(int size)
+{
+    Q_UNUSED(size)
+}
+
+bool HttpConnection::writeBuffer()
+{
+    if (m_buffer.isEmpty()) {
+        return false;
+    }
+
+    bool worked = false;
+    Q_EMIT data(m_offset, m_buffer, worked);
+    if (!worked) {
+        return false;
+    }
+
+    const int size = m_buffer.size();
+    m_currentSegSize -= size;
+    if (!m_findFilesize) {
+        m_totalBytesLeft -= size;
+    }
+    m_offset += size;
+    m_bytesWritten += size;
+    BufferPool::release(m_buffer);
+    bufferWritten(size);
+
+    if (m_findFilesize) {
+        return true;
+    }
+
+    bool finished = false;
+    while ((m_currentSegSize <= 0) && !finished) {
+        finished = (m_currentSegment == m_endSegment);
+        if (finished) {
+            // nothing is requested anymore, so a finished connection can be reused; unless the
+            // range got smaller after more was requested, that response would still arrive
+            if (m_pipelinedRequests) {
+                closeSocket();
+            }
+            m_running = false;
+            m_timeout->stop();
+        }
+        Q_EMIT finishedSegment(this, m_currentSegment, finished);
+        if (!finished) {
+            ++m_currentSegment;
+            m_currentSegSize += (m_currentSegment == m_endSegment ? m_segSize.second : m_segSize.first);
+        }
+    }
+
+    // only now, the connection to the host might have been handed over with the socket
+    if (finished) {
+        HostConnectionBroker::self()->release(this);
+    }
+
+    return true;
+}
+
+void HttpConnection::slotWriteRest()
+{
+    if (!m_writePending) {
+        return;
+    }
+
+    if (writeBuffer()) {
+        m_writePending = false;
+        if (m_state == Idle) {
+            responseFinished();
+        }
+        // the response to a pipelined request might be waiting already
+        if (m_state != Idle) {
+            slotReadyRead();
+        }
+        return;
+    }
+
+    // there is no limit, as the receiver reports failed writes itself and stops the download then
+    m_writeRetry->start();
+}
+
+void HttpConnection::resumeWriting()
+{
+    if (m_writePending) {
+        m_writeRetry->stop();
+        slotWriteRest();
+    }
+}
+
+void HttpConnection::slotDisconnected()
+{
+    if (!m_running) {
+        return;
+    }
+
+    // the body ended with the connection
+    if ((m_state == ReadingBody) && (m_bodyLeft == -1)) {
+        slotReadyRead();
+        m_state = Idle;
+        if (!m_buffer.isEmpty() && !writeBuffer()) {
+            m_writePending = true;
+            m_writeRetry->start();
+            return;
+        }
+        if (m_findFilesize || !m_totalBytesLeft) {
+            responseFinished();
+            return;
+        }
+    }
+
+    slotSocketError();
+}
+
+void HttpConnection::slotSocketError()
+{
+    if (!m_running || !m_socket) {
+        return;
+    }
+
+    // the server closed a kept alive connection before it got the request, just open a new one
+    if (m_reused && ((m_state == ReadingHeaders) || (m_state == Idle)) && m_statusLine.isEmpty()) {
+        qCDebug(KGET_DEBUG) << "Kept alive connection to" << m_url.host() << "was closed, reconnecting";
+        connectToServer();
+        return;
+    }
+
+    // data that ends with the connection is handled in slotDisconnected
+    if ((m_socket->error() == QAbstractSocket::RemoteHostClosedError) && (m_state == ReadingBody) && (m_bodyLeft == -1)) {
+        return;
+    }
+
+    const QString errorText = m_socket->errorString();
+    qCDebug(KGET_DEBUG) << "Connection to" << m_url.host() << "failed:" << errorText;
+    fail(errorText);
+}
+
+void HttpConnection::slotSslErrors(const QList<QSslError> &errors)
+{
+    // the errors are not ignored, so the connection gets aborted afterwards
+    foreach (const QSslError &error, errors) {
+        qCDebug(KGET_DEBUG) << "SSL error for" << m_url.host() << error.errorString();
+    }
+}
+
+void HttpConnection::slotTimeout()
+{
+    if (m_running) {
+        fail(KIO::buildErrorString(KIO::ERR_SERVER_TIMEOUT, m_url.host()), Transfer::Log_Warning);
+    }
+}
+
+void HttpConnection::fail(const QString &errorText, Transfer::LogLevel logLevel)
+{
+    m_running = false;
+    m_writePending = false;
+    m_timeout->stop();
+    closeSocket();
+    HostConnectionBroker::self()->release(this);
+    Q_EMIT error(this, errorText, logLevel);
+}
+
+QPair<int, int> HttpConnection::assignedSegments() const
+{
+    return QPair<int, int>(m_currentSegment, m_endSegment);
+}
+
+QPair<KIO::fileoffset_t, KIO::fileoffset_t> HttpConnection::segmentSize() const
+{
+    return m_segSize;
+}
+
+int HttpConnection::countUnfinishedSegments() const
+{
+    return m_endSegment - m_currentSegment;
+}
+
+QPair<int, int> HttpConnection::split()
+{
+    const int free = (m_endSegment - m_currentSegment + 1) / 2;
+    if (m_findFilesize || !free) {
+        return qMakePair(-1, -1);
+    }
+
+    // the request continues beyond the new end, the rest of its response gets dropped
+    const int newEnd = m_endSegment - free;
+    const QPair<int, int> freed = qMakePair(newEnd + 1, m_endSegment);
+    m_endSegment = newEnd;
+    m_totalBytesLeft -= m_segSize.first * (free - 1) + m_segSize.second;
+    m_segSize.second = m_segSize.first;
+    qCDebug(KGET_DEBUG) << "Freed" << freed << "of" << m_url;
+
+    return freed;
+}
+
+bool HttpConnection::merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    if (m_findFilesize || (m_endSegment + 1 != segmentRange.first)) {
+        return false;
+    }
+
+    m_endSegment = segmentRange.second;
+    m_segSize.second = segmentSize.second;
+    m_totalBytesLeft += segmentSize.first * (m_endSegment - segmentRange.first) + m_segSize.second;
+    pipelineRequest();
+    return true;
+}
+
+#include "moc_httpconnection.cpp"
@@ -0,0 +1,225 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_HTTPCONNECTION_H
+#define KGET_HTTPCONNECTION_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QSslError>
+#include <QUrl>
+
+#include <kio/global.h>
+
+#include "core/transfer.h"
+#include "segmentconnection.h"
+
+class QSslSocket;
+class QTimer;
+
+/**
+ * Downloads a range of segments over a single HTTP/1.1 connection, without KIO.
+ *
+ * The socket is read directly into the buffer that is handed on with data(), the server
+ * has to support range requests unless the download starts at the beginning of the file.
+ * Redirects are followed and https is used via QSslSocket. Once the range is finished the
+ * connection can be reused for another range with takeSocket().
+ *
+ * The range works like the one of Segment. Subclasses can use another transport by
+ * reimplementing the virtual methods, they feed the response into handleResponse()
+ * and the data into m_buffer.
+ */
+class HttpConnection : public QObject, public SegmentConnection
+{
+    Q_OBJECT
+
+public:
+    HttpConnection(const QUrl &src, const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange, QObject *parent);
+    ~HttpConnection() override;
+
+    /**
+     * Uses an established connection instead of opening a new one, has to be called before start()
+     * @note the connection takes ownership of socket
+     */
+    void setSocket(QSslSocket *socket);
+
+    /**
+     * Removes the socket from the connection if it can be used for another request
+     * @return the socket, nullptr if it can not be reused
+     * @note the caller takes ownership of the socket
+     */
+    QSslSocket *takeSocket();
+
+    /**
+     * @return the scheme, host and port of url, connections to the same origin can be reused
+     */
+    static QString origin(const QUrl &url);
+
+    QUrl url() const
+    {
+        return m_url;
+    }
+
+    bool isRunning() const
+    {
+        return m_running;
+    }
+
+    bool findingFileSize() const
+    {
+        return m_findFilesize;
+    }
+
+    KIO::filesize_t receivedBytes() const
+    {
+        return m_receivedBytes;
+    }
+
+    QPair<int, int> assignedSegments() const override;
+    QPair<KIO::fileoffset_t, KIO::fileoffset_t> segmentSize() const override;
+    int countUnfinishedSegments() const override;
+    QPair<int, int> split() override;
+    bool merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) override;
+
+    /**
+     * Hands on data that was refused, once the receiver accepts data again
+     */
+    void resumeWriting();
+
+public Q_SLOTS:
+    virtual void start();
+    virtual void stop();
+
+Q_SIGNALS:
+    void data(KIO::fileoffset_t offset, const QByteArray &data, bool &worked);
+    void error(HttpConnection *connection, const QString &errorText, Transfer::LogLevel logLevel);
+    void finishedSegment(HttpConnection *connection, int segmentNum, bool connectionFinished);
+    void totalSize(KIO::filesize_t size, QPair<int, int> segmentRange);
+    void segmentSizeNeeded(KIO::filesize_t size, KIO::fileoffset_t &segmentSize);
+    void finishedDownload(KIO::filesize_t size);
+    void canResume();
+    void urlChanged(const QUrl &newUrl);
+    void validators(const QString &etag, const QString &lastModified);
+
+    /**
+     * Emitted once the response to a request started, msecs after the request was sent
+     */
+    void timeToFirstByte(qint64 msecs);
+
+    /**
+     * Emitted for every request that is sent
+     * @param reusedConnection true if the socket was used for an earlier request
+     */
+    void requestStarted(bool reusedConnection);
+
+private Q_SLOTS:
+    void slotConnected();
+    void slotReadyRead();
+    void slotDisconnected();
+    void slotSocketError();
+    void slotSslErrors(const QList<QSslError> &errors);
+    void slotTimeout();
+    void slotConnectionAcquired();
+
+protected Q_SLOTS:
+    /**
+     * Retries to write the buffer, as Segment::slotWriteRest
+     */
+    void slotWriteRest();
+
+protected:
+    enum State {
+        Idle, ///< no request is pending, the connection can be used for the next one
+        Connecting,
+        ReadingHeaders,
+        ReadingBody,
+        ReadingChunkSize,
+        ReadingChunkEnd,
+        ReadingTrailer
+    };
+
+    virtual void connectToServer();
+    virtual void sendRequest();
+    virtual void closeSocket();
+
+    /**
+     * Called once size bytes of the buffer have been written
+     */
+    virtual void bufferWritten(int size);
+
+    void connectSocket();
+
+    /**
+     * @return false if more data is needed
+     */
+    bool readHeaders();
+    bool readBody();
+    bool readChunkLine();
+
+    /**
+     * Evaluates the headers of a response
+     * @return false if the response can not be used, the connection has been dealt with then
+     */
+    bool handleResponse();
+    void setTotalSize(KIO::filesize_t size);
+    bool writeBuffer();
+
+    /**
+     * @return the request for the bytes start to end of the file, for the whole file if end is -1
+     */
+    QByteArray requestText(KIO::fileoffset_t start, KIO::fileoffset_t end) const;
+
+    /**
+     * Requests the part of the range that got merged after the current request was sent
+     * before the current response ended (HTTP/1.1 pipelining), so it follows without a round trip
+     */
+    void pipelineRequest();
+
+    /**
+     * Called once a response is completely read
+     */
+    void responseFinished();
+    void fail(const QString &errorText, Transfer::LogLevel logLevel = Transfer::Log_Error);
+
+protected:
+    QUrl m_url;
+    QSslSocket *m_socket;
+    QTimer *m_timeout;
+    QTimer *m_writeRetry; ///< hands on refused data again
+    QElapsedTimer m_requestTimer; ///< valid while waiting for the response to a request
+    State m_state;
+    bool m_running;
+    bool m_waitingForConnection;
+    bool m_findFilesize;
+    bool m_canResume;
+    bool m_keepAlive;
+    bool m_reused; ///< the socket was used for a request before, the server may have closed it meanwhile
+    int m_socketRequests; ///< the requests sent over m_socket, including those of earlier connections
+    bool m_writePending;
+    int m_redirects;
+
+    int m_currentSegment;
+    int m_endSegment;
+    KIO::fileoffset_t m_offset;
+    KIO::fileoffset_t m_currentSegSize;
+    KIO::filesize_t m_bytesWritten;
+    KIO::filesize_t m_totalBytesLeft;
+    KIO::filesize_t m_receivedBytes;
+    QPair<KIO::fileoffset_t, KIO::fileoffset_t> m_segSize;
+    KIO::fileoffset_t m_requestedEnd; ///< the last byte requested over the socket, -1 if open ended
+    int m_pipelinedRequests; ///< requests sent before the response to the previous one ended
+
+    QByteArray m_statusLine;
+    QHash<QByteArray, QByteArray> m_headers; ///< with lower case names
+    qint64 m_bodyLeft; ///< bytes left of the body or the current chunk, -1 if it ends with the connection
+    bool m_chunked;
+    QByteArray m_buffer;
+};
+
+#endif
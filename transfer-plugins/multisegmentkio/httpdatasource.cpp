@@ -0,0 +1,259 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#include "httpdatasource.h"
+#include "httpconnection.h"
+
+#include "core/hostconnectionbroker.h"
+
+#include "kget_debug.h"
+#include <QDebug>
+
+#include <KLocalizedString>
+
+#include <QNetworkProxyFactory>
+#include <QSslSocket>
+#include <QTimer>
+
+// how long a connection is kept open for the next segments, in msec
+const int IDLE_TIMEOUT = 15 * 1000;
+
+HttpDataSource::HttpDataSource(const QUrl &srcUrl, QObject *parent)
+    : SegmentedDataSource(srcUrl, parent)
+    , m_idleTimer(new QTimer(this))
+    , m_reusedRequests(0)
+    , m_newRequests(0)
+{
+    qCDebug(KGET_DEBUG) << "Create HttpDataSource for" << m_sourceUrl << this;
+
+    m_idleTimer->setSingleShot(true);
+    m_idleTimer->setInterval(IDLE_TIMEOUT);
+    connect(m_idleTimer, &QTimer::timeout, this, &HttpDataSource::slotCloseIdleSockets);
+}
+
+HttpDataSource::~HttpDataSource()
+{
+    qCDebug(KGET_DEBUG) << this;
+}
+
+bool HttpDataSource::isSupported(const QUrl &url)
+{
+    const QString scheme = url.scheme();
+    if ((scheme != QLatin1String("http")) && (scheme != QLatin1String("https"))) {
+        return false;
+    }
+    if ((scheme == QLatin1String("https")) && !QSslSocket::supportsSsl()) {
+        return false;
+    }
+
+    // authentication and proxies are handled by KIO
+    if (!url.userInfo().isEmpty()) {
+        return false;
+    }
+    const QList<QNetworkProxy> proxies = QNetworkProxyFactory::systemProxyForQuery(QNetworkProxyQuery(url));
+    return proxies.isEmpty() || (proxies.first().type() == QNetworkProxy::NoProxy);
+}
+
+void HttpDataSource::start()
+{
+    qCDebug(KGET_DEBUG) << this;
+
+    m_started = true;
+    foreach (HttpConnection *connection, m_connections) {
+        connection->start();
+    }
+}
+
+void HttpDataSource::stop()
+{
+    qCDebug(KGET_DEBUG) << this << m_connections.count() << "connections stopped.";
+
+    m_started = false;
+    logConnectionReuse();
+    foreach (HttpConnection *connection, m_connections) {
+        if (connection->findingFileSize()) {
+            qCDebug(KGET_DEBUG) << "Removing findingFileSize connection" << this;
+            m_connections.removeAll(connection);
+            connection->deleteLater();
+        } else {
+            connection->stop();
+        }
+    }
+}
+
+QList<QPair<int, int>> HttpDataSource::assignedSegments() const
+{
+    QList<QPair<int, int>> assigned;
+    foreach (HttpConnection *connection, m_connections) {
+        assigned.append(connection->assignedSegments());
+    }
+
+    return assigned;
+}
+
+HttpConnection *HttpDataSource::newConnection(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    return new HttpConnection(m_sourceUrl, segmentSize, segmentRange, this);
+}
+
+HttpConnection *HttpDataSource::createConnection(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    HttpConnection *connection = newConnection(segmentSize, segmentRange);
+    m_connections.append(connection);
+
+    // continue on a kept alive connection to the server
+    const QString origin = HttpConnection::origin(m_sourceUrl);
+    if (m_idleSockets.contains(origin)) {
+        QSslSocket *socket = m_idleSockets.take(origin);
+        socket->disconnect(this);
+        // the connection to the host is the socket's, nobody waiting may take it meanwhile
+        HostConnectionBroker::self()->handOver(socket, connection);
+        connection->setSocket(socket);
+    }
+
+    connect(connection, &HttpConnection::canResume, this, &HttpDataSource::slotCanResume);
+    connect(connection, SIGNAL(totalSize(KIO::filesize_t, QPair<int, int>)), this, SLOT(slotTotalSize(KIO::filesize_t, QPair<int, int>)));
+    connect(connection, SIGNAL(data(KIO::fileoffset_t, QByteArray, bool &)), this, SIGNAL(data(KIO::fileoffset_t, QByteArray, bool &)));
+    connect(connection, &HttpConnection::segmentSizeNeeded, this, &HttpDataSource::segmentSizeNeeded);
+    connect(connection, &HttpConnection::finishedSegment, this, &HttpDataSource::slotFinishedSegment);
+    connect(connection, &HttpConnection::error, this, &HttpDataSource::slotError);
+    connect(connection, &HttpConnection::finishedDownload, this, &HttpDataSource::slotFinishedDownload);
+    connect(connection, &HttpConnection::urlChanged, this, &HttpDataSource::slotUrlChanged);
+    connect(connection, &HttpConnection::validators, this, &HttpDataSource::slotValidators);
+    connect(connection, &HttpConnection::timeToFirstByte, this, &HttpDataSource::slotTimeToFirstByte);
+    connect(connection, &HttpConnection::requestStarted, this, &HttpDataSource::slotRequestStarted);
+
+    return connection;
+}
+
+void HttpDataSource::addSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    HttpConnection *connection = createConnection(segmentSize, segmentRange);
+    if (m_started) {
+        connection->start();
+    }
+}
+
+void HttpDataSource::findFileSize(KIO::fileoffset_t segmentSize)
+{
+    HttpConnection *connection = createConnection(qMakePair(segmentSize, segmentSize), qMakePair(-1, -1));
+    connection->start();
+}
+
+void HttpDataSource::slotFinishedSegment(HttpConnection *connection, int segmentNum, bool connectionFinished)
+{
+    if (connectionFinished) {
+        // keep the connection open, the next segments most likely follow right away,
+        // it keeps counting as connection to the host meanwhile
+        QSslSocket *socket = connection->takeSocket();
+        if (socket) {
+            socket->setParent(this);
+            if ((m_idleSockets.count() < qMax(m_parallelSegments, 1)) && HostConnectionBroker::self()->handOver(connection, socket)) {
+                connect(socket, &QAbstractSocket::disconnected, this, &HttpDataSource::slotIdleSocketDisconnected);
+                m_idleSockets.insert(HttpConnection::origin(connection->url()), socket);
+                m_idleTimer->start();
+            } else {
+                socket->abort();
+                socket->deleteLater();
+            }
+        }
+        discardConnection(connection);
+        // the transfer does not stop its sources once it is finished
+        if (m_connections.isEmpty()) {
+            logConnectionReuse();
+        }
+    }
+    Q_EMIT finishedSegment(this, segmentNum, connectionFinished);
+}
+
+void HttpDataSource::slotIdleSocketDisconnected()
+{
+    auto *socket = qobject_cast<QSslSocket *>(sender());
+    for (auto it = m_idleSockets.begin(); it != m_idleSockets.end(); ++it) {
+        if (it.value() == socket) {
+            m_idleSockets.erase(it);
+            closeIdleSocket(socket);
+            break;
+        }
+    }
+}
+
+void HttpDataSource::slotRequestStarted(bool reusedConnection)
+{
+    if (reusedConnection) {
+        ++m_reusedRequests;
+    } else {
+        ++m_newRequests;
+    }
+}
+
+void HttpDataSource::logConnectionReuse()
+{
+    if (!m_reusedRequests && !m_newRequests) {
+        return;
+    }
+
+    qCDebug(KGET_DEBUG) << m_sourceUrl << "reused connections:" << m_reusedRequests << "new connections:" << m_newRequests;
+    Q_EMIT log(i18n("%1 of %2 requests to %3 reused an open connection.", m_reusedRequests, m_reusedRequests + m_newRequests, m_sourceUrl.toString()),
+               Transfer::Log_Info);
+    m_reusedRequests = 0;
+    m_newRequests = 0;
+}
+
+void HttpDataSource::slotCloseIdleSockets()
+{
+    foreach (QSslSocket *socket, m_idleSockets) {
+        closeIdleSocket(socket);
+    }
+    m_idleSockets.clear();
+}
+
+void HttpDataSource::closeIdleSocket(QSslSocket *socket)
+{
+    socket->disconnect(this);
+    socket->abort();
+    socket->deleteLater();
+    HostConnectionBroker::self()->release(socket);
+}
+
+QList<SegmentConnection *> HttpDataSource::connections() const
+{
+    QList<SegmentConnection *> connections;
+    foreach (HttpConnection *connection, m_connections) {
+        connections.append(connection);
+    }
+
+    return connections;
+}
+
+void HttpDataSource::discardConnection(SegmentConnection *connection)
+{
+    auto *httpConnection = static_cast<HttpConnection *>(connection);
+    m_connections.removeAll(httpConnection);
+    httpConnection->stop();
+    httpConnection->deleteLater();
+}
+
+void HttpDataSource::resumeWriting()
+{
+    foreach (HttpConnection *connection, m_connections) {
+        connection->resumeWriting();
+    }
+}
+
+int HttpDataSource::currentSegments() const
+{
+    return m_connections.count();
+}
+
+void HttpDataSource::slotError(HttpConnection *connection, const QString &errorText, Transfer::LogLevel logLevel)
+{
+    handleError(connection, errorText, logLevel);
+}
+
+#include "moc_httpdatasource.cpp"
@@ -0,0 +1,95 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_HTTPDATASOURCE_H
+#define KGET_HTTPDATASOURCE_H
+
+#include "segmenteddatasource.h"
+
+#include <QMultiHash>
+
+class HttpConnection;
+class QSslSocket;
+class QTimer;
+
+/**
+ * Downloads http and https urls with its own connections instead of KIO, avoiding
+ * the copying between the KIO worker and KGet.
+ *
+ * Connections are kept alive, once a connection finished its segments the next
+ * segments are requested over it. Urls that need anything else than a plain
+ * connection, e.g. authentication or a proxy, are left to MultiSegKioDataSource.
+ *
+ * Duplicated segments at the end of a download, lookahead segments and splitting
+ * stalled or slow connections are only done by MultiSegKioDataSource, that is why
+ * it is only used if NativeHttp is enabled.
+ */
+class HttpDataSource : public SegmentedDataSource
+{
+    Q_OBJECT
+
+public:
+    HttpDataSource(const QUrl &srcUrl, QObject *parent);
+    ~HttpDataSource() override;
+
+    /**
+     * @return true if url can be downloaded by HttpDataSource
+     */
+    static bool isSupported(const QUrl &url);
+
+    void start() override;
+    void stop() override;
+
+    void findFileSize(KIO::fileoffset_t segmentSize) override;
+    void addSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) override;
+    QList<QPair<int, int>> assignedSegments() const override;
+    void resumeWriting() override;
+    int currentSegments() const override;
+
+private Q_SLOTS:
+    void slotFinishedSegment(HttpConnection *connection, int segmentNum, bool connectionFinished);
+    void slotError(HttpConnection *connection, const QString &errorText, Transfer::LogLevel logLevel);
+    void slotIdleSocketDisconnected();
+    void slotRequestStarted(bool reusedConnection);
+
+    /**
+     * Closes the connections that have not been reused for a while
+     */
+    void slotCloseIdleSockets();
+
+protected:
+    /**
+     * @return a new connection for the range, reimplement to use another transport
+     */
+    virtual HttpConnection *newConnection(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+
+    QList<SegmentConnection *> connections() const override;
+    void discardConnection(SegmentConnection *connection) override;
+
+private:
+    HttpConnection *createConnection(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+
+    /**
+     * Closes an idle socket and gives its connection back to the HostConnectionBroker
+     */
+    void closeIdleSocket(QSslSocket *socket);
+
+    /**
+     * Logs how many requests reused a connection since the last call, if there were any
+     */
+    void logConnectionReuse();
+
+private:
+    QList<HttpConnection *> m_connections;
+    QMultiHash<QString, QSslSocket *> m_idleSockets; ///< by HttpConnection::origin(), holding their broker connection
+    QTimer *m_idleTimer;
+    int m_reusedRequests; ///< since the last logConnectionReuse()
+    int m_newRequests;
+};
+
+#endif
@@ -11,19 +11,34 @@
 
 #include "multisegkiodatasource.h"
 #include "core/transfer.h"
+#include "multisegkiosettings.h"
 #include "segment.h"
 
 #include "kget_debug.h"
+#include <KLocalizedString>
 #include <QDebug>
+#include <QTimer>
+
+// how often the throughput of the connections is checked, in msec
+const int STALL_CHECK_INTERVAL = 2000;
+
+// the weight of the newest measurement in the smoothed throughput
+const double SPEED_SMOOTHING = 0.3;
+
+// the number of measurements before a connection can be considered slow
+const int MIN_SPEED_SAMPLES = 5;
 
 MultiSegKioDataSource::MultiSegKioDataSource(const QUrl &srcUrl, QObject *parent)
-    : TransferDataSource(srcUrl, parent)
-    , m_size(0)
-    , m_canResume(false)
-    , m_started(false)
+    : SegmentedDataSource(srcUrl, parent)
+    , m_lookaheadSegment(nullptr)
+    , m_stallTimer(new QTimer(this))
+    , m_stallEvents(0)
+    , m_slowEvents(0)
 {
     qCDebug(KGET_DEBUG) << "Create MultiSegKioDataSource for" << m_sourceUrl << this;
-    setCapabilities(capabilities() | Transfer::Cap_FindFilesize);
+
+    m_stallTimer->setInterval(STALL_CHECK_INTERVAL);
+    connect(m_stallTimer, &QTimer::timeout, this, &MultiSegKioDataSource::slotCheckStalls);
 }
 
 MultiSegKioDataSource::~MultiSegKioDataSource()
@@ -39,6 +54,10 @@ void MultiSegKioDataSource::start()
     foreach (Segment *segment, m_segments) {
         segment->startTransfer();
     }
+
+    m_throughput.clear();
+    m_lastStallCheck.start();
+    m_stallTimer->start();
 }
 
 void MultiSegKioDataSource::stop()
@@ -46,6 +65,16 @@ void MultiSegKioDataSource::stop()
     qCDebug(KGET_DEBUG) << this << m_segments.count() << "segments stopped.";
 
     m_started = false;
+    m_stallTimer->stop();
+    m_throughput.clear();
+
+    // duplicates are only used while running
+    foreach (Segment *segment, m_duplicateSegments) {
+        segment->stopTransfer();
+        segment->deleteLater();
+    }
+    m_duplicateSegments.clear();
+
     foreach (Segment *segment, m_segments) {
         if (segment->findingFileSize()) {
             qCDebug(KGET_DEBUG) << "Removing findingFileSize segment" << this;
@@ -62,6 +91,7 @@ QList<QPair<int, int>> MultiSegKioDataSource::assignedSegments() const
     QList<QPair<int, int>> assigned;
     foreach (Segment *segment, m_segments) {
         assigned.append(segment->assignedSegments());
+        assigned.append(segment->queuedSegments());
     }
 
     return assigned;
@@ -75,177 +105,256 @@ void MultiSegKioDataSource::addSegments(const QPair<KIO::fileoffset_t, KIO::file
     connect(segment, &Segment::canResume, this, &MultiSegKioDataSource::slotCanResume);
     connect(segment, SIGNAL(totalSize(KIO::filesize_t, QPair<int, int>)), this, SLOT(slotTotalSize(KIO::filesize_t, QPair<int, int>)));
     connect(segment, SIGNAL(data(KIO::fileoffset_t, QByteArray, bool &)), this, SIGNAL(data(KIO::fileoffset_t, QByteArray, bool &)));
+    connect(segment, &Segment::segmentSizeNeeded, this, &MultiSegKioDataSource::segmentSizeNeeded);
     connect(segment, &Segment::finishedSegment, this, &MultiSegKioDataSource::slotFinishedSegment);
     connect(segment, &Segment::error, this, &MultiSegKioDataSource::slotError);
     connect(segment, &Segment::finishedDownload, this, &MultiSegKioDataSource::slotFinishedDownload);
     connect(segment, &Segment::urlChanged, this, &MultiSegKioDataSource::slotUrlChanged);
+    connect(segment, &Segment::validators, this, &MultiSegKioDataSource::slotValidators);
+    connect(segment, &Segment::timeToFirstByte, this, &MultiSegKioDataSource::slotTimeToFirstByte);
+    connect(segment, &Segment::lookaheadNeeded, this, &MultiSegKioDataSource::slotLookaheadNeeded);
 
     if (m_started) {
         segment->startTransfer();
     }
 }
 
-void MultiSegKioDataSource::slotUrlChanged(const QUrl &url)
+bool MultiSegKioDataSource::addLookaheadSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
 {
-    if (m_sourceUrl != url) {
-        Q_EMIT urlChanged(m_sourceUrl, url);
-        m_sourceUrl = url;
+    if (!m_lookaheadSegment) {
+        return false;
     }
-}
 
-void MultiSegKioDataSource::findFileSize(KIO::fileoffset_t segmentSize)
-{
-    addSegments(qMakePair(segmentSize, segmentSize), qMakePair(-1, -1));
-    Segment *segment = m_segments.last();
-    segment->startTransfer();
-}
-
-void MultiSegKioDataSource::slotSpeed(ulong downloadSpeed)
-{
-    m_speed = downloadSpeed;
-    Q_EMIT speed(m_speed);
+    m_lookaheadSegment->queueRange(segmentSize, segmentRange);
+    return true;
 }
 
-void MultiSegKioDataSource::slotFinishedSegment(Segment *segment, int segmentNum, bool connectionFinished)
+void MultiSegKioDataSource::slotLookaheadNeeded(Segment *segment)
 {
-    if (connectionFinished) {
-        m_segments.removeAll(segment);
-        segment->deleteLater();
-    }
-    Q_EMIT finishedSegment(this, segmentNum, connectionFinished);
+    m_lookaheadSegment = segment;
+    Q_EMIT requestSegments(this, segment->assignedSegments().second);
+    m_lookaheadSegment = nullptr;
 }
 
-void MultiSegKioDataSource::setSupposedSize(KIO::filesize_t supposedSize)
+void MultiSegKioDataSource::handOverQueuedRanges(Segment *segment)
 {
-    m_supposedSize = supposedSize;
+    const QList<Segment::Range> ranges = segment->takeQueuedRanges();
+    foreach (const Segment::Range &range, ranges) {
+        Segment *other = (m_segments.isEmpty() ? nullptr : m_segments.first());
+        foreach (Segment *candidate, m_segments) {
+            if (candidate->countUnfinishedSegments() < other->countUnfinishedSegments()) {
+                other = candidate;
+            }
+        }
 
-    // check if the size is correct
-    slotTotalSize(m_size);
+        if (other) {
+            other->queueRange(range.segmentSize, range.segments);
+        } else {
+            // the ranges were never started, so nothing went wrong with them
+            Q_EMIT freeSegments(this, range.segments, false);
+        }
+    }
 }
 
-void MultiSegKioDataSource::slotTotalSize(KIO::filesize_t size, const QPair<int, int> &range)
+void MultiSegKioDataSource::slotCheckStalls()
 {
-    qCDebug(KGET_DEBUG) << "Size found for" << m_sourceUrl << size << "bytes";
+    const qint64 elapsed = m_lastStallCheck.restart();
+    if (elapsed <= 0) {
+        return;
+    }
 
-    m_size = size;
+    // update the throughput, connections that are gone or not running are dropped
+    QHash<Segment *, Throughput> throughput;
+    QList<double> speeds;
+    foreach (Segment *segment, m_segments) {
+        if (segment->findingFileSize() || (segment->status() != Segment::Running)) {
+            continue;
+        }
 
-    // findFileSize was called
-    if ((range.first != -1) && (range.second != -1)) {
-        Q_EMIT foundFileSize(this, size, range);
+        Throughput current;
+        if (m_throughput.contains(segment)) {
+            current = m_throughput[segment];
+            const double speed = (segment->receivedBytes() - current.received) * 1000.0 / elapsed;
+            current.speed = (current.samples ? current.speed * (1.0 - SPEED_SMOOTHING) + speed * SPEED_SMOOTHING : speed);
+            ++current.samples;
+            if (current.samples >= MIN_SPEED_SAMPLES) {
+                speeds.append(current.speed);
+            }
+        }
+        current.received = segment->receivedBytes();
+        throughput.insert(segment, current);
     }
+    m_throughput = throughput;
+
+    // compare with all connections of the transfer, a mirror might be slow as a whole
+    double median = 0;
+    Q_EMIT connectionSpeeds(this, speeds, median);
+
+    const qint64 stallTimeout = MultiSegKioSettings::stallTimeout() * 1000;
+    const int slowFactor = MultiSegKioSettings::slowSegmentFactor();
+    const QList<Segment *> segments = m_throughput.keys();
+    foreach (Segment *segment, segments) {
+        // freeing segments can lead to connections being removed
+        if (!m_started || !m_segments.contains(segment)) {
+            continue;
+        }
 
-    // the filesize is not what it should be, maybe using a wrong mirror
-    if (m_size && m_supposedSize && (m_size != m_supposedSize)) {
-        qCDebug(KGET_DEBUG) << "Size does not match for" << m_sourceUrl << this;
-        Q_EMIT broken(this, WrongDownloadSize);
+        if (stallTimeout && (segment->msecsSinceData() >= stallTimeout)) {
+            ++m_stallEvents;
+            qCDebug(KGET_DEBUG) << "Segment" << segment << "of" << m_sourceUrl << "stalled, stall events:" << m_stallEvents;
+            Q_EMIT log(i18n("The connection to %1 stalled, it is reconnected and part of its segments are given to other connections (stall %2).",
+                            m_sourceUrl.toString(),
+                            m_stallEvents),
+                       Transfer::Log_Warning);
+
+            releaseSegments(segment);
+            // a new request most likely gets a working connection
+            if (m_segments.contains(segment)) {
+                segment->stopTransfer();
+                segment->startTransfer();
+            }
+            m_throughput.remove(segment);
+        } else if (slowFactor && (median > 0) && (m_throughput[segment].samples >= MIN_SPEED_SAMPLES)
+                   && (m_throughput[segment].speed * slowFactor < median)) {
+            if (releaseSegments(segment)) {
+                ++m_slowEvents;
+                qCDebug(KGET_DEBUG) << "Segment" << segment << "of" << m_sourceUrl << "is slow:" << m_throughput.value(segment).speed << "median:" << median
+                                    << "slow events:" << m_slowEvents;
+                Q_EMIT log(i18n("A connection to %1 is much slower than the others, part of its segments are given to other connections (slow connection %2).",
+                                m_sourceUrl.toString(),
+                                m_slowEvents),
+                           Transfer::Log_Info);
+            }
+            // give it time to show its new speed before splitting it again
+            if (m_throughput.contains(segment)) {
+                m_throughput[segment].samples = 0;
+            }
+        }
     }
 }
 
-void MultiSegKioDataSource::slotCanResume()
+bool MultiSegKioDataSource::releaseSegments(Segment *segment)
 {
-    qCDebug(KGET_DEBUG) << this;
+    // the segment being downloaded can not be split
+    if (!segment->countUnfinishedSegments()) {
+        return false;
+    }
 
-    if (!m_canResume) {
-        m_canResume = true;
-        setCapabilities(capabilities() | Transfer::Cap_Resuming);
+    const QPair<int, int> freed = segment->split();
+    if ((freed.first == -1) || (freed.second == -1)) {
+        return false;
     }
+
+    qCDebug(KGET_DEBUG) << "Freeing" << freed << "of" << segment;
+    Q_EMIT freeSegments(this, freed, false);
+    return true;
 }
 
-int MultiSegKioDataSource::currentSegments() const
+bool MultiSegKioDataSource::addDuplicateSegment(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, int segment)
 {
-    return m_segments.count();
+    auto *duplicate = new Segment(m_sourceUrl, segmentSize, qMakePair(segment, segment), this);
+    m_duplicateSegments.append(duplicate);
+
+    connect(duplicate, &Segment::canResume, this, &MultiSegKioDataSource::slotCanResume);
+    connect(duplicate, SIGNAL(data(KIO::fileoffset_t, QByteArray, bool &)), this, SIGNAL(duplicateData(KIO::fileoffset_t, QByteArray, bool &)));
+    connect(duplicate, &Segment::finishedSegment, this, &MultiSegKioDataSource::slotFinishedSegment);
+    connect(duplicate, &Segment::error, this, &MultiSegKioDataSource::slotError);
+    connect(duplicate, &Segment::urlChanged, this, &MultiSegKioDataSource::slotUrlChanged);
+    connect(duplicate, &Segment::validators, this, &MultiSegKioDataSource::slotValidators);
+    connect(duplicate, &Segment::timeToFirstByte, this, &MultiSegKioDataSource::slotTimeToFirstByte);
+
+    if (m_started) {
+        duplicate->startTransfer();
+    }
+    return true;
 }
 
-Segment *MultiSegKioDataSource::mostUnfinishedSegments(int *unfin) const
+KIO::filesize_t MultiSegKioDataSource::cancelSegment(int segment)
 {
-    int unfinished = 0;
-    Segment *seg = nullptr;
-    foreach (Segment *segment, m_segments) {
-        if (segment->countUnfinishedSegments() > unfinished) {
-            unfinished = segment->countUnfinishedSegments();
-            seg = segment;
+    const QPair<int, int> range = qMakePair(segment, segment);
+    KIO::filesize_t downloaded = 0;
+    foreach (Segment *seg, m_segments + m_duplicateSegments) {
+        if (seg->assignedSegments() == range) {
+            qCDebug(KGET_DEBUG) << "Cancelling segment" << segment << "of" << m_sourceUrl;
+            downloaded += seg->downloadedBytes(segment);
+            m_segments.removeAll(seg);
+            m_duplicateSegments.removeAll(seg);
+            handOverQueuedRanges(seg);
+            seg->stopTransfer();
+            seg->deleteLater();
         }
     }
 
-    if (unfin) {
-        *unfin = unfinished;
-    }
-
-    return seg;
+    return downloaded;
 }
 
-int MultiSegKioDataSource::countUnfinishedSegments() const
+void MultiSegKioDataSource::findFileSize(KIO::fileoffset_t segmentSize)
 {
-    int unfinished = 0;
-    mostUnfinishedSegments(&unfinished);
+    addSegments(qMakePair(segmentSize, segmentSize), qMakePair(-1, -1));
+    Segment *segment = m_segments.last();
+    segment->startTransfer();
+}
 
-    return unfinished;
+void MultiSegKioDataSource::slotSpeed(ulong downloadSpeed)
+{
+    m_speed = downloadSpeed;
+    Q_EMIT speed(m_speed);
 }
 
-QPair<int, int> MultiSegKioDataSource::split()
+void MultiSegKioDataSource::slotFinishedSegment(Segment *segment, int segmentNum, bool connectionFinished)
 {
-    QPair<int, int> unassigned = qMakePair(-1, -1);
-    Segment *seg = mostUnfinishedSegments();
-    if (seg) {
-        unassigned = seg->split();
+    if (connectionFinished) {
+        m_segments.removeAll(segment);
+        m_duplicateSegments.removeAll(segment);
+        segment->deleteLater();
     }
-
-    return unassigned;
+    Q_EMIT finishedSegment(this, segmentNum, connectionFinished);
 }
 
-QPair<int, int> MultiSegKioDataSource::removeConnection()
+void MultiSegKioDataSource::resumeWriting()
 {
-    QPair<int, int> unassigned = qMakePair(-1, -1);
-    Segment *seg = mostUnfinishedSegments();
-    if (seg) {
-        unassigned = seg->assignedSegments();
-        m_segments.removeAll(seg);
-        seg->deleteLater();
+    foreach (Segment *segment, m_segments) {
+        segment->resumeWriting();
+    }
+    foreach (Segment *segment, m_duplicateSegments) {
+        segment->resumeWriting();
     }
+}
 
-    return unassigned;
+int MultiSegKioDataSource::currentSegments() const
+{
+    return m_segments.count() + m_duplicateSegments.count();
 }
 
-bool MultiSegKioDataSource::tryMerge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+QList<SegmentConnection *> MultiSegKioDataSource::connections() const
 {
+    QList<SegmentConnection *> connections;
     foreach (Segment *segment, m_segments) {
-        if (segment->merge(segmentSize, segmentRange)) {
-            return true;
-        }
+        connections.append(segment);
     }
 
-    return false;
+    return connections;
 }
 
-void MultiSegKioDataSource::slotError(Segment *segment, const QString &errorText, Transfer::LogLevel logLevel)
+void MultiSegKioDataSource::discardConnection(SegmentConnection *connection)
 {
-    qCDebug(KGET_DEBUG) << "Error" << errorText << "segment" << segment;
-
-    const QPair<KIO::fileoffset_t, KIO::fileoffset_t> size = segment->segmentSize();
-    const QPair<int, int> range = segment->assignedSegments();
+    auto *segment = static_cast<Segment *>(connection);
     m_segments.removeAll(segment);
+    handOverQueuedRanges(segment);
     segment->deleteLater();
-
-    Q_EMIT log(errorText, logLevel);
-    if (m_segments.isEmpty()) {
-        qCDebug(KGET_DEBUG) << this << "has broken segments.";
-        Q_EMIT brokenSegments(this, range);
-    } else {
-        // decrease the number of maximum parallel downloads, maybe the server does not support so many connections
-        if (m_parallelSegments > 1) {
-            --m_parallelSegments;
-        }
-        qCDebug(KGET_DEBUG) << this << "reducing connections to" << m_parallelSegments << "and freeing range of segments" << range;
-        if (!tryMerge(size, range)) {
-            Q_EMIT freeSegments(this, range);
-        }
-    }
 }
 
-void MultiSegKioDataSource::slotFinishedDownload(KIO::filesize_t size)
+void MultiSegKioDataSource::slotError(Segment *segment, const QString &errorText, Transfer::LogLevel logLevel)
 {
-    stop();
-    Q_EMIT finishedDownload(this, size);
+    // another connection downloads the range of a duplicate already
+    if (m_duplicateSegments.removeAll(segment)) {
+        qCDebug(KGET_DEBUG) << "Error" << errorText << "duplicate segment" << segment;
+        segment->deleteLater();
+        Q_EMIT log(errorText, logLevel);
+        return;
+    }
+
+    handleError(segment, errorText, logLevel);
 }
 
 void MultiSegKioDataSource::slotRestartBrokenSegment()
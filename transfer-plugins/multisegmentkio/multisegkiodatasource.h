@@ -12,11 +12,15 @@
 #ifndef KGET_MULTISEGKIODATASOURCE_H
 #define KGET_MULTISEGKIODATASOURCE_H
 
-#include "core/transferdatasource.h"
+#include "segmenteddatasource.h"
 
+#include <QElapsedTimer>
+#include <QHash>
+
+class QTimer;
 class Segment;
 
-class MultiSegKioDataSource : public TransferDataSource
+class MultiSegKioDataSource : public SegmentedDataSource
 {
     Q_OBJECT
 
@@ -29,12 +33,12 @@ public:
 
     void findFileSize(KIO::fileoffset_t segmentSize) override;
     void addSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) override;
-    QPair<int, int> removeConnection() override;
+    bool addLookaheadSegments(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) override;
     QList<QPair<int, int>> assignedSegments() const override;
-    int countUnfinishedSegments() const override;
-    QPair<int, int> split() override;
+    bool addDuplicateSegment(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, int segment) override;
+    KIO::filesize_t cancelSegment(int segment) override;
 
-    void setSupposedSize(KIO::filesize_t supposedSize) override;
+    void resumeWriting() override;
     int currentSegments() const override;
 
 private Q_SLOTS:
@@ -43,31 +47,58 @@ private Q_SLOTS:
     void slotRestartBrokenSegment();
 
     /**
-     * There was an error while downloading segment, the number of connections this
-     * TransferDataSource uses simultaneously gets reduced
+     * Errors of duplicates are only logged, the others are handled by handleError()
      */
     void slotError(Segment *segment, const QString &errorText, Transfer::LogLevel logLevel);
+    void slotLookaheadNeeded(Segment *segment);
 
-    /**the following slots are there to check if the size reported by the mirror
-     * Checks if the sizre reported by the mirror is correct
+    /**
+     * Updates the throughput of the connections and deals with those that stalled
+     * or are far slower than the others
      */
-    void slotTotalSize(KIO::filesize_t size, const QPair<int, int> &range = qMakePair(-1, -1));
+    void slotCheckStalls();
 
-    void slotCanResume();
+protected:
+    QList<SegmentConnection *> connections() const override;
+    void discardConnection(SegmentConnection *connection) override;
 
-    void slotFinishedDownload(KIO::filesize_t size);
+private:
+    /**
+     * Gives the queued ranges of a segment that is removed to the remaining
+     * segments, or frees them if there are none
+     */
+    void handOverQueuedRanges(Segment *segment);
 
-    void slotUrlChanged(const QUrl &url);
+    /**
+     * Splits the segments of segment and frees the part it does not download anymore
+     * @return true if something was freed
+     */
+    bool releaseSegments(Segment *segment);
 
 private:
-    Segment *mostUnfinishedSegments(int *unfinished = nullptr) const;
-    bool tryMerge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+    struct Throughput {
+        KIO::filesize_t received = 0; ///< Segment::receivedBytes() at the last check
+        double speed = 0; ///< bytes per second, smoothed
+        int samples = 0;
+    };
 
-private:
     QList<Segment *> m_segments;
-    KIO::filesize_t m_size;
-    bool m_canResume;
-    bool m_started;
+
+    /**
+     * segments that are downloaded by another connection as well
+     */
+    QList<Segment *> m_duplicateSegments;
+
+    /**
+     * the segment that asked for more segments, only set while requestSegments is emitted
+     */
+    Segment *m_lookaheadSegment;
+
+    QTimer *m_stallTimer;
+    QElapsedTimer m_lastStallCheck;
+    QHash<Segment *, Throughput> m_throughput;
+    int m_stallEvents;
+    int m_slowEvents;
 };
 
 #endif
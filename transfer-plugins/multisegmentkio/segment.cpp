@@ -12,26 +12,37 @@
 #include "segment.h"
 #include "multisegkiosettings.h"
 
+#include "core/bufferpool.h"
+#include "core/hostconnectionbroker.h"
+
 #include <cmath>
 
 #include "kget_debug.h"
-#include <KLocalizedString>
 #include <QDebug>
 
 #include <QTimer>
 
+// room for one more packet of data once the buffer is almost full, so that it does not grow
+const int PACKET_RESERVE = 64 * 1024;
+// msecs after which refused data is handed on again, if the receiver did not call resumeWriting() before
+const int WRITE_RETRY_INTERVAL = 50;
+
 Segment::Segment(const QUrl &src, const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange, QObject *parent)
     : QObject(parent)
     , m_findFilesize((segmentRange.first == -1) && (segmentRange.second == -1))
     , m_canResume(true)
+    , m_validatorsChecked(false)
+    , m_waitingForConnection(false)
     , m_status(Stopped)
     , m_currentSegment(segmentRange.first)
     , m_endSegment(segmentRange.second)
-    , m_errorCount(0)
     , m_offset(segmentSize.first * segmentRange.first)
     , m_currentSegSize(segmentSize.first)
     , m_bytesWritten(0)
+    , m_receivedBytes(0)
+    , m_requestEnd(-1)
     , m_getJob(nullptr)
+    , m_writeRetry(new QTimer(this))
     , m_url(src)
     , m_segSize(segmentSize)
 {
@@ -49,6 +60,10 @@ Segment::Segment(const QUrl &src, const QPair<KIO::fileoffset_t, KIO::fileoffset
     } else {
         m_totalBytesLeft = m_segSize.first * (m_endSegment - m_currentSegment) + m_segSize.second;
     }
+
+    m_writeRetry->setSingleShot(true);
+    m_writeRetry->setInterval(WRITE_RETRY_INTERVAL);
+    connect(m_writeRetry, &QTimer::timeout, this, &Segment::slotWriteRest);
 }
 
 Segment::~Segment()
@@ -57,6 +72,7 @@ Segment::~Segment()
         qCDebug(KGET_DEBUG) << "Closing transfer ...";
         m_getJob->kill(KJob::Quietly);
     }
+    HostConnectionBroker::self()->release(this);
 }
 
 bool Segment::findingFileSize() const
@@ -64,6 +80,14 @@ bool Segment::findingFileSize() const
     return m_findFilesize;
 }
 
+qint64 Segment::msecsSinceData() const
+{
+    if ((m_status != Running) || !m_lastData.isValid()) {
+        return -1;
+    }
+    return m_lastData.elapsed();
+}
+
 bool Segment::createTransfer()
 {
     qCDebug(KGET_DEBUG) << " -- " << m_url;
@@ -74,11 +98,23 @@ bool Segment::createTransfer()
     m_getJob->suspend();
     m_getJob->addMetaData("errorPage", "false");
     m_getJob->addMetaData("AllowCompressedPage", "false");
+    // needed to get the validators of the file
+    m_getJob->addMetaData("PropagateHttpHeader", "true");
+    m_validatorsChecked = false;
     if (m_offset) {
         m_canResume = false; // FIXME set m_canResume to false by default!!
         m_getJob->addMetaData("resume", KIO::number(m_offset));
         connect(m_getJob, &KIO::TransferJob::canResume, this, &Segment::slotCanResume);
     }
+    // only request the range, if the server does not send more than that the job finishes on
+    // its own and KIO hands the next job for the host to the same worker, which still has the
+    // connection open. Segments that get merged into the range while the job runs are requested
+    // by the next job, as the end of a job can not be changed
+    m_requestEnd = -1;
+    if (!m_findFilesize && m_totalBytesLeft) {
+        m_requestEnd = m_offset + m_totalBytesLeft - 1;
+        m_getJob->addMetaData("resume_until", KIO::number(m_requestEnd));
+    }
 #if 0 // TODO: we disable that code till it's implemented in kdelibs, also we need to think, which settings we should use
     if (Settings::speedLimit())
     {
@@ -113,6 +149,16 @@ void Segment::slotTotalSize(KJob *job, qulonglong size)
     qCDebug(KGET_DEBUG) << "Size found for" << m_url;
 
     if (m_findFilesize) {
+        // the segment size is chosen based on the file size
+        if (m_segSize.first <= 0) {
+            KIO::fileoffset_t segmentSize = 0;
+            Q_EMIT segmentSizeNeeded(size, segmentSize);
+            if (segmentSize <= 0) {
+                segmentSize = qMax(static_cast<KIO::fileoffset_t>(size), static_cast<KIO::fileoffset_t>(1));
+            }
+            m_segSize = qMakePair(segmentSize, segmentSize);
+        }
+
         int numSegments = size / m_segSize.first;
         KIO::fileoffset_t rest = size % m_segSize.first;
         if (rest) {
@@ -136,12 +182,25 @@ void Segment::slotTotalSize(KJob *job, qulonglong size)
 bool Segment::startTransfer()
 {
     qCDebug(KGET_DEBUG) << m_url;
+    if (m_getJob && (m_status == Running)) {
+        return false;
+    }
+    // too many connections to the host already, start once there is one for this segment
+    if (!HostConnectionBroker::self()->acquire(this, m_url)) {
+        qCDebug(KGET_DEBUG) << "Waiting for a connection to" << m_url.host();
+        m_waitingForConnection = true;
+        return false;
+    }
+    m_waitingForConnection = false;
+
     if (!m_getJob) {
         createTransfer();
     }
     if (m_getJob && (m_status != Running)) {
         setStatus(Running, false);
         m_getJob->resume();
+        m_lastData.start();
+        m_requestTimer.start();
         return true;
     }
     return false;
@@ -152,24 +211,37 @@ bool Segment::stopTransfer()
     qCDebug(KGET_DEBUG);
 
     setStatus(Stopped, false);
+    m_waitingForConnection = false;
     if (m_getJob) {
         if (m_getJob) {
             m_getJob->kill(KJob::EmitResult);
         }
+        HostConnectionBroker::self()->release(this);
         return true;
     }
+    HostConnectionBroker::self()->release(this);
     return false;
 }
 
+void Segment::slotConnectionAcquired()
+{
+    if (m_waitingForConnection) {
+        startTransfer();
+    }
+}
+
 void Segment::slotResult(KJob *job)
 {
     qCDebug(KGET_DEBUG) << "Job:" << job << m_url << "error:" << job->error();
 
     m_getJob = nullptr;
 
+    // a new job acquires the connection again, maybe another transfer waits for it
+    HostConnectionBroker::self()->release(this);
+
     // clear the buffer as the download might be moved around
     if (m_status == Stopped) {
-        m_buffer.clear();
+        BufferPool::release(m_buffer);
     }
     if (!m_buffer.isEmpty()) {
         if (m_findFilesize && !job->error()) {
@@ -185,6 +257,21 @@ void Segment::slotResult(KJob *job)
     if (m_status == Killed) {
         return;
     }
+    // the range got extended by merge() after it had been requested, continue with
+    // the rest, most likely over the same connection
+    if (!job->error() && (m_status == Running) && (m_requestEnd != -1)) {
+        writeBuffer();
+        if (!m_totalBytesLeft) {
+            setStatus(Finished);
+            return;
+        }
+        if (m_buffer.isEmpty()) {
+            qCDebug(KGET_DEBUG) << "Continuing" << m_url << "at" << m_offset;
+            setStatus(Stopped, false);
+            startTransfer();
+            return;
+        }
+    }
     if (job->error() && (m_status == Running)) {
         Q_EMIT error(this, job->errorString(), Transfer::Log_Error);
     }
@@ -202,12 +289,39 @@ void Segment::slotData(KIO::Job *, const QByteArray &_data)
         return;
     }
 
-    m_buffer.append(_data);
+    if (!m_validatorsChecked) {
+        checkValidators();
+    }
+
+    m_receivedBytes += _data.size();
+    m_lastData.start();
+    if (m_requestTimer.isValid()) {
+        Q_EMIT timeToFirstByte(m_requestTimer.elapsed());
+        m_requestTimer.invalidate();
+    }
+
+    const int bufferSize = MultiSegKioSettings::saveSegSize() * 1024;
+    if (m_buffer.isEmpty() && (_data.size() > bufferSize)) {
+        // nothing to collect, hand the data on without copying it
+        m_buffer = _data;
+    } else {
+        if (m_buffer.isEmpty() && (m_buffer.capacity() < bufferSize)) {
+            m_buffer = BufferPool::acquire(bufferSize + PACKET_RESERVE);
+        }
+        m_buffer.append(_data);
+    }
     if (!m_findFilesize && m_totalBytesLeft && static_cast<uint>(m_buffer.size()) >= m_totalBytesLeft) {
         qCDebug(KGET_DEBUG) << "Segment::slotData() buffer full. Stopping transfer..."; // TODO really stop it? is this even needed?
         if (m_getJob) {
-            m_getJob->kill(KJob::Quietly);
-            m_getJob = nullptr;
+            // killing the job closes the connection, so let it end on its own if it got all it requested
+            if (m_offset + m_buffer.size() - 1 != m_requestEnd) {
+                m_getJob->kill(KJob::Quietly);
+                m_getJob = nullptr;
+            } else if (m_queuedRanges.isEmpty()) {
+                m_getJob->disconnect(this);
+                m_getJob = nullptr;
+            }
+            // otherwise the queued range is requested once the job ended
         }
         m_buffer.truncate(m_totalBytesLeft);
         slotWriteRest();
@@ -217,11 +331,41 @@ void Segment::slotData(KIO::Job *, const QByteArray &_data)
          this hack try to avoid too much cpu usage. it seems to be due KIO::Filejob
          so remove it when it works property
         */
-        if (m_buffer.size() > MultiSegKioSettings::saveSegSize() * 1024)
-            writeBuffer();
+        if ((m_buffer.size() > bufferSize) && !writeBuffer() && m_getJob && !m_getJob->isSuspended()) {
+            // the data is not taken, e.g. the disk is too slow, so stop receiving until it is
+            qCDebug(KGET_DEBUG) << "Suspending" << m_url << "until the buffer got written";
+            m_getJob->suspend();
+            m_writeRetry->start();
+        }
     }
 }
 
+void Segment::checkValidators()
+{
+    m_validatorsChecked = true;
+    if (!m_getJob) {
+        return;
+    }
+
+    QString etag;
+    QString lastModified;
+    const QStringList headers = m_getJob->queryMetaData("HTTP-Headers").split('\n');
+    foreach (const QString &header, headers) {
+        const int colon = header.indexOf(':');
+        if (colon == -1) {
+            continue;
+        }
+        const QString name = header.left(colon).trimmed();
+        if (!name.compare(QLatin1String("ETag"), Qt::CaseInsensitive)) {
+            etag = header.mid(colon + 1).trimmed();
+        } else if (!name.compare(QLatin1String("Last-Modified"), Qt::CaseInsensitive)) {
+            lastModified = header.mid(colon + 1).trimmed();
+        }
+    }
+
+    Q_EMIT validators(etag, lastModified);
+}
+
 bool Segment::writeBuffer()
 {
     qCDebug(KGET_DEBUG) << "Segment::writeBuffer() sending:" << m_buffer.size() << "from job:" << m_getJob;
@@ -239,7 +383,8 @@ bool Segment::writeBuffer()
         }
         m_offset += m_buffer.size();
         m_bytesWritten += m_buffer.size();
-        m_buffer.clear();
+        // the receiver keeps the data without copying it, if it does not the memory can be reused
+        BufferPool::release(m_buffer);
         qCDebug(KGET_DEBUG) << "Segment::writeBuffer() updating segment record of job:" << m_getJob << "--" << m_totalBytesLeft << "bytes left";
     }
 
@@ -252,15 +397,27 @@ bool Segment::writeBuffer()
     bool finished = false;
     // m_currentSegSize being smaller than 1 means that at least one segment has been finished
     while (m_currentSegSize <= 0 && !finished) {
-        finished = (m_currentSegment == m_endSegment);
+        finished = (m_currentSegment == m_endSegment) && m_queuedRanges.isEmpty();
         Q_EMIT finishedSegment(this, m_currentSegment, finished);
 
-        if (!finished) {
+        if (finished) {
+            break;
+        }
+        if (m_currentSegment != m_endSegment) {
             ++m_currentSegment;
             m_currentSegSize += (m_currentSegment == m_endSegment ? m_segSize.second : m_segSize.first);
+        } else if (!m_queuedRanges.isEmpty()) {
+            startQueuedRange();
+        } else {
+            // the queued ranges were taken away meanwhile
+            break;
         }
     }
 
+    if (!finished) {
+        checkLookahead();
+    }
+
     return worked;
 }
 
@@ -272,19 +429,27 @@ void Segment::slotWriteRest()
     qCDebug(KGET_DEBUG) << this;
 
     if (writeBuffer()) {
-        m_errorCount = 0;
+        m_writeRetry->stop();
+        if (m_getJob && m_getJob->isSuspended()) {
+            m_getJob->resume();
+        }
         if (m_findFilesize) {
             Q_EMIT finishedDownload(m_bytesWritten);
         }
         return;
     }
 
-    if (++m_errorCount >= 100) {
-        qWarning() << "Failed to write to the file:" << m_url << this;
-        Q_EMIT error(this, i18n("Failed to write to the file."), Transfer::Log_Error);
-    } else {
-        qCDebug(KGET_DEBUG) << "Wait 50 msec:" << this;
-        QTimer::singleShot(50, this, &Segment::slotWriteRest);
+    // there is no limit, as the receiver reports failed writes itself and stops the download then
+    qCDebug(KGET_DEBUG) << "Waiting until the data is taken:" << this;
+    m_writeRetry->start();
+}
+
+void Segment::resumeWriting()
+{
+    // only data that got refused is waiting for a retry
+    if (m_writeRetry->isActive()) {
+        m_writeRetry->stop();
+        slotWriteRest();
     }
 }
 
@@ -307,22 +472,35 @@ QPair<KIO::fileoffset_t, KIO::fileoffset_t> Segment::segmentSize() const
 
 int Segment::countUnfinishedSegments() const
 {
-    return m_endSegment - m_currentSegment;
+    int unfinished = m_endSegment - m_currentSegment;
+    foreach (const Range &range, m_queuedRanges) {
+        unfinished += range.segments.second - range.segments.first + 1;
+    }
+    return unfinished;
 }
 
 QPair<int, int> Segment::split()
 {
+    // the queued ranges have not been started yet, so they go first
+    if (!m_queuedRanges.isEmpty()) {
+        const Range range = m_queuedRanges.takeLast();
+        qCDebug(KGET_DEBUG) << "Freeing queued range" << range.segments;
+        return range.segments;
+    }
+
+    // the job might be suspended already until the buffer got written
+    const bool wasSuspended = m_getJob && m_getJob->isSuspended();
     if (m_getJob) {
         m_getJob->suspend();
     }
 
     QPair<int, int> freed = QPair<int, int>(-1, -1);
-    const int free = std::ceil((countUnfinishedSegments() + 1) / static_cast<double>(2));
+    const int free = std::ceil((m_endSegment - m_currentSegment + 1) / static_cast<double>(2));
 
     if (!free) {
         qCDebug(KGET_DEBUG) << "None freed, start:" << m_currentSegment << "end:" << m_endSegment;
 
-        if (m_getJob) {
+        if (m_getJob && !wasSuspended) {
             m_getJob->resume();
         }
         return freed;
@@ -339,12 +517,25 @@ QPair<int, int> Segment::split()
         m_segSize.second = m_segSize.first;
     }
 
-    if (m_getJob) {
+    if (m_getJob && !wasSuspended) {
         m_getJob->resume();
     }
     return freed;
 }
 
+KIO::filesize_t Segment::downloadedBytes(int segment) const
+{
+    if (m_findFilesize || (segment > m_currentSegment)) {
+        return 0;
+    }
+
+    const KIO::fileoffset_t size = (segment == m_endSegment ? m_segSize.second : m_segSize.first);
+    if (segment < m_currentSegment) {
+        return size;
+    }
+    return qMax(size - m_currentSegSize, static_cast<KIO::fileoffset_t>(0));
+}
+
 bool Segment::merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
 {
     if (m_endSegment + 1 == segmentRange.first) {
@@ -357,4 +548,76 @@ bool Segment::merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSi
     return false;
 }
 
+void Segment::queueRange(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    if (m_queuedRanges.isEmpty() && merge(segmentSize, segmentRange)) {
+        qCDebug(KGET_DEBUG) << "Merged" << segmentRange << "into" << assignedSegments();
+        return;
+    }
+
+    // continue the last queued range, so that it is requested at once
+    if (!m_queuedRanges.isEmpty() && (m_queuedRanges.last().segments.second + 1 == segmentRange.first)) {
+        m_queuedRanges.last().segments.second = segmentRange.second;
+        m_queuedRanges.last().segmentSize.second = segmentSize.second;
+        return;
+    }
+
+    Range range;
+    range.segmentSize = segmentSize;
+    range.segments = segmentRange;
+    m_queuedRanges.append(range);
+    qCDebug(KGET_DEBUG) << "Queued" << segmentRange << "after" << assignedSegments();
+}
+
+QList<QPair<int, int>> Segment::queuedSegments() const
+{
+    QList<QPair<int, int>> segments;
+    foreach (const Range &range, m_queuedRanges) {
+        segments.append(range.segments);
+    }
+    return segments;
+}
+
+QList<Segment::Range> Segment::takeQueuedRanges()
+{
+    const QList<Range> ranges = m_queuedRanges;
+    m_queuedRanges.clear();
+    return ranges;
+}
+
+void Segment::checkLookahead()
+{
+    if (m_findFilesize) {
+        return;
+    }
+
+    const int lookahead = MultiSegKioSettings::lookahead();
+    while ((m_currentSegment == m_endSegment) && (m_queuedRanges.count() < lookahead)) {
+        const int queued = m_queuedRanges.count();
+        Q_EMIT lookaheadNeeded(this);
+        if ((m_queuedRanges.count() == queued) && (m_currentSegment == m_endSegment)) {
+            // nothing left to assign
+            break;
+        }
+    }
+}
+
+void Segment::startQueuedRange()
+{
+    const Range range = m_queuedRanges.takeFirst();
+    m_segSize = range.segmentSize;
+    m_currentSegment = range.segments.first;
+    m_endSegment = range.segments.second;
+    m_offset = m_segSize.first * m_currentSegment;
+    m_currentSegSize = (m_currentSegment == m_endSegment ? m_segSize.second : m_segSize.first);
+    m_totalBytesLeft = m_segSize.first * (m_endSegment - m_currentSegment) + m_segSize.second;
+    qCDebug(KGET_DEBUG) << "Continuing" << m_url << "with the queued range" << range.segments;
+
+    // otherwise the job of the previous range is still ending, the next one is started once it did
+    if (!m_getJob && (m_status == Running)) {
+        setStatus(Stopped, false);
+        startTransfer();
+    }
+}
+
 #include "moc_segment.cpp"
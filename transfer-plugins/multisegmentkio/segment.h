@@ -12,17 +12,21 @@
 #ifndef SEGMENT_H
 #define SEGMENT_H
 
+#include <QElapsedTimer>
 #include <QObject>
 
 #include <KIO/Job>
 
 #include "core/transfer.h"
+#include "segmentconnection.h"
+
+class QTimer;
 
 /**
  * class Segment
  */
 
-class Segment : public QObject
+class Segment : public QObject, public SegmentConnection
 {
     Q_OBJECT
 
@@ -38,6 +42,14 @@ public:
      */
     enum Status { Running, Stopped, Killed, Timeout, Finished };
 
+    /**
+     * A range of segments that is downloaded after the current one
+     */
+    struct Range {
+        QPair<KIO::fileoffset_t, KIO::fileoffset_t> segmentSize; ///< as in merge()
+        QPair<int, int> segments;
+    };
+
     Segment(const QUrl &src, const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange, QObject *parent);
 
     ~Segment() override;
@@ -96,13 +108,55 @@ public:
         return m_status;
     } // TODO needed?
 
-    QPair<int, int> assignedSegments() const;
-    QPair<KIO::fileoffset_t, KIO::fileoffset_t> segmentSize() const;
-    int countUnfinishedSegments() const;
-    QPair<int, int> split();
-    bool merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+    QPair<int, int> assignedSegments() const override;
+    QPair<KIO::fileoffset_t, KIO::fileoffset_t> segmentSize() const override;
+    int countUnfinishedSegments() const override;
+    QPair<int, int> split() override;
+
+    /**
+     * @return the number of bytes of segment that have been downloaded and written
+     */
+    KIO::filesize_t downloadedBytes(int segment) const;
+    bool merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) override;
+
+    /**
+     * Adds a range that is downloaded right after the assigned one, so that the connection
+     * does not wait for new segments once it is done
+     * @note a range that continues the assigned one is merged
+     */
+    void queueRange(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+
+    /**
+     * @return the ranges that are downloaded after the assigned one
+     */
+    QList<QPair<int, int>> queuedSegments() const;
+
+    /**
+     * Removes and returns the ranges that are downloaded after the assigned one
+     */
+    QList<Range> takeQueuedRanges();
     bool findingFileSize() const;
 
+    /**
+     * @return the number of bytes received since the segment was created, including
+     * data that has not been written yet
+     */
+    KIO::filesize_t receivedBytes() const
+    {
+        return m_receivedBytes;
+    }
+
+    /**
+     * @return the milliseconds since the last data arrived or the transfer
+     * was started, -1 if it is not running
+     */
+    qint64 msecsSinceData() const;
+
+    /**
+     * Hands on data that was refused, once the receiver accepts data again
+     */
+    void resumeWriting();
+
 public Q_SLOTS:
     /**
      * start the segment transfer
@@ -126,10 +180,28 @@ Q_SIGNALS:
     void speed(ulong speed);
     void connectionProblem();
     void totalSize(KIO::filesize_t size, QPair<int, int> segmentRange);
+    void segmentSizeNeeded(KIO::filesize_t size, KIO::fileoffset_t &segmentSize);
     void finishedDownload(KIO::filesize_t size);
     void canResume();
     void urlChanged(const QUrl &newUrl);
 
+    /**
+     * Emitted when the last segment of the range is started and fewer ranges than
+     * configured are queued, the receiver should call queueRange() right away
+     */
+    void lookaheadNeeded(Segment *segment);
+
+    /**
+     * Emitted once per request with the validators the server sent for the file,
+     * empty if it sent none
+     */
+    void validators(const QString &etag, const QString &lastModified);
+
+    /**
+     * Emitted once the first data of a request arrived, msecs after it was started
+     */
+    void timeToFirstByte(qint64 msecs);
+
 private Q_SLOTS:
     void slotData(KIO::Job *job, const QByteArray &data);
     void slotCanResume(KIO::Job *job, KIO::filesize_t); // TODO remove
@@ -137,32 +209,60 @@ private Q_SLOTS:
 
     /**
      * Writes the buffer, assuming that this segment is finished and the rest should be written.
-     * Tries to write and if that fails waits for 50 msec and retries again.
-     * If this whole process still fails after 100 times, then error is emitted.
+     * Tries to write and if that fails waits for 50 msec or resumeWriting() and retries again.
+     * The receiver refuses data only as long as it can not take it, e.g. while the disk is busy,
+     * a failed write is reported by the receiver itself.
      */
     void slotWriteRest();
 
     void slotRedirection(KIO::Job *, const QUrl &);
 
+    /**
+     * Starts the transfer once the queued request for a connection got through
+     */
+    void slotConnectionAcquired();
+
 private:
     bool writeBuffer();
     void setStatus(Status stat, bool doEmit = true);
 
+    /**
+     * Reads the ETag and Last-Modified header of the response
+     */
+    void checkValidators();
+
+    /**
+     * Requests more ranges if the connection is about to run out of segments
+     */
+    void checkLookahead();
+
+    /**
+     * Continues with the first queued range
+     */
+    void startQueuedRange();
+
 private:
     bool m_findFilesize;
     bool m_canResume;
+    bool m_validatorsChecked;
+    bool m_waitingForConnection;
     Status m_status;
     int m_currentSegment;
     int m_endSegment;
-    int m_errorCount;
     KIO::fileoffset_t m_offset;
     KIO::fileoffset_t m_currentSegSize;
     KIO::filesize_t m_bytesWritten;
     KIO::filesize_t m_totalBytesLeft;
+    KIO::filesize_t m_receivedBytes;
+    KIO::fileoffset_t m_requestEnd; ///< the last byte requested by m_getJob, -1 if open ended
     KIO::TransferJob *m_getJob;
+    QTimer *m_writeRetry;
     QUrl m_url;
     QByteArray m_buffer;
     QPair<KIO::fileoffset_t, KIO::fileoffset_t> m_segSize;
+    QList<Range> m_queuedRanges;
+    QElapsedTimer m_lastData;
+    QElapsedTimer m_requestTimer; ///< valid while waiting for the first data of a request
 };
 
 #endif // SEGMENT_H
@@ -0,0 +1,45 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_SEGMENTCONNECTION_H
+#define KGET_SEGMENTCONNECTION_H
+
+#include <QPair>
+
+#include <kio/global.h>
+
+/**
+ * A connection that downloads a range of segments, as Segment does with KIO and
+ * HttpConnection with an own socket. SegmentedDataSource distributes the segments
+ * of its connections with it.
+ */
+class SegmentConnection
+{
+public:
+    virtual ~SegmentConnection()
+    {
+    }
+
+    virtual QPair<int, int> assignedSegments() const = 0;
+    virtual QPair<KIO::fileoffset_t, KIO::fileoffset_t> segmentSize() const = 0;
+    virtual int countUnfinishedSegments() const = 0;
+
+    /**
+     * Removes part of the unfinished segments, so that another connection can download them
+     * @return the removed segments, (-1, -1) if nothing was removed
+     */
+    virtual QPair<int, int> split() = 0;
+
+    /**
+     * Adds segmentRange if it continues the assigned segments
+     * @return true if it got added
+     */
+    virtual bool merge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange) = 0;
+};
+
+#endif
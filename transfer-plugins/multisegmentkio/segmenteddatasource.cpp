@@ -0,0 +1,175 @@
+/* This file is part of the KDE project
+
+   Copyright (C) 2008 Manolo Valdes <nolis71cu@gmail.com>
+   Copyright (C) 2009 Matthias Fuchs <mat69@gmx.net>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#include "segmenteddatasource.h"
+#include "segmentconnection.h"
+
+#include "kget_debug.h"
+#include <QDebug>
+
+SegmentedDataSource::SegmentedDataSource(const QUrl &srcUrl, QObject *parent)
+    : TransferDataSource(srcUrl, parent)
+    , m_size(0)
+    , m_canResume(false)
+    , m_started(false)
+{
+    setCapabilities(capabilities() | Transfer::Cap_FindFilesize);
+}
+
+SegmentedDataSource::~SegmentedDataSource()
+{
+}
+
+void SegmentedDataSource::setSupposedSize(KIO::filesize_t supposedSize)
+{
+    m_supposedSize = supposedSize;
+
+    // check if the size is correct
+    slotTotalSize(m_size);
+}
+
+void SegmentedDataSource::slotTotalSize(KIO::filesize_t size, const QPair<int, int> &range)
+{
+    qCDebug(KGET_DEBUG) << "Size found for" << m_sourceUrl << size << "bytes";
+
+    m_size = size;
+
+    // findFileSize was called
+    if ((range.first != -1) && (range.second != -1)) {
+        Q_EMIT foundFileSize(this, size, range);
+    }
+
+    // the filesize is not what it should be, maybe using a wrong mirror
+    if (m_size && m_supposedSize && (m_size != m_supposedSize)) {
+        qCDebug(KGET_DEBUG) << "Size does not match for" << m_sourceUrl << this;
+        Q_EMIT broken(this, WrongDownloadSize);
+    }
+}
+
+void SegmentedDataSource::slotCanResume()
+{
+    qCDebug(KGET_DEBUG) << this;
+
+    if (!m_canResume) {
+        m_canResume = true;
+        setCapabilities(capabilities() | Transfer::Cap_Resuming);
+    }
+}
+
+void SegmentedDataSource::slotFinishedDownload(KIO::filesize_t size)
+{
+    stop();
+    Q_EMIT finishedDownload(this, size);
+}
+
+void SegmentedDataSource::slotUrlChanged(const QUrl &url)
+{
+    if (m_sourceUrl != url) {
+        Q_EMIT urlChanged(m_sourceUrl, url);
+        m_sourceUrl = url;
+    }
+}
+
+void SegmentedDataSource::slotValidators(const QString &etag, const QString &lastModified)
+{
+    Q_EMIT validators(this, etag, lastModified);
+}
+
+void SegmentedDataSource::slotTimeToFirstByte(qint64 msecs)
+{
+    Q_EMIT timeToFirstByte(this, msecs);
+}
+
+SegmentConnection *SegmentedDataSource::mostUnfinishedSegments(int *unfin) const
+{
+    int unfinished = 0;
+    SegmentConnection *con = nullptr;
+    foreach (SegmentConnection *connection, connections()) {
+        if (connection->countUnfinishedSegments() > unfinished) {
+            unfinished = connection->countUnfinishedSegments();
+            con = connection;
+        }
+    }
+
+    if (unfin) {
+        *unfin = unfinished;
+    }
+
+    return con;
+}
+
+int SegmentedDataSource::countUnfinishedSegments() const
+{
+    int unfinished = 0;
+    mostUnfinishedSegments(&unfinished);
+
+    return unfinished;
+}
+
+QPair<int, int> SegmentedDataSource::split()
+{
+    QPair<int, int> unassigned = qMakePair(-1, -1);
+    SegmentConnection *connection = mostUnfinishedSegments();
+    if (connection) {
+        unassigned = connection->split();
+    }
+
+    return unassigned;
+}
+
+QPair<int, int> SegmentedDataSource::removeConnection()
+{
+    QPair<int, int> unassigned = qMakePair(-1, -1);
+    SegmentConnection *connection = mostUnfinishedSegments();
+    if (connection) {
+        unassigned = connection->assignedSegments();
+        discardConnection(connection);
+    }
+
+    return unassigned;
+}
+
+bool SegmentedDataSource::tryMerge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange)
+{
+    foreach (SegmentConnection *connection, connections()) {
+        if (connection->merge(segmentSize, segmentRange)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SegmentedDataSource::handleError(SegmentConnection *connection, const QString &errorText, Transfer::LogLevel logLevel)
+{
+    qCDebug(KGET_DEBUG) << "Error" << errorText << "connection" << connection;
+
+    const QPair<KIO::fileoffset_t, KIO::fileoffset_t> size = connection->segmentSize();
+    const QPair<int, int> range = connection->assignedSegments();
+    discardConnection(connection);
+
+    Q_EMIT log(errorText, logLevel);
+    if (connections().isEmpty()) {
+        qCDebug(KGET_DEBUG) << this << "has broken segments.";
+        Q_EMIT brokenSegments(this, range);
+    } else {
+        // decrease the number of maximum parallel downloads, maybe the server does not support so many connections
+        if (m_parallelSegments > 1) {
+            --m_parallelSegments;
+        }
+        qCDebug(KGET_DEBUG) << this << "reducing connections to" << m_parallelSegments << "and freeing range of segments" << range;
+        if (!tryMerge(size, range)) {
+            Q_EMIT freeSegments(this, range, true);
+        }
+    }
+}
+
+#include "moc_segmenteddatasource.cpp"
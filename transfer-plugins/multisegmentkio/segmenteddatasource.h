@@ -0,0 +1,73 @@
+/* This file is part of the KDE project
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+*/
+
+#ifndef KGET_SEGMENTEDDATASOURCE_H
+#define KGET_SEGMENTEDDATASOURCE_H
+
+#include "core/transferdatasource.h"
+
+class SegmentConnection;
+
+/**
+ * Base of the data sources that download their segments with several connections,
+ * it handles the segments of the connections and what they report about the file.
+ *
+ * Subclasses connect the signals of their connections to the slots and report
+ * errors with handleError().
+ */
+class SegmentedDataSource : public TransferDataSource
+{
+    Q_OBJECT
+
+public:
+    SegmentedDataSource(const QUrl &srcUrl, QObject *parent);
+    ~SegmentedDataSource() override;
+
+    QPair<int, int> removeConnection() override;
+    int countUnfinishedSegments() const override;
+    QPair<int, int> split() override;
+    void setSupposedSize(KIO::filesize_t supposedSize) override;
+
+protected Q_SLOTS:
+    /**
+     * Checks if the size reported by the mirror is correct
+     */
+    void slotTotalSize(KIO::filesize_t size, const QPair<int, int> &range = qMakePair(-1, -1));
+    void slotCanResume();
+    void slotFinishedDownload(KIO::filesize_t size);
+    void slotUrlChanged(const QUrl &url);
+    void slotValidators(const QString &etag, const QString &lastModified);
+    void slotTimeToFirstByte(qint64 msecs);
+
+protected:
+    /**
+     * @return the connections that download the assigned segments
+     */
+    virtual QList<SegmentConnection *> connections() const = 0;
+
+    /**
+     * Removes connection and deletes it later, its segments are not freed
+     */
+    virtual void discardConnection(SegmentConnection *connection) = 0;
+
+    /**
+     * There was an error while downloading with connection, it is discarded and the number
+     * of connections this TransferDataSource uses simultaneously gets reduced
+     */
+    void handleError(SegmentConnection *connection, const QString &errorText, Transfer::LogLevel logLevel);
+
+    SegmentConnection *mostUnfinishedSegments(int *unfinished = nullptr) const;
+    bool tryMerge(const QPair<KIO::fileoffset_t, KIO::fileoffset_t> &segmentSize, const QPair<int, int> &segmentRange);
+
+protected:
+    KIO::filesize_t m_size;
+    bool m_canResume;
+    bool m_started;
+};
+
+#endif
@@ -61,6 +61,7 @@ void TransferMultiSegKio::init()
         connect(m_dataSourceFactory, &DataSourceFactory::dataSourceFactoryChange, this, &TransferMultiSegKio::slotDataSourceFactoryChange);
         connect(m_dataSourceFactory->verifier(), &Verifier::verified, this, &TransferMultiSegKio::slotVerified);
         connect(m_dataSourceFactory, &DataSourceFactory::log, this, &Transfer::setLog);
+        connect(m_dataSourceFactory, &DataSourceFactory::storageError, this, &TransferMultiSegKio::slotStorageError);
 
         m_dataSourceFactory->addMirror(m_source, MultiSegKioSettings::segments());
 
@@ -245,6 +246,12 @@ void TransferMultiSegKio::slotDataSourceFactoryChange(Transfer::ChangesFlags cha
     setTransferChange(change, true);
 }
 
+void TransferMultiSegKio::slotStorageError(const QString &errorText)
+{
+    setError(errorText, "dialog-cancel", Job::NotSolveable);
+    setTransferChange(Tc_Status, true);
+}
+
 void TransferMultiSegKio::slotVerified(bool isVerified)
 {
     if (m_fileModel) {
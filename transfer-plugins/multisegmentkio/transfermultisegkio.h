@@ -84,6 +84,7 @@ private Q_SLOTS:
     void slotSearchUrls(const QList<QUrl> &urls);
     void slotRename(const QUrl &oldUrl, const QUrl &newUrl);
     void slotVerified(bool isVerified);
+    void slotStorageError(const QString &errorText);
     void slotStatResult(KJob *kioJob);
 
 private:
@@ -13,6 +13,10 @@
 
 #include "core/scheduler.h"
 #include "core/transfergroup.h"
+#ifdef HAVE_NGHTTP2
+#include "http2datasource.h"
+#endif
+#include "httpdatasource.h"
 #include "multisegkiodatasource.h"
 #include "multisegkiosettings.h"
 #include "transfermultisegkio.h"
@@ -71,6 +75,16 @@ TransferDataSource *TransferMultiSegKioFactory::createTransferDataSource(const Q
     }
 
     if (isSupported(srcUrl)) {
+        // KIO stays in use for everything that is not plain http(s)
+        if (MultiSegKioSettings::nativeHttp() && HttpDataSource::isSupported(srcUrl)) {
+#ifdef HAVE_NGHTTP2
+            // HTTP/2 is only negotiated for https
+            if (MultiSegKioSettings::http2() && (srcUrl.scheme() == QLatin1String("https"))) {
+                return new Http2DataSource(srcUrl, parent);
+            }
+#endif
+            return new HttpDataSource(srcUrl, parent);
+        }
         return new MultiSegKioDataSource(srcUrl, parent);
     }
     return nullptr;
@@ -92,5 +106,11 @@ QStringList TransferMultiSegKioFactory::addsProtocols() const
     return protocols;
 }
 
+void TransferMultiSegKioFactory::settingsChanged()
+{
+    // the settings dialog saves them with its own instance
+    MultiSegKioSettings::self()->load();
+}
+
 #include "moc_transfermultisegkiofactory.cpp"
 #include "transfermultisegkiofactory.moc"
@@ -34,6 +34,7 @@ public:
     TransferDataSource *createTransferDataSource(const QUrl &srcUrl, const QDomElement &type, QObject *parent) override;
     bool isSupported(const QUrl &url) const override;
     QStringList addsProtocols() const override;
+    void settingsChanged() override;
 };
 
 #endif
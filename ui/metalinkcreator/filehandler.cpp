@@ -91,31 +91,26 @@ void FileHandlerThread::run()
                 file.resources.urls.append(mirror);
             }
 
-            foreach (const QString &type, types) {
-                if (abort) {
-                    return;
-                }
+            // the file is only read once for all checksums
+            QHash<QString, PartialChecksums> partialChecksums;
+            const QHash<QString, QString> hashes = Verifier::checksums(url, types, createPartial ? types : QStringList(), &partialChecksums, 0, &abort);
+            if (abort) {
+                return;
+            }
 
-                const QString hash = Verifier::checksum(url, type, &abort);
+            foreach (const QString &type, types) {
+                const QString hash = hashes.value(type);
                 if (!hash.isEmpty()) {
                     file.verification.hashes[type] = hash;
                 }
-            }
-
-            if (createPartial) {
-                foreach (const QString &type, types) {
-                    if (abort) {
-                        return;
-                    }
 
-                    const PartialChecksums partialChecksums = Verifier::partialChecksums(url, type, 0, &abort);
-                    if (partialChecksums.isValid()) {
-                        KGetMetalink::Pieces pieces;
-                        pieces.type = type;
-                        pieces.length = partialChecksums.length();
-                        pieces.hashes = partialChecksums.checksums();
-                        file.verification.pieces.append(pieces);
-                    }
+                const PartialChecksums partial = partialChecksums.value(type);
+                if (partial.isValid()) {
+                    KGetMetalink::Pieces pieces;
+                    pieces.type = type;
+                    pieces.length = partial.length();
+                    pieces.hashes = partial.checksums();
+                    file.verification.pieces.append(pieces);
                 }
             }
             if (!abort) {